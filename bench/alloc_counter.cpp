@@ -0,0 +1,103 @@
+﻿#include "bench.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <malloc.h>
+#include <new>
+
+// ベンチマークの実行ファイルだけでグローバルのoperator new/deleteを置き換え、ヒープへの確保を数える
+// サイズ付きとnothrowのdeleteは既定の実装がここのdeleteを呼ぶので置き換えない
+namespace {
+	std::atomic<uint64_t> allocations = 0;
+	std::atomic<uint64_t> allocated_bytes = 0;
+
+	void* counted_alloc(size_t _size) noexcept
+	{
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		allocated_bytes.fetch_add(_size, std::memory_order_relaxed);
+		return std::malloc(_size == 0 ? 1 : _size);
+	}
+
+	void* counted_aligned_alloc(size_t _size, std::align_val_t _align) noexcept
+	{
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		allocated_bytes.fetch_add(_size, std::memory_order_relaxed);
+		return ::_aligned_malloc(_size == 0 ? 1 : _size, static_cast<size_t>(_align));
+	}
+}
+
+namespace bench {
+
+	heap_counts_t heap_counts() noexcept
+	{
+		return { allocations.load(std::memory_order_relaxed), allocated_bytes.load(std::memory_order_relaxed) };
+	}
+}
+
+void* operator new(size_t _size)
+{
+	void* p = counted_alloc(_size);
+	if (p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t _size)
+{
+	void* p = counted_alloc(_size);
+	if (p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new(size_t _size, const std::nothrow_t&) noexcept
+{
+	return counted_alloc(_size);
+}
+
+void* operator new[](size_t _size, const std::nothrow_t&) noexcept
+{
+	return counted_alloc(_size);
+}
+
+void* operator new(size_t _size, std::align_val_t _align)
+{
+	void* p = counted_aligned_alloc(_size, _align);
+	if (p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t _size, std::align_val_t _align)
+{
+	void* p = counted_aligned_alloc(_size, _align);
+	if (p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new(size_t _size, std::align_val_t _align, const std::nothrow_t&) noexcept
+{
+	return counted_aligned_alloc(_size, _align);
+}
+
+void* operator new[](size_t _size, std::align_val_t _align, const std::nothrow_t&) noexcept
+{
+	return counted_aligned_alloc(_size, _align);
+}
+
+void operator delete(void* _p) noexcept
+{
+	std::free(_p);
+}
+
+void operator delete[](void* _p) noexcept
+{
+	std::free(_p);
+}
+
+void operator delete(void* _p, std::align_val_t) noexcept
+{
+	::_aligned_free(_p);
+}
+
+void operator delete[](void* _p, std::align_val_t) noexcept
+{
+	::_aligned_free(_p);
+}
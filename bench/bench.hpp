@@ -0,0 +1,104 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include "http_config.hpp"
+#include "http_thread.hpp"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace bench {
+
+	// 引数は --name=value の形。無ければ_def
+	using args_t = std::vector<std::string>;
+	std::string option(const args_t& _args, std::string_view _name, std::string_view _def);
+	uint64_t option_uint(const args_t& _args, std::string_view _name, uint64_t _def);
+
+	int64_t now() noexcept;
+	double to_usec(int64_t _ticks) noexcept;
+
+	struct summary_t {
+		size_t count;
+		double p50;
+		double p90;
+		double p99;
+		double p999;
+		double max;
+	};
+
+	// _valuesは並べ替える
+	summary_t summarize(std::vector<double>& _values);
+	void print(const char* _name, const char* _variant, const summary_t& _summary, const char* _unit);
+
+	// グローバルのoperator newを通ったヒープへの確保。ベンチマークの実行ファイルではoperator newを置き換えて数える
+	struct heap_counts_t {
+		uint64_t allocations;
+		uint64_t bytes;
+	};
+	heap_counts_t heap_counts() noexcept;
+
+	// 実行ファイルの隣のhtdocs。サーバーと同じ場所
+	std::wstring htdocs();
+	bool write_file(const std::wstring& _path, uint64_t _size, char _fill);
+	void remove_tree(const std::wstring& _path);
+
+	// 同じプロセスでサーバーのスレッドを動かす
+	class server_instance
+	{
+	private:
+		app::http_thread thread_;
+		uint16_t port_;
+		bool running_;
+
+	public:
+		server_instance();
+		~server_instance();
+
+		// コピー不可
+		server_instance(const server_instance&) = delete;
+		server_instance& operator = (const server_instance&) = delete;
+		// ムーブ不可
+		server_instance(server_instance&&) = delete;
+		server_instance& operator = (server_instance&&) = delete;
+
+		// 接続できるようになるまで待つ
+		bool start(const app::http_config_t& _config);
+		void stop();
+	};
+
+	// ブロッキングソケットの最小限のHTTP/1.1クライアント
+	class http_client
+	{
+	private:
+		SOCKET sock_;
+		std::vector<char> buf_;
+
+	public:
+		http_client();
+		~http_client();
+
+		// コピー不可
+		http_client(const http_client&) = delete;
+		http_client& operator = (const http_client&) = delete;
+		// ムーブ不可
+		http_client(http_client&&) = delete;
+		http_client& operator = (http_client&&) = delete;
+
+		bool connect(uint16_t _port);
+		void close();
+		bool is_connected() const noexcept;
+
+		// 応答のボディのバイト数を返す。失敗したら-1。_ttfbには送信から最初の1バイトまでの時間(QPC)
+		int64_t get(std::string_view _path, bool _keepalive, int64_t* _ttfb = nullptr);
+	};
+
+	int direct_io(const args_t& _args);
+	int policy(const args_t& _args);
+	int coroutine(const args_t& _args);
+	int socket_profile(const args_t& _args);
+	int parser(const args_t& _args);
+	int parser_check(const args_t& _args);
+}
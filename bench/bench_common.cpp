@@ -0,0 +1,296 @@
+﻿#include "bench.hpp"
+
+#include "log.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+
+#include <Ws2tcpip.h>
+
+#pragma comment(lib, "Ws2_32.lib")
+
+namespace bench {
+
+	std::string option(const args_t& _args, std::string_view _name, std::string_view _def)
+	{
+		for (const auto& x : _args)
+		{
+			std::string_view arg(x);
+			if (arg.size() > _name.size() + 3 && arg.starts_with("--") && arg.substr(2, _name.size()) == _name && arg.at(_name.size() + 2) == '=')
+			{
+				return std::string(arg.substr(_name.size() + 3));
+			}
+		}
+		return std::string(_def);
+	}
+
+	uint64_t option_uint(const args_t& _args, std::string_view _name, uint64_t _def)
+	{
+		auto value = option(_args, _name, "");
+		uint64_t r = _def;
+		std::from_chars(value.data(), value.data() + value.size(), r);
+		return r;
+	}
+
+	int64_t now() noexcept
+	{
+		LARGE_INTEGER t;
+		::QueryPerformanceCounter(&t);
+		return t.QuadPart;
+	}
+
+	double to_usec(int64_t _ticks) noexcept
+	{
+		static const int64_t freq = [] {
+			LARGE_INTEGER f;
+			::QueryPerformanceFrequency(&f);
+			return f.QuadPart;
+		}();
+		return static_cast<double>(_ticks) * 1000000.0 / static_cast<double>(freq);
+	}
+
+	summary_t summarize(std::vector<double>& _values)
+	{
+		summary_t r = {};
+		if (_values.empty()) return r;
+
+		std::sort(_values.begin(), _values.end());
+		auto at = [&](double _q) {
+			return _values.at(std::min(_values.size() - 1, static_cast<size_t>(_q * _values.size())));
+		};
+		r.count = _values.size();
+		r.p50 = at(0.5);
+		r.p90 = at(0.9);
+		r.p99 = at(0.99);
+		r.p999 = at(0.999);
+		r.max = _values.back();
+		return r;
+	}
+
+	void print(const char* _name, const char* _variant, const summary_t& _summary, const char* _unit)
+	{
+		std::printf("%-12s %-16s count=%-8llu p50=%.2f%s p90=%.2f%s p99=%.2f%s p999=%.2f%s max=%.2f%s\n",
+			_name, _variant, static_cast<unsigned long long>(_summary.count),
+			_summary.p50, _unit, _summary.p90, _unit, _summary.p99, _unit, _summary.p999, _unit, _summary.max, _unit);
+	}
+
+	std::wstring htdocs()
+	{
+		std::vector<WCHAR> buf(32767, L'\0');
+		auto loaded = ::GetModuleFileNameW(::GetModuleHandleW(nullptr), buf.data(), static_cast<DWORD>(buf.size()));
+		std::wstring r(buf.data(), loaded);
+		auto pos = r.find_last_of(L'\\');
+		if (pos != std::wstring::npos) r.resize(pos);
+		return r + L"\\htdocs";
+	}
+
+	bool write_file(const std::wstring& _path, uint64_t _size, char _fill)
+	{
+		// 途中のフォルダも作る
+		for (size_t pos = _path.find(L'\\', 3); pos != std::wstring::npos; pos = _path.find(L'\\', pos + 1))
+		{
+			::CreateDirectoryW(_path.substr(0, pos).c_str(), NULL);
+		}
+
+		HANDLE file = ::CreateFileW(_path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) return false;
+
+		std::vector<char> chunk(1024 * 1024, _fill);
+		bool ok = true;
+		while (ok && _size > 0)
+		{
+			DWORD length = static_cast<DWORD>(std::min<uint64_t>(_size, chunk.size()));
+			DWORD written = 0;
+			ok = ::WriteFile(file, chunk.data(), length, &written, NULL) && written == length;
+			_size -= length;
+		}
+		::CloseHandle(file);
+		return ok;
+	}
+
+	void remove_tree(const std::wstring& _path)
+	{
+		WIN32_FIND_DATAW data;
+		HANDLE find = ::FindFirstFileW((_path + L"\\*").c_str(), &data);
+		if (find != INVALID_HANDLE_VALUE)
+		{
+			do {
+				std::wstring name = data.cFileName;
+				if (name == L"." || name == L"..") continue;
+				auto child = _path + L"\\" + name;
+				if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+				{
+					remove_tree(child);
+				}
+				else
+				{
+					::DeleteFileW(child.c_str());
+				}
+			} while (::FindNextFileW(find, &data));
+			::FindClose(find);
+		}
+		::RemoveDirectoryW(_path.c_str());
+	}
+
+	server_instance::server_instance()
+		: thread_()
+		, port_(0)
+		, running_(false)
+	{
+	}
+
+	server_instance::~server_instance()
+	{
+		stop();
+	}
+
+	bool server_instance::start(const app::http_config_t& _config)
+	{
+		stop();
+		port_ = _config.port;
+		if (!thread_.run(NULL, _config)) return false;
+		running_ = true;
+
+		// リスンするまで待つ
+		for (int i = 0; i < 100; ++i)
+		{
+			http_client client;
+			if (client.connect(port_)) return true;
+			::Sleep(50);
+		}
+		stop();
+		return false;
+	}
+
+	void server_instance::stop()
+	{
+		if (!running_) return;
+		thread_.stop();
+		running_ = false;
+
+		// サーバーのログは使わないので捨てる
+		app::log_read();
+	}
+
+	http_client::http_client()
+		: sock_(INVALID_SOCKET)
+		, buf_(64 * 1024)
+	{
+	}
+
+	http_client::~http_client()
+	{
+		close();
+	}
+
+	bool http_client::connect(uint16_t _port)
+	{
+		close();
+		sock_ = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (sock_ == INVALID_SOCKET) return false;
+
+		BOOL enable = TRUE;
+		::setsockopt(sock_, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&enable), sizeof(enable));
+
+		SOCKADDR_IN addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = ::htons(_port);
+		::inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+		if (::connect(sock_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0)
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void http_client::close()
+	{
+		if (sock_ != INVALID_SOCKET)
+		{
+			::closesocket(sock_);
+			sock_ = INVALID_SOCKET;
+		}
+	}
+
+	bool http_client::is_connected() const noexcept
+	{
+		return sock_ != INVALID_SOCKET;
+	}
+
+	int64_t http_client::get(std::string_view _path, bool _keepalive, int64_t* _ttfb)
+	{
+		if (sock_ == INVALID_SOCKET) return -1;
+
+		std::string request = "GET ";
+		request.append(_path).append(" HTTP/1.1\r\nHost: localhost\r\n");
+		if (!_keepalive) request.append("Connection: close\r\n");
+		request.append("\r\n");
+
+		auto start = now();
+		if (::send(sock_, request.data(), static_cast<int>(request.size()), 0) != static_cast<int>(request.size()))
+		{
+			close();
+			return -1;
+		}
+
+		// ヘッダの終わりまで読む
+		std::string head;
+		size_t end = std::string::npos;
+		bool first = true;
+		while (end == std::string::npos)
+		{
+			auto n = ::recv(sock_, buf_.data(), static_cast<int>(buf_.size()), 0);
+			if (n <= 0)
+			{
+				close();
+				return -1;
+			}
+			if (first && _ttfb != nullptr) *_ttfb = now() - start;
+			first = false;
+			head.append(buf_.data(), n);
+			end = head.find("\r\n\r\n");
+		}
+
+		// 103 Early Hintsは読み飛ばす
+		while (head.starts_with("HTTP/1.1 1"))
+		{
+			head.erase(0, end + 4);
+			end = head.find("\r\n\r\n");
+			while (end == std::string::npos)
+			{
+				auto n = ::recv(sock_, buf_.data(), static_cast<int>(buf_.size()), 0);
+				if (n <= 0)
+				{
+					close();
+					return -1;
+				}
+				head.append(buf_.data(), n);
+				end = head.find("\r\n\r\n");
+			}
+		}
+
+		uint64_t length = 0;
+		auto pos = head.find("Content-Length: ");
+		if (pos != std::string::npos && pos < end)
+		{
+			std::from_chars(head.data() + pos + 16, head.data() + end, length);
+		}
+
+		uint64_t received = head.size() - (end + 4);
+		while (received < length)
+		{
+			auto n = ::recv(sock_, buf_.data(), static_cast<int>(std::min<uint64_t>(buf_.size(), length - received)), 0);
+			if (n <= 0)
+			{
+				close();
+				return -1;
+			}
+			received += n;
+		}
+
+		if (!_keepalive) close();
+		return static_cast<int64_t>(length);
+	}
+}
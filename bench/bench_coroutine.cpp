@@ -0,0 +1,71 @@
+﻿#include "bench.hpp"
+#include "loopback_bench.hpp"
+
+#include "early_hints.hpp"
+#include "frame_pool.hpp"
+#include "not_found_cache.hpp"
+
+#include <cstdio>
+#include <string>
+
+// 接続ごとのコルーチンと、完了ごとにフラグで分岐する状態機械(minimal_handler)の比較
+// どちらも機能を外した状態で、本文の大きさを変えて1リクエストあたりの時間とコルーチンフレームの確保を見る
+namespace bench {
+
+	namespace {
+		const std::wstring HTDOCS = L"htdocs";
+	}
+
+	int coroutine(const args_t& _args)
+	{
+		loopback_options_t opt = {
+			option_uint(_args, "rounds", 100),
+			option_uint(_args, "conns", 64),
+			option_uint(_args, "requests", 8),
+			option_uint(_args, "files", 16),
+			0,
+		};
+		app::early_hints hints({}, HTDOCS, false);
+
+		// 1回の読込(64KB)に収まるもの、先読みの枠を何周かするもの
+		for (uint64_t body : { option_uint(_args, "small", 1024), option_uint(_args, "large", 1024 * 1024) })
+		{
+			opt.body = body;
+			auto variant = std::to_string(body / 1024) + "KB";
+
+			loopback_result_t coroutine_result;
+			loopback_result_t state_result;
+			app::frame_pool_stats_t before = app::frame_pool::current().stats();
+			{
+				app::loopback_backend io(opt.conns);
+				add_files(io, HTDOCS, opt);
+				app::null_not_found_cache cache(0);
+				app::loopback_bare_http_handler handler(io, cache, hints, HTDOCS);
+				if (!run_loopback(io, handler, opt, coroutine_result))
+				{
+					std::printf("coroutine: handler returned an unexpected response\n");
+					return 1;
+				}
+			}
+			app::frame_pool_stats_t after = app::frame_pool::current().stats();
+			{
+				app::loopback_backend io(opt.conns);
+				add_files(io, HTDOCS, opt);
+				minimal_handler handler(io, HTDOCS);
+				if (!run_loopback(io, handler, opt, state_result))
+				{
+					std::printf("coroutine: state machine returned an unexpected response\n");
+					return 1;
+				}
+			}
+
+			print("coroutine", (variant + " coroutine").c_str(), summarize(coroutine_result.ns_per_request), "ns");
+			print("coroutine", (variant + " state").c_str(), summarize(state_result.ns_per_request), "ns");
+
+			// 接続ごとに1フレーム。プールから出した数のうち、ヒープから取ったもの
+			std::printf("%-12s %-16s frames=%llu heap=%llu\n", "coroutine", (variant + " frames").c_str(),
+				(after.allocated - before.allocated) + (after.reused - before.reused), after.allocated - before.allocated);
+		}
+		return 0;
+	}
+}
@@ -0,0 +1,126 @@
+﻿#include "bench.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// 大きなファイルを流している間の、キャッシュに載っている小さなファイルの応答時間
+// 大きなファイルがページキャッシュを押し流すと小さなファイルの読込がディスクまで行くようになる
+// --large_mbは搭載メモリより大きくしないと差が出にくい
+namespace bench {
+
+	namespace {
+		struct direct_io_result_t {
+			summary_t small;
+			double large_mbps;
+			uint64_t errors;
+		};
+
+		bool run_pass(const args_t& _args, uint32_t _threshold_mb, direct_io_result_t& _result)
+		{
+			auto port = static_cast<uint16_t>(option_uint(_args, "port", 20182));
+			auto small_count = option_uint(_args, "small", 2000);
+			auto downloads = option_uint(_args, "downloads", 4);
+			auto seconds = option_uint(_args, "seconds", 20);
+
+			app::http_config_t config;
+			config.port = port;
+			config.maxconn = static_cast<uint16_t>(downloads + 8);
+			config.direct_io_threshold = _threshold_mb;
+			config.metrics_path = "none";
+			server_instance server;
+			if (!server.start(config))
+			{
+				std::printf("direct_io: server did not start on port %u\n", port);
+				return false;
+			}
+
+			// 小さなファイルを一通り読んでキャッシュに載せる
+			http_client client;
+			for (uint64_t i = 0; i < small_count; ++i)
+			{
+				if (!client.is_connected() && !client.connect(port)) return false;
+				client.get("/__bench/small/" + std::to_string(i) + ".bin", true);
+			}
+
+			std::atomic<bool> stop = false;
+			std::atomic<uint64_t> large_bytes = 0;
+			std::atomic<uint64_t> errors = 0;
+			std::vector<std::thread> threads;
+			for (uint64_t i = 0; i < downloads; ++i)
+			{
+				threads.emplace_back([&] {
+					http_client large;
+					while (!stop)
+					{
+						if (!large.is_connected() && !large.connect(port)) break;
+						auto n = large.get("/__bench/large.bin", true);
+						if (n < 0) errors++;
+						else large_bytes += n;
+					}
+				});
+			}
+
+			std::mt19937 rng(1);
+			std::uniform_int_distribution<uint64_t> pick(0, small_count - 1);
+			std::vector<double> latencies;
+			auto start = now();
+			while (to_usec(now() - start) < seconds * 1000000.0)
+			{
+				if (!client.is_connected() && !client.connect(port)) break;
+				auto t = now();
+				if (client.get("/__bench/small/" + std::to_string(pick(rng)) + ".bin", true) < 0)
+				{
+					errors++;
+					continue;
+				}
+				latencies.push_back(to_usec(now() - t));
+			}
+			auto elapsed = to_usec(now() - start);
+
+			stop = true;
+			server.stop();
+			for (auto& x : threads) x.join();
+
+			_result.small = summarize(latencies);
+			_result.large_mbps = static_cast<double>(large_bytes) / elapsed;
+			_result.errors = errors;
+			return true;
+		}
+	}
+
+	int direct_io(const args_t& _args)
+	{
+		auto small_count = option_uint(_args, "small", 2000);
+		auto small_kb = option_uint(_args, "small_kb", 16);
+		auto large_mb = option_uint(_args, "large_mb", 4096);
+		auto threshold_mb = static_cast<uint32_t>(option_uint(_args, "threshold_mb", 64));
+
+		auto root = htdocs() + L"\\__bench";
+		std::printf("direct_io: writing %llu x %lluKB and %lluMB under %ls\n", small_count, small_kb, large_mb, root.c_str());
+		for (uint64_t i = 0; i < small_count; ++i)
+		{
+			if (!write_file(root + L"\\small\\" + std::to_wstring(i) + L".bin", small_kb * 1024, 's')) return 1;
+		}
+		if (!write_file(root + L"\\large.bin", large_mb * 1024 * 1024, 'l')) return 1;
+
+		int rc = 0;
+		for (uint32_t threshold : { 0u, threshold_mb })
+		{
+			direct_io_result_t result = {};
+			if (!run_pass(_args, threshold, result))
+			{
+				rc = 1;
+				break;
+			}
+			print("direct_io", threshold == 0 ? "buffered" : "direct", result.small, "us");
+			std::printf("%-12s %-16s large=%.1fMB/s errors=%llu\n", "direct_io", threshold == 0 ? "buffered" : "direct", result.large_mbps, result.errors);
+		}
+
+		remove_tree(root);
+		return rc;
+	}
+}
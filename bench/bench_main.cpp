@@ -0,0 +1,57 @@
+﻿#include "bench.hpp"
+
+#include <cstdio>
+#include <string_view>
+
+namespace {
+
+	struct benchmark_t {
+		const char* name;
+		int (*run)(const bench::args_t& _args);
+		const char* description;
+	};
+
+	const benchmark_t benchmarks[] = {
+		{ "direct_io", bench::direct_io, "small-file latency while large files stream, buffered vs DIRECT_IO_THRESHOLD" },
+		{ "policy", bench::policy, "handler cost per request: default policies vs all features compiled out vs a hand-written loop" },
+		{ "coroutine", bench::coroutine, "coroutine handler vs a callback state machine, and coroutine frame allocations" },
+		{ "socket", bench::socket_profile, "time to first byte for each socket profile, keep-alive and new connection" },
+		{ "parser", bench::parser, "request head parsing, path checks, content types and header formatting" },
+		{ "parser_check", bench::parser_check, "compare the request parser with the previous implementation on generated heads" },
+	};
+
+	void usage()
+	{
+		std::printf("usage: bench <name>|all [--option=value ...]\n");
+		for (const auto& x : benchmarks)
+		{
+			std::printf("  %-12s %s\n", x.name, x.description);
+		}
+	}
+}
+
+int main(int _argc, char** _argv)
+{
+	if (_argc < 2)
+	{
+		usage();
+		return 1;
+	}
+
+	WSADATA wsa;
+	::WSAStartup(MAKEWORD(2, 2), &wsa);
+
+	std::string_view name = _argv[1];
+	bench::args_t args(_argv + 2, _argv + _argc);
+	int rc = -1;
+	for (const auto& x : benchmarks)
+	{
+		if (name != "all" && name != x.name) continue;
+		rc = x.run(args);
+		if (rc != 0) break;
+	}
+
+	::WSACleanup();
+	if (rc == -1) usage();
+	return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,421 @@
+﻿#include "bench.hpp"
+#include "parser_reference.hpp"
+
+#include "counting_resource.hpp"
+#include "http_parser.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+// リクエストの解析、パスの検査、Content-Type、応答ヘッダの書き出しを単体で測る
+// parser_checkは今の解析と1文字ずつ追加していた頃の解析(parser_reference.hpp)に同じ入力を与えて結果を比べる
+namespace bench {
+
+	namespace {
+		volatile uint64_t sink = 0;
+
+		struct head_t {
+			const char* name;
+			const char* text;
+		};
+
+		// ブラウザ、curl、クローラーの実際のリクエストヘッダ
+		const head_t corpus[] = {
+			{ "chrome",
+				"GET /index.html HTTP/1.1\r\n"
+				"Host: example.com\r\n"
+				"Connection: keep-alive\r\n"
+				"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+				"sec-ch-ua-mobile: ?0\r\n"
+				"sec-ch-ua-platform: \"Windows\"\r\n"
+				"Upgrade-Insecure-Requests: 1\r\n"
+				"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+				"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+				"Sec-Fetch-Site: none\r\n"
+				"Sec-Fetch-Mode: navigate\r\n"
+				"Sec-Fetch-User: ?1\r\n"
+				"Sec-Fetch-Dest: document\r\n"
+				"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+				"Accept-Language: ja,en-US;q=0.9,en;q=0.8\r\n"
+				"\r\n" },
+			{ "firefox",
+				"GET /css/site.css HTTP/1.1\r\n"
+				"Host: example.com\r\n"
+				"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+				"Accept: text/css,*/*;q=0.1\r\n"
+				"Accept-Language: ja,en-US;q=0.7,en;q=0.3\r\n"
+				"Accept-Encoding: gzip, deflate, br\r\n"
+				"Connection: keep-alive\r\n"
+				"Referer: http://example.com/index.html\r\n"
+				"Sec-Fetch-Dest: style\r\n"
+				"Sec-Fetch-Mode: no-cors\r\n"
+				"Sec-Fetch-Site: same-origin\r\n"
+				"If-Modified-Since: Tue, 14 May 2024 03:12:45 GMT\r\n"
+				"Cache-Control: max-age=0\r\n"
+				"\r\n" },
+			{ "safari",
+				"GET /images/photo-2024_01.jpg HTTP/1.1\r\n"
+				"Host: example.com\r\n"
+				"Accept: image/webp,image/avif,image/jxl,image/heic,image/heic-sequence,video/*;q=0.8,image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5\r\n"
+				"Sec-Fetch-Site: same-origin\r\n"
+				"Accept-Language: ja-JP,ja;q=0.9\r\n"
+				"Accept-Encoding: gzip, deflate\r\n"
+				"Sec-Fetch-Mode: no-cors\r\n"
+				"User-Agent: Mozilla/5.0 (iPhone; CPU iPhone OS 17_4 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.4 Mobile/15E148 Safari/604.1\r\n"
+				"Referer: http://example.com/gallery/\r\n"
+				"Connection: keep-alive\r\n"
+				"Sec-Fetch-Dest: image\r\n"
+				"\r\n" },
+			{ "curl",
+				"GET /assets/app.js HTTP/1.1\r\n"
+				"Host: localhost:20082\r\n"
+				"User-Agent: curl/8.7.1\r\n"
+				"Accept: */*\r\n"
+				"\r\n" },
+			{ "googlebot",
+				"GET /robots.txt HTTP/1.1\r\n"
+				"Host: example.com\r\n"
+				"Connection: keep-alive\r\n"
+				"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+				"From: googlebot(at)googlebot.com\r\n"
+				"User-Agent: Mozilla/5.0 (compatible; Googlebot/2.1; +http://www.google.com/bot.html)\r\n"
+				"Accept-Encoding: gzip, deflate, br\r\n"
+				"\r\n" },
+		};
+
+		const char* const valid_paths[] = {
+			"/index.html",
+			"/assets/js/app.min.js?v=20240514",
+			"/images/photo-2024_01.jpg",
+			"/docs/api/v1/reference~old.html",
+			"/",
+		};
+
+		const char* const malicious_paths[] = {
+			"/../../windows/win.ini",
+			"/.git/config",
+			"//server/share/file",
+			"/a/./b.html",
+			"/%2e%2e/secret",
+			"/index.html.",
+			"/scripts/..%5c..%5cwindows/system32/cmd.exe",
+			"/\xe3\x81\x82.html",
+			"index.html",
+			"/a b.html",
+		};
+
+		const wchar_t* const content_paths[] = {
+			L"htdocs\\index.html",
+			L"htdocs\\css\\site.css",
+			L"htdocs\\images\\photo-2024_01.jpg",
+			L"htdocs\\fonts\\noto.woff2",
+			L"htdocs\\data\\archive.tar.gz",
+			L"htdocs\\README",
+			L"htdocs\\dir.v2\\file",
+		};
+
+		// _batches回に分けて1回あたりの時間を取り、分布と合計の処理量を出す
+		template <typename Fn>
+		void measure(const char* _name, const char* _variant, uint64_t _iterations, uint64_t _bytes_per_op, Fn&& _fn)
+		{
+			const uint64_t batches = 50;
+			uint64_t per_batch = std::max<uint64_t>(_iterations / batches, 1);
+			std::vector<double> samples;
+			double total_usec = 0;
+			for (uint64_t b = 0; b < batches; ++b)
+			{
+				auto start = now();
+				for (uint64_t i = 0; i < per_batch; ++i)
+				{
+					_fn();
+				}
+				auto elapsed = to_usec(now() - start);
+				total_usec += elapsed;
+				samples.push_back(elapsed * 1000.0 / static_cast<double>(per_batch));
+			}
+			print(_name, _variant, summarize(samples), "ns");
+			if (_bytes_per_op > 0)
+			{
+				std::printf("%-12s %-16s scanned=%.1fMB/s\n", _name, _variant, static_cast<double>(_bytes_per_op * per_batch * batches) / total_usec);
+			}
+		}
+
+		// 1回の呼び出しでヒープに行く確保の数
+		template <typename Fn>
+		uint64_t count_allocations(Fn&& _fn)
+		{
+			app::counting_resource counting;
+			_fn(&counting);
+			return counting.count();
+		}
+
+		template <typename Parser>
+		void bench_head(const head_t& _head, const char* _suffix, uint64_t _iterations, Parser _parse)
+		{
+			std::string_view text(_head.text);
+			std::vector<char> buf(text.begin(), text.end());
+			buf.resize(16 * 1024); // 受信バッファと同じく後ろに余白がある
+			auto variant = std::string(_head.name) + " " + _suffix;
+
+			// ハンドラと同じく、接続ごとのアリーナに解析結果を置いて毎回巻き戻す
+			std::vector<char> arena_buf(4096);
+			measure("parse", variant.c_str(), _iterations, text.size(), [&] {
+				std::pmr::monotonic_buffer_resource arena(arena_buf.data(), arena_buf.size(), std::pmr::new_delete_resource());
+				auto [rc, method, request, version, kvs] = _parse(buf, text.size(), &arena);
+				sink = sink + rc + method.size() + request.size() + kvs.size();
+			});
+
+			auto allocations = count_allocations([&](std::pmr::memory_resource* _mr) {
+				auto [rc, method, request, version, kvs] = _parse(buf, text.size(), _mr);
+				sink = sink + rc + kvs.size();
+			});
+			std::printf("%-12s %-16s allocations=%llu\n", "parse", variant.c_str(), allocations);
+		}
+
+		// 0x80以上の文字、区切りの欠落、長すぎる各部分、重複や空のヘッダを混ぜた不正なものも含むヘッダ
+		class head_generator
+		{
+		private:
+			std::mt19937_64 rng_;
+
+			uint64_t pick(uint64_t _n)
+			{
+				return std::uniform_int_distribution<uint64_t>(0, _n - 1)(rng_);
+			}
+
+			bool chance(int _percent)
+			{
+				return pick(100) < static_cast<uint64_t>(_percent);
+			}
+
+			char random_char()
+			{
+				static const char alphabet[] = "abcxyzABCXYZ0189-._~/?=&%+:;,@! \t\"'<>\\";
+				if (chance(3)) return static_cast<char>(pick(256));
+				return alphabet[pick(sizeof(alphabet) - 1)];
+			}
+
+			std::string token(size_t _max)
+			{
+				std::string r;
+				auto n = pick(_max + 1);
+				for (size_t i = 0; i < n; ++i) r.push_back(random_char());
+				return r;
+			}
+
+			std::string path()
+			{
+				static const char* const segments[] = { "index.html", "css", "a.b", "..", ".", "", "x~y", "img_01.png", "%2e", "q?x=1", "\xc3\xa9" };
+				if (chance(5)) return token(12);
+				if (chance(1)) return "/" + std::string(4090 + pick(12), 'a');
+				std::string r;
+				auto n = pick(5) + 1;
+				for (size_t i = 0; i < n; ++i)
+				{
+					r.append("/").append(segments[pick(std::size(segments))]);
+				}
+				if (chance(20)) r.append("?").append(token(10));
+				return r;
+			}
+
+			std::string eol()
+			{
+				if (chance(95)) return "\r\n";
+				static const char* const broken[] = { "\n", "\r", "\n\r", "" };
+				return broken[pick(std::size(broken))];
+			}
+
+		public:
+			explicit head_generator(uint64_t _seed)
+				: rng_(_seed)
+			{
+			}
+
+			// _sizeは解析させる長さ。受信バッファの後ろに続くバイトも付ける
+			std::vector<char> next(size_t& _size)
+			{
+				static const char* const methods[] = { "GET", "HEAD", "POST", "OPTIONS", "CONNECT", "PROPFIND", "" };
+				static const char* const versions[] = { "HTTP/1.1", "HTTP/1.0", "HTTP/2", "HTTP/1.1x", "" };
+				static const char* const keys[] = { "Host", "Accept", "User-Agent", "Cookie", " X-Pad ", "" };
+
+				std::string head = chance(90) ? methods[pick(std::size(methods))] : token(10);
+				head.append(chance(97) ? " " : "").append(path()).append(chance(97) ? " " : "");
+				head.append(chance(95) ? versions[pick(std::size(versions))] : token(10)).append(eol());
+
+				auto headers = pick(10);
+				for (size_t i = 0; i < headers; ++i)
+				{
+					head.append(chance(90) ? keys[pick(std::size(keys))] : token(8));
+					if (chance(95)) head.append(":");
+					head.append(chance(50) ? " " : "").append(token(20)).append(chance(10) ? " \t" : "").append(eol());
+				}
+				if (chance(95)) head.append("\r\n");
+
+				// 1バイトの置換、挿入、削除
+				auto mutations = chance(30) ? pick(3) + 1 : 0;
+				for (size_t i = 0; i < mutations && !head.empty(); ++i)
+				{
+					auto pos = pick(head.size());
+					switch (pick(3))
+					{
+					case 0: head[pos] = static_cast<char>(pick(256)); break;
+					case 1: head.insert(head.begin() + pos, static_cast<char>(pick(256))); break;
+					default: head.erase(pos, 1); break;
+					}
+				}
+
+				_size = chance(90) ? head.size() : pick(head.size() + 1);
+				std::vector<char> r(head.begin(), head.end());
+				if (chance(30))
+				{
+					auto extra = token(16);
+					r.insert(r.end(), extra.begin(), extra.end());
+				}
+				return r;
+			}
+
+			std::string next_path()
+			{
+				return chance(80) ? path() : token(16);
+			}
+		};
+
+		std::string escape(std::string_view _s)
+		{
+			std::string r;
+			for (char c : _s)
+			{
+				auto u = static_cast<unsigned char>(c);
+				if (u >= 0x20 && u < 0x7f && c != '\\')
+				{
+					r.push_back(c);
+				}
+				else
+				{
+					char buf[8];
+					std::snprintf(buf, sizeof(buf), "\\x%02x", u);
+					r.append(buf);
+				}
+			}
+			return r;
+		}
+
+		bool same_headers(const app::http_header_map& _a, const app::http_header_map& _b)
+		{
+			if (_a.size() != _b.size()) return false;
+			for (const auto& [k, v] : _a)
+			{
+				auto it = _b.find(k);
+				if (it == _b.end() || it->second != v) return false;
+			}
+			return true;
+		}
+	}
+
+	int parser(const args_t& _args)
+	{
+		auto iterations = option_uint(_args, "iterations", 200000);
+
+		for (const auto& head : corpus)
+		{
+			bench_head(head, "current", iterations, [](const std::vector<char>& _buf, size_t _size, std::pmr::memory_resource* _mr) {
+				return app::parse_http_header(_buf, _size, _mr);
+			});
+			bench_head(head, "reference", iterations, [](const std::vector<char>& _buf, size_t _size, std::pmr::memory_resource* _mr) {
+				return reference::parse_http_header(_buf, _size, _mr);
+			});
+		}
+
+		for (auto [variant, paths, count] : { std::tuple{ "valid", valid_paths, std::size(valid_paths) }, std::tuple{ "malicious", malicious_paths, std::size(malicious_paths) } })
+		{
+			uint64_t bytes = 0;
+			for (size_t i = 0; i < count; ++i) bytes += std::string_view(paths[i]).size();
+
+			std::vector<char> arena_buf(1024);
+			measure("path", variant, iterations, bytes, [&] {
+				std::pmr::monotonic_buffer_resource arena(arena_buf.data(), arena_buf.size(), std::pmr::new_delete_resource());
+				for (size_t i = 0; i < count; ++i)
+				{
+					sink = sink + app::get_absolute_path(paths[i], &arena).size();
+				}
+			});
+			auto allocations = count_allocations([&](std::pmr::memory_resource* _mr) {
+				for (size_t i = 0; i < count; ++i)
+				{
+					sink = sink + app::get_absolute_path(paths[i], _mr).size();
+				}
+			});
+			std::printf("%-12s %-16s paths/op=%zu allocations=%llu\n", "path", variant, count, allocations);
+		}
+
+		measure("content_type", "lookup", iterations, 0, [] {
+			for (auto path : content_paths)
+			{
+				sink = sink + app::get_content_type(path).size();
+			}
+		});
+		std::printf("%-12s %-16s paths/op=%zu\n", "content_type", "lookup", std::size(content_paths));
+
+		// 接続ごとに使い回すのと同じく、容量を残したまま書き直す
+		std::string header;
+		header.reserve(256);
+		measure("header", "200", iterations, 0, [&] {
+			header.clear();
+			app::append_ok_header(header, "text/html", 123456);
+			sink = sink + header.size();
+		});
+		return 0;
+	}
+
+	int parser_check(const args_t& _args)
+	{
+		auto cases = option_uint(_args, "cases", 200000);
+		auto seed = option_uint(_args, "seed", 1);
+
+		head_generator gen(seed);
+		uint64_t accepted = 0;
+		uint64_t mismatches = 0;
+		for (uint64_t i = 0; i < cases; ++i)
+		{
+			size_t size = 0;
+			auto head = gen.next(size);
+			auto [rc, method, request, version, kvs] = app::parse_http_header(head, size, std::pmr::new_delete_resource());
+			auto [ref_rc, ref_method, ref_request, ref_version, ref_kvs] = reference::parse_http_header(head, size, std::pmr::new_delete_resource());
+
+			// 失敗したときの途中までの値はどちらも使わないので、結果が0のときだけ中身を比べる
+			const char* field = nullptr;
+			if (rc != ref_rc) field = "rc";
+			else if (rc == 0 && method != ref_method) field = "method";
+			else if (rc == 0 && request != ref_request) field = "request";
+			else if (rc == 0 && version != ref_version) field = "version";
+			else if (rc == 0 && !same_headers(kvs, ref_kvs)) field = "headers";
+			else if (rc == 0 && app::get_absolute_path(request, std::pmr::new_delete_resource()) != reference::get_absolute_path(request, std::pmr::new_delete_resource())) field = "path";
+
+			if (rc == 0) accepted++;
+			if (field != nullptr)
+			{
+				if (mismatches++ < 5)
+				{
+					std::printf("parser_check: %s differs (rc=%d reference=%d) size=%zu head=\"%s\"\n", field, rc, ref_rc, size, escape(std::string_view(head.data(), head.size())).c_str());
+				}
+			}
+
+			auto path = gen.next_path();
+			if (app::get_absolute_path(path, std::pmr::new_delete_resource()) != reference::get_absolute_path(path, std::pmr::new_delete_resource()))
+			{
+				if (mismatches++ < 5)
+				{
+					std::printf("parser_check: path differs path=\"%s\"\n", escape(path).c_str());
+				}
+			}
+		}
+
+		std::printf("%-12s seed=%llu cases=%llu accepted=%llu mismatches=%llu\n", "parser_check", seed, cases, accepted, mismatches);
+		return mismatches == 0 ? 0 : 1;
+	}
+}
@@ -0,0 +1,69 @@
+﻿#include "bench.hpp"
+#include "loopback_bench.hpp"
+
+#include "early_hints.hpp"
+#include "not_found_cache.hpp"
+
+#include <cstdio>
+
+// 既定のポリシーのハンドラ、全ての機能を外したハンドラ、手書きの最小ループで、同じ台本を処理する時間を比べる
+// ソケットとファイルの代わりにloopback_backendを使うので、ハンドラ自体のコストだけが出る
+namespace bench {
+
+	namespace {
+		const std::wstring HTDOCS = L"htdocs";
+
+		template <typename Handler>
+		bool run_variant(const char* _variant, app::loopback_backend& _io, Handler& _handler, const loopback_options_t& _opt)
+		{
+			loopback_result_t result;
+			if (!run_loopback(_io, _handler, _opt, result))
+			{
+				std::printf("policy: %s returned an unexpected response\n", _variant);
+				return false;
+			}
+			print("policy", _variant, summarize(result.ns_per_request), "ns");
+			std::printf("%-12s %-16s completions/request=%.1f\n", "policy", _variant, static_cast<double>(result.completions) / static_cast<double>(_opt.rounds * _opt.conns * _opt.requests));
+			// 台本の受け渡しを除いた、ハンドラとloopback_backendの中でのヒープへの確保
+			if (_opt.rounds > 1)
+			{
+				std::printf("%-12s %-16s heap allocations/request=%.3f\n", "policy", _variant, static_cast<double>(result.heap_allocations) / static_cast<double>((_opt.rounds - 1) * _opt.conns * _opt.requests));
+			}
+			return true;
+		}
+	}
+
+	int policy(const args_t& _args)
+	{
+		loopback_options_t opt = {
+			option_uint(_args, "rounds", 200),
+			option_uint(_args, "conns", 64),
+			option_uint(_args, "requests", 8),
+			option_uint(_args, "files", 100),
+			option_uint(_args, "body", 1024),
+		};
+		app::early_hints hints({}, HTDOCS, false);
+
+		{
+			app::loopback_backend io(opt.conns);
+			add_files(io, HTDOCS, opt);
+			app::http_cache_policy cache(1024);
+			app::loopback_http_handler handler(io, cache, hints, HTDOCS);
+			if (!run_variant("default", io, handler, opt)) return 1;
+		}
+		{
+			app::loopback_backend io(opt.conns);
+			add_files(io, HTDOCS, opt);
+			app::null_not_found_cache cache(0);
+			app::loopback_bare_http_handler handler(io, cache, hints, HTDOCS);
+			if (!run_variant("bare", io, handler, opt)) return 1;
+		}
+		{
+			app::loopback_backend io(opt.conns);
+			add_files(io, HTDOCS, opt);
+			minimal_handler handler(io, HTDOCS);
+			if (!run_variant("hand-written", io, handler, opt)) return 1;
+		}
+		return 0;
+	}
+}
@@ -0,0 +1,115 @@
+﻿#include "bench.hpp"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// ソケットの設定ごとの最初の1バイトまでの時間(TTFB)
+// keep-aliveで続けて送る場合と、リクエストごとに接続する場合(接続の時間を含む)を測る
+namespace bench {
+
+	namespace {
+		struct socket_profile_t {
+			const char* name;
+			bool nodelay;
+			uint32_t buffer_kb; // 送受信とも。0はOS任せ
+			bool accept_data;
+			bool fastopen;
+		};
+
+		const socket_profile_t profiles[] = {
+			{ "default", true, 0, false, false },
+			{ "nagle", false, 0, false, false },
+			{ "buffer-8k", true, 8, false, false },
+			{ "buffer-1m", true, 1024, false, false },
+			{ "accept-data", true, 0, true, false },
+			{ "fastopen", true, 0, false, true },
+		};
+
+		bool run_profile(const args_t& _args, const socket_profile_t& _profile)
+		{
+			auto port = static_cast<uint16_t>(option_uint(_args, "port", 20183));
+			auto requests = option_uint(_args, "requests", 5000);
+
+			app::http_config_t config;
+			config.port = port;
+			config.metrics_path = "none";
+			config.tcp_nodelay = _profile.nodelay;
+			config.send_buffer = _profile.buffer_kb;
+			config.recv_buffer = _profile.buffer_kb;
+			config.accept_data = _profile.accept_data;
+			config.tcp_fastopen = _profile.fastopen;
+			server_instance server;
+			if (!server.start(config))
+			{
+				std::printf("socket: server did not start on port %u\n", port);
+				return false;
+			}
+
+			std::vector<double> keepalive;
+			std::vector<double> connect;
+			uint64_t errors = 0;
+
+			http_client client;
+			for (uint64_t i = 0; i < requests; ++i)
+			{
+				if (!client.is_connected() && !client.connect(port)) break;
+				int64_t ttfb = 0;
+				if (client.get("/__bench/ttfb.html", true, &ttfb) < 0)
+				{
+					errors++;
+					continue;
+				}
+				keepalive.push_back(to_usec(ttfb));
+			}
+
+			for (uint64_t i = 0; i < requests; ++i)
+			{
+				http_client once;
+				auto start = now();
+				if (!once.connect(port))
+				{
+					errors++;
+					continue;
+				}
+				auto connected = now() - start;
+				int64_t ttfb = 0;
+				if (once.get("/__bench/ttfb.html", false, &ttfb) < 0)
+				{
+					errors++;
+					continue;
+				}
+				connect.push_back(to_usec(connected + ttfb));
+			}
+			server.stop();
+
+			print("socket", (std::string(_profile.name) + " keepalive").c_str(), summarize(keepalive), "us");
+			print("socket", (std::string(_profile.name) + " connect").c_str(), summarize(connect), "us");
+			if (errors > 0) std::printf("%-12s %-16s errors=%llu\n", "socket", _profile.name, errors);
+			return true;
+		}
+	}
+
+	int socket_profile(const args_t& _args)
+	{
+		auto body = option_uint(_args, "body", 4096);
+		auto only = option(_args, "profile", "");
+
+		auto root = htdocs() + L"\\__bench";
+		if (!write_file(root + L"\\ttfb.html", body, 't')) return 1;
+
+		int rc = 0;
+		for (const auto& x : profiles)
+		{
+			if (!only.empty() && only != x.name) continue;
+			if (!run_profile(_args, x))
+			{
+				rc = 1;
+				break;
+			}
+		}
+
+		remove_tree(root);
+		return rc;
+	}
+}
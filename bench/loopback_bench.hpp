@@ -0,0 +1,184 @@
+﻿#pragma once
+
+#include "bench.hpp"
+
+#include "log.hpp"
+#include "loopback_backend.hpp"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace bench {
+
+	// 静的ファイルを返すだけの手書きのループ。完了ごとにフラグとカウンタで次の処理を決める状態機械で、ヘッダは固定、エラー処理も無い比較用
+	class minimal_handler
+	{
+	private:
+		app::loopback_backend& io_;
+		std::wstring htdocs_;
+
+	public:
+		minimal_handler(app::loopback_backend& _io, const std::wstring& _htdocs)
+			: io_(_io)
+			, htdocs_(_htdocs)
+		{
+		}
+
+		// コピー不可
+		minimal_handler(const minimal_handler&) = delete;
+		minimal_handler& operator = (const minimal_handler&) = delete;
+		// ムーブ不可
+		minimal_handler(minimal_handler&&) = delete;
+		minimal_handler& operator = (minimal_handler&&) = delete;
+
+		void on_accept(app::http_conn_t* _conn, ULONG, bool, DWORD)
+		{
+			io_.tcp_read(_conn);
+		}
+
+		void run_deferred() {}
+		void run_throttled() {}
+		bool has_deferred() const noexcept { return false; }
+
+		void on_socket(app::HTTP_IO_CONTEXT* _ctx, DWORD, DWORD _transferred)
+		{
+			app::http_conn_t* conn = _ctx->conn;
+			if (_ctx->type == app::HTTP_TCP_RECV)
+			{
+				if (_transferred == 0)
+				{
+					io_.connection_close(conn);
+					return;
+				}
+
+				std::string_view head(_ctx->buf.data(), _transferred);
+				auto start = head.find(' ') + 1;
+				auto end = head.find(' ', start);
+				std::wstring path = htdocs_;
+				for (char c : head.substr(start, end - start))
+				{
+					path.push_back(c == '/' ? L'\\' : static_cast<wchar_t>(c));
+				}
+				io_.file_open_start(conn, path.c_str());
+				return;
+			}
+
+			io_.tcp_send_file_complete(conn, _transferred);
+			if (conn->fio_ctx.total_sent >= conn->fio_ctx.size)
+			{
+				io_.file_close(conn);
+				io_.tcp_read(conn);
+				return;
+			}
+			// 空いた枠に次を読む
+			io_.file_read(conn);
+			io_.tcp_send_file(conn);
+		}
+
+		void on_file_open(app::FILE_OPEN_CONTEXT* _ctx)
+		{
+			app::http_conn_t* conn = _ctx->conn;
+			if (!io_.file_open_finish(_ctx) || !io_.file_open_complete(conn))
+			{
+				io_.connection_close(conn);
+				return;
+			}
+			conn->header = "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: " + std::to_string(conn->fio_ctx.size) + "\r\n\r\n";
+			io_.file_read(conn);
+		}
+
+		void on_file_read(app::FILE_READ_CONTEXT* _slot, DWORD, DWORD _transferred)
+		{
+			app::http_conn_t* conn = _slot->conn;
+			app::FILE_IO_CONTEXT& ctx = conn->fio_ctx;
+			ctx.reading--;
+			_slot->pending = false;
+			_slot->transferred = _transferred;
+			_slot->ready = true;
+			ctx.total_read += _transferred;
+			io_.file_read(conn);
+			io_.tcp_send_file(conn);
+		}
+	};
+
+	struct loopback_options_t {
+		uint64_t rounds;
+		uint64_t conns;
+		uint64_t requests; // 1接続あたり。keep-aliveで続けて送る
+		uint64_t files;
+		uint64_t body;
+	};
+
+	inline void add_files(app::loopback_backend& _io, const std::wstring& _htdocs, const loopback_options_t& _opt)
+	{
+		for (uint64_t i = 0; i < _opt.files; ++i)
+		{
+			_io.add_file(_htdocs + L"\\f\\" + std::to_wstring(i) + L".html", std::string(_opt.body, 'p'));
+		}
+	}
+
+	inline std::vector<std::vector<std::string>> make_scripts(const loopback_options_t& _opt)
+	{
+		std::vector<std::vector<std::string>> r(_opt.conns);
+		uint64_t n = 0;
+		for (auto& script : r)
+		{
+			for (uint64_t i = 0; i < _opt.requests; ++i)
+			{
+				script.push_back("GET /f/" + std::to_string(n++ % _opt.files) + ".html HTTP/1.1\r\nHost: localhost\r\nUser-Agent: bench\r\nAccept: */*\r\n\r\n");
+			}
+		}
+		return r;
+	}
+
+	inline size_t count_ok(std::string_view _output)
+	{
+		size_t n = 0;
+		for (auto pos = _output.find("HTTP/1.1 200 OK\r\n"); pos != std::string_view::npos; pos = _output.find("HTTP/1.1 200 OK\r\n", pos + 1))
+		{
+			n++;
+		}
+		return n;
+	}
+
+	struct loopback_result_t {
+		std::vector<double> ns_per_request; // ラウンドごと
+		uint64_t completions;
+		uint64_t heap_allocations; // 2ラウンド目以降のrun()の間にヒープから確保した数。1ラウンド目はバッファやフレームが揃うまでの分なので除く
+	};
+
+	// 全ての接続に台本を渡して完了が無くなるまで回すのを_opt.roundsだけ繰り返す。応答が台本と合わなければfalse
+	template <typename Handler>
+	bool run_loopback(app::loopback_backend& _io, Handler& _handler, const loopback_options_t& _opt, loopback_result_t& _result)
+	{
+		auto scripts = make_scripts(_opt);
+		std::vector<app::http_conn_t*> conns(_opt.conns);
+		_result = {};
+
+		for (uint64_t round = 0; round < _opt.rounds; ++round)
+		{
+			auto input = scripts;
+			auto start = now();
+			for (uint64_t i = 0; i < _opt.conns; ++i)
+			{
+				conns.at(i) = _io.accept(_handler, std::move(input.at(i)));
+			}
+			auto heap_before = heap_counts();
+			_result.completions += _io.run(_handler);
+			auto heap_after = heap_counts();
+			auto elapsed = to_usec(now() - start);
+			if (round > 0) _result.heap_allocations += heap_after.allocations - heap_before.allocations;
+
+			for (auto conn : conns)
+			{
+				if (conn == nullptr || count_ok(_io.output(conn)) != _opt.requests || !_io.closed(conn)) return false;
+			}
+			_result.ns_per_request.push_back(elapsed * 1000.0 / static_cast<double>(_opt.conns * _opt.requests));
+
+			// ログを出すハンドラの分が溜まり続けないように捨てる
+			app::log_read();
+		}
+		return true;
+	}
+}
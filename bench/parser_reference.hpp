@@ -0,0 +1,269 @@
+﻿#pragma once
+
+#include "http_parser.hpp"
+
+#include <algorithm>
+#include <array>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+// 1文字ずつ文字列に追加していた頃のparse_http_header()とget_absolute_path()
+// 今の実装と結果が変わっていないことを確かめるための比較用。0x80以上の文字と空のリクエストで落ちる箇所だけ直してある
+namespace bench::reference {
+
+	const std::array<bool, 0x80> absolute_path_codes =
+	{
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 1, 1, 1, // 0x2D(-) 0x2E(.) 0x2F(/)
+		1, 1, 1, 1, 1, 1, 1, 1, // 0x30-
+		1, 1, 0, 0, 0, 0, 0, 0, // -0x39 数字
+		1, 1, 1, 1, 1, 1, 1, 1, // 0x40(@) 0x41-
+		1, 1, 1, 1, 1, 1, 1, 1, // -
+		1, 1, 1, 1, 1, 1, 1, 1, // -
+		1, 1, 1, 0, 0, 0, 0, 1, // -0x5A ALPHA 0x5F(_)
+		0, 1, 1, 1, 1, 1, 1, 1, // 0x61-
+		1, 1, 1, 1, 1, 1, 1, 1, // -
+		1, 1, 1, 1, 1, 1, 1, 1, // -
+		1, 1, 1, 0, 0, 0, 1, 0  // -0x7A alpha 0x7E(~)
+	};
+
+	inline std::string_view trim(std::string_view s)
+	{
+		auto a = s.find_first_not_of(" \t\r\n");
+		if (a == std::string_view::npos) return "";
+		auto b = s.find_last_not_of(" \t\r\n");
+		return s.substr(a, b - a + 1);
+	}
+
+	inline std::tuple<int, std::pmr::string, std::pmr::string, std::pmr::string, app::http_header_map>
+		parse_http_header(const std::vector<char>& _header, size_t _size, std::pmr::memory_resource* _mr)
+	{
+		enum : int {
+			SEC_METHOD,
+			SEC_REQUEST,
+			SEC_VERSION,
+			SEC_KEY,
+			SEC_VALUE
+		};
+
+		int sec = SEC_METHOD;
+		int rc = -1;
+		char prev_c = 0;
+
+		bool invalid_char = false;
+		std::pmr::string method(_mr);
+		bool method_oversize = false;
+		std::pmr::string request(_mr);
+		bool request_oversize = false;
+		std::pmr::string version(_mr);
+		bool version_oversize = false;
+		std::pmr::string key(_mr);
+		std::pmr::string value(_mr);
+		bool header_end = false;
+		bool invalid_keyvalue = false;
+		app::http_header_map key_values(_mr);
+
+		// サイズ予約。リクエストは4096文字まで
+		request.reserve(std::min<size_t>(_size, 4098));
+
+		for (size_t i = 0; i < _header.size() && i < _size; ++i)
+		{
+			char c = _header.at(i);
+
+			// check valid char
+			if (!app::is_http_char(c)) // 元はc > 0x7f || !http_available_ascii_codes.at(c)。charが符号付きだとat()が例外になる
+			{
+				invalid_char = true;
+			}
+			else
+			{
+
+				switch (sec)
+				{
+				case SEC_METHOD:
+					if (c == ' ')
+					{
+						sec = SEC_REQUEST;
+					}
+					else
+					{
+						if (method.size() > 7)
+						{
+							// CONNECT/OPTIONS = 7chars
+							method_oversize = true;
+						}
+						else
+						{
+							method += c;
+						}
+					}
+					break;
+				case SEC_REQUEST:
+					if (c == ' ')
+					{
+						sec = SEC_VERSION;
+					}
+					else
+					{
+						if (request.size() > 4096)
+						{
+							request_oversize = true;
+						}
+						else
+						{
+							request += c;
+						}
+					}
+					break;
+				case SEC_VERSION:
+					if (c == '\n' && prev_c == '\r')
+					{
+						sec = SEC_KEY;
+						version.pop_back(); // 末尾の\rを削除
+					}
+					else
+					{
+						if (version.size() > 8)
+						{
+							// HTTP/1.1 = 8chars
+							version_oversize = true;
+						}
+						else
+						{
+							version += c;
+						}
+					}
+					break;
+				case SEC_KEY:
+					if (c == '\n' && prev_c == '\r')
+					{
+						key.pop_back(); // 末尾の\rを削除
+
+						if (key == "")
+						{
+							header_end = true;
+						}
+						else
+						{
+							invalid_keyvalue = true;
+						}
+					}
+					else if (c == ':')
+					{
+						sec = SEC_VALUE;
+					}
+					else
+					{
+						key += c;
+					}
+					break;
+				case SEC_VALUE:
+					if (c == '\n' && prev_c == '\r')
+					{
+						sec = SEC_KEY;
+						value.pop_back(); // 末尾の\rを削除
+
+						// key valueの格納
+						const auto trimed_key = trim(key);
+						const auto trimed_value = trim(value);
+						if (trimed_key == "" || trimed_value == "")
+						{
+							invalid_keyvalue = true;
+						}
+						else
+						{
+							std::pmr::string k(trimed_key, _mr);
+							auto it = key_values.find(k);
+							if (it != key_values.end())
+							{
+								it->second.append(", ").append(trimed_value);
+							}
+							else
+							{
+								key_values.emplace(std::move(k), std::pmr::string(trimed_value, _mr));
+							}
+							key.clear();
+							value.clear();
+						}
+					}
+					else
+					{
+						value += c;
+					}
+					break;
+				}
+			}
+
+			prev_c = c;
+
+			if (invalid_char) break;
+			if (method_oversize) break;
+			if (request_oversize) break;
+			if (version_oversize) break;
+			if (invalid_keyvalue) break;
+			if (header_end) break;
+		}
+
+		// 解析終了後のチェック
+		if (invalid_char) rc = -1;
+		else if (method_oversize) rc = -2;
+		else if (request_oversize) rc = -3;
+		else if (version_oversize) rc = -4;
+		else if (invalid_keyvalue) rc = -5;
+		else if (!header_end) rc = -6;
+		else rc = 0;
+
+		return {
+			rc,
+			std::move(method),
+			std::move(request),
+			std::move(version),
+			std::move(key_values)
+		};
+	}
+
+	inline std::pmr::string get_absolute_path(std::string_view _request, std::pmr::memory_resource* _mr)
+	{
+		std::pmr::string r(_mr);
+		r.reserve(_request.size());
+		char prev_c = 0;
+
+		for (size_t i = 0; i < _request.size(); ++i)
+		{
+			char c = _request.at(i);
+			if (r == "" && c != '/') // スラッシュで始まらないURL禁止
+				return std::pmr::string(_mr);
+
+			if (c == '/' && prev_c == '/') // 連続スラッシュ禁止
+				return std::pmr::string(_mr);
+			if (c == '/' && prev_c == '.') // .で終わるフォルダ禁止
+				return std::pmr::string(_mr);
+			if (c == '.' && prev_c == '/') // .で始まるファイル/フォルダは禁止
+				return std::pmr::string(_mr);
+			if (c == '.' && prev_c == '.') // 連続ドット禁止
+				return std::pmr::string(_mr);
+
+			if (c == '?') // クエリ以降は無視
+				break;
+
+			if (static_cast<unsigned char>(c) >= 0x80 || absolute_path_codes[static_cast<unsigned char>(c)] == 0) // 元はabsolute_path_codes[c]。負の添字になる
+				return std::pmr::string(_mr);
+
+			r += c;
+
+			prev_c = c;
+		}
+
+		if (r.empty() || r.back() == '.') // 元はr.back()だけ。空のリクエストで未定義動作
+			return std::pmr::string(_mr);
+
+		return r;
+	}
+}
@@ -0,0 +1,553 @@
+﻿#include "client.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+
+#include <Ws2tcpip.h>
+#include <winternl.h>
+
+#pragma comment(lib, "Ws2_32.lib")
+#pragma comment(lib, "Mswsock.lib")
+#pragma comment(lib, "ntdll.lib")
+
+namespace {
+
+	constexpr size_t RECV_SIZE = 64 * 1024;
+	constexpr ULONG ENTRY_COUNT = 64;
+	constexpr DWORD WAIT_MAX = 50;
+	constexpr int64_t SPIN_MSEC = 2;
+	constexpr int64_t DRAIN_MSEC = 5000;
+
+	int64_t frequency() noexcept
+	{
+		static const int64_t freq = [] {
+			LARGE_INTEGER f;
+			::QueryPerformanceFrequency(&f);
+			return f.QuadPart;
+		}();
+		return freq;
+	}
+
+	// http_threadと同じく、完了したI/Oの結果をWin32のエラーコードで返す
+	DWORD get_completion_error(const OVERLAPPED_ENTRY& _entry)
+	{
+		if (_entry.lpOverlapped == NULL) return ERROR_SUCCESS;
+		auto status = static_cast<NTSTATUS>(_entry.lpOverlapped->Internal);
+		if (NT_SUCCESS(status)) return ERROR_SUCCESS;
+		return ::RtlNtStatusToDosError(status);
+	}
+
+	bool iequals(std::string_view _a, std::string_view _b)
+	{
+		return std::equal(_a.begin(), _a.end(), _b.begin(), _b.end(), [](char _x, char _y) {
+			return std::tolower(static_cast<unsigned char>(_x)) == std::tolower(static_cast<unsigned char>(_y));
+		});
+	}
+
+	std::string_view trim(std::string_view _s)
+	{
+		while (!_s.empty() && (_s.front() == ' ' || _s.front() == '\t')) _s.remove_prefix(1);
+		while (!_s.empty() && (_s.back() == ' ' || _s.back() == '\t')) _s.remove_suffix(1);
+		return _s;
+	}
+
+	// 応答のヘッダからContent-LengthとConnection: closeを拾う
+	void parse_response_header(std::string_view _head, int64_t& _length, bool& _close)
+	{
+		_length = 0;
+		_close = false;
+		auto pos = _head.find("\r\n");
+		while (pos != std::string_view::npos && pos + 2 < _head.size())
+		{
+			auto start = pos + 2;
+			pos = _head.find("\r\n", start);
+			if (pos == std::string_view::npos) break;
+			auto line = _head.substr(start, pos - start);
+			auto colon = line.find(':');
+			if (colon == std::string_view::npos) continue;
+			auto name = line.substr(0, colon);
+			auto value = trim(line.substr(colon + 1));
+			if (iequals(name, "Content-Length"))
+			{
+				std::from_chars(value.data(), value.data() + value.size(), _length);
+			}
+			else if (iequals(name, "Connection"))
+			{
+				_close = iequals(value, "close");
+			}
+		}
+	}
+}
+
+namespace loadgen {
+
+	int64_t now() noexcept
+	{
+		LARGE_INTEGER t;
+		::QueryPerformanceCounter(&t);
+		return t.QuadPart;
+	}
+
+	double to_usec(int64_t _ticks) noexcept
+	{
+		return static_cast<double>(_ticks) * 1000000.0 / static_cast<double>(frequency());
+	}
+
+	int64_t from_usec(double _usec) noexcept
+	{
+		return static_cast<int64_t>(_usec * static_cast<double>(frequency()) / 1000000.0);
+	}
+
+	client::connection_t::connection_t()
+		: index(0)
+		, sock(INVALID_SOCKET)
+		, send_ov{}
+		, recv_ov{}
+		, ops(0)
+		, connecting(false)
+		, sending(false)
+		, done(false)
+		, has_pending(false)
+		, pending{}
+		, in_used(0)
+		, body_remaining(-1)
+		, body_length(0)
+		, status(0)
+		, close_after(false)
+	{
+	}
+
+	client::client(const client_options_t& _options, source_t _source)
+		: options_(_options)
+		, source_(std::move(_source))
+		, port_(::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1))
+		, connectex_(nullptr)
+		, conns_(_options.connections)
+		, outstanding_(0)
+		, stats_{}
+	{
+		options_.pipeline = std::max<size_t>(options_.pipeline, 1);
+		if (!options_.keepalive) options_.pipeline = 1;
+		for (size_t i = 0; i < conns_.size(); ++i)
+		{
+			conns_.at(i).index = i;
+			conns_.at(i).in.resize(RECV_SIZE);
+		}
+
+		// ConnectExは関数ポインタを取り出して使う
+		SOCKET sock = ::WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+		if (sock != INVALID_SOCKET)
+		{
+			GUID guid = WSAID_CONNECTEX;
+			DWORD bytes = 0;
+			if (::WSAIoctl(sock, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(guid), &connectex_, sizeof(connectex_), &bytes, NULL, NULL) != 0)
+			{
+				connectex_ = nullptr;
+			}
+			::closesocket(sock);
+		}
+	}
+
+	client::~client()
+	{
+		for (auto& x : conns_)
+		{
+			if (x.sock != INVALID_SOCKET) ::closesocket(x.sock);
+		}
+		if (port_ != NULL) ::CloseHandle(port_);
+	}
+
+	const client_stats_t& client::stats() const noexcept
+	{
+		return stats_;
+	}
+
+	void client::fill(connection_t& _conn, int64_t _now)
+	{
+		// 閉じた直後は前のソケットのI/Oが返ってくるまで次を出さない
+		if (_conn.sock == INVALID_SOCKET && _conn.ops > 0) return;
+
+		while (!_conn.done && _conn.inflight.size() < options_.pipeline)
+		{
+			if (!_conn.has_pending)
+			{
+				if (!source_(_conn.index, _conn.pending))
+				{
+					_conn.done = true;
+					break;
+				}
+				_conn.has_pending = true;
+			}
+			if (_conn.pending.due > _now) break;
+
+			const auto& data = *_conn.pending.data;
+			auto due = _conn.pending.due == 0 ? _now : _conn.pending.due;
+			_conn.inflight.push_back({ due, 0, due >= options_.record_from, data.starts_with("HEAD ") });
+			_conn.queued.append(data);
+			_conn.has_pending = false;
+		}
+		flush(_conn, _now);
+
+		// 送るものが尽きて応答も揃った接続は閉じる
+		if (_conn.done && _conn.inflight.empty() && !_conn.sending && _conn.sock != INVALID_SOCKET) close(_conn, false);
+	}
+
+	void client::flush(connection_t& _conn, int64_t _now)
+	{
+		if (_conn.sending || _conn.queued.empty()) return;
+		if (_conn.sock == INVALID_SOCKET && _conn.ops > 0) return;
+
+		_conn.out.swap(_conn.queued);
+		_conn.queued.clear();
+		for (auto& x : _conn.inflight)
+		{
+			if (x.sent == 0) x.sent = _now;
+		}
+
+		if (_conn.sock == INVALID_SOCKET)
+		{
+			if (!connect(_conn)) close(_conn, true);
+			return;
+		}
+
+		_conn.send_ov = {};
+		DWORD bytes = 0;
+		WSABUF buf = { static_cast<ULONG>(_conn.out.size()), _conn.out.data() };
+		if (::WSASend(_conn.sock, &buf, 1, &bytes, 0, &_conn.send_ov, NULL) != 0 && ::WSAGetLastError() != WSA_IO_PENDING)
+		{
+			close(_conn, true);
+			return;
+		}
+		_conn.sending = true;
+		_conn.ops++;
+		outstanding_++;
+	}
+
+	bool client::connect(connection_t& _conn)
+	{
+		if (connectex_ == nullptr) return false;
+
+		SOCKET sock = ::WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+		if (sock == INVALID_SOCKET) return false;
+
+		// ConnectExはbind済みのソケットが要る
+		SOCKADDR_IN local = {};
+		local.sin_family = AF_INET;
+		local.sin_addr.s_addr = INADDR_ANY;
+		local.sin_port = 0;
+		BOOL nodelay = TRUE;
+		if (::bind(sock, reinterpret_cast<const SOCKADDR*>(&local), sizeof(local)) != 0
+			|| ::setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&nodelay), sizeof(nodelay)) != 0
+			|| ::CreateIoCompletionPort(reinterpret_cast<HANDLE>(sock), port_, reinterpret_cast<ULONG_PTR>(&_conn), 0) == NULL)
+		{
+			::closesocket(sock);
+			return false;
+		}
+
+		// 最初のリクエストは接続と一緒に送る
+		_conn.sock = sock;
+		_conn.send_ov = {};
+		DWORD bytes = 0;
+		if (!connectex_(sock, reinterpret_cast<const SOCKADDR*>(&options_.address), sizeof(options_.address),
+			_conn.out.data(), static_cast<DWORD>(_conn.out.size()), &bytes, &_conn.send_ov)
+			&& ::WSAGetLastError() != ERROR_IO_PENDING)
+		{
+			return false;
+		}
+		_conn.connecting = true;
+		_conn.sending = true;
+		_conn.ops++;
+		outstanding_++;
+		stats_.connects++;
+		return true;
+	}
+
+	bool client::post_recv(connection_t& _conn)
+	{
+		if (_conn.in.size() - _conn.in_used < RECV_SIZE / 4) _conn.in.resize(_conn.in.size() * 2);
+
+		_conn.recv_ov = {};
+		DWORD bytes = 0;
+		DWORD flags = 0;
+		WSABUF buf = { static_cast<ULONG>(_conn.in.size() - _conn.in_used), _conn.in.data() + _conn.in_used };
+		if (::WSARecv(_conn.sock, &buf, 1, &bytes, &flags, &_conn.recv_ov, NULL) != 0 && ::WSAGetLastError() != WSA_IO_PENDING)
+		{
+			return false;
+		}
+		_conn.ops++;
+		outstanding_++;
+		return true;
+	}
+
+	void client::parse(connection_t& _conn, int64_t _now)
+	{
+		size_t pos = 0;
+		while (_conn.sock != INVALID_SOCKET)
+		{
+			if (_conn.body_remaining < 0)
+			{
+				std::string_view data(_conn.in.data() + pos, _conn.in_used - pos);
+				auto end = data.find("\r\n\r\n");
+				if (end == std::string_view::npos) break;
+				auto head = data.substr(0, end + 4);
+				pos += head.size();
+
+				int status = 0;
+				if (head.size() > 12 && head.starts_with("HTTP/1.")) std::from_chars(head.data() + 9, head.data() + 12, status);
+				// 103 Early Hintsなどの途中経過は数えない
+				if (status >= 100 && status < 200) continue;
+
+				int64_t length = 0;
+				parse_response_header(head, length, _conn.close_after);
+				if (!_conn.inflight.empty() && _conn.inflight.front().head) length = 0;
+				_conn.status = status;
+				_conn.body_remaining = std::max<int64_t>(length, 0);
+				_conn.body_length = static_cast<uint64_t>(_conn.body_remaining);
+			}
+
+			auto take = std::min<int64_t>(_conn.body_remaining, static_cast<int64_t>(_conn.in_used - pos));
+			pos += static_cast<size_t>(take);
+			_conn.body_remaining -= take;
+			if (_conn.body_remaining > 0) break;
+
+			_conn.body_remaining = -1;
+			complete(_conn, _now);
+			if (_conn.close_after || !options_.keepalive)
+			{
+				close(_conn, false);
+				pos = _conn.in_used;
+			}
+		}
+
+		std::copy(_conn.in.begin() + pos, _conn.in.begin() + _conn.in_used, _conn.in.begin());
+		_conn.in_used -= pos;
+	}
+
+	void client::complete(connection_t& _conn, int64_t _now)
+	{
+		// 頼んでいない応答(受け付けた直後の503など)
+		if (_conn.inflight.empty())
+		{
+			stats_.status.at(0)++;
+			return;
+		}
+
+		auto x = _conn.inflight.front();
+		_conn.inflight.pop_front();
+		if (!x.record) return;
+
+		stats_.requests++;
+		stats_.bytes += _conn.body_length;
+		auto klass = _conn.status / 100;
+		stats_.status.at(klass >= 1 && klass <= 5 ? klass : 0)++;
+		stats_.latency.push_back(static_cast<float>(to_usec(_now - x.due)));
+		stats_.service.push_back(static_cast<float>(to_usec(_now - x.sent)));
+	}
+
+	void client::close(connection_t& _conn, bool _error)
+	{
+		if (_conn.sock != INVALID_SOCKET)
+		{
+			::closesocket(_conn.sock);
+			_conn.sock = INVALID_SOCKET;
+		}
+		// 応答を受け取れなかったものは失敗
+		if (_error && _conn.inflight.empty()) stats_.errors++;
+		for (const auto& x : _conn.inflight)
+		{
+			if (x.record) stats_.errors++;
+		}
+		_conn.inflight.clear();
+		_conn.out.clear();
+		_conn.queued.clear();
+		_conn.in_used = 0;
+		_conn.body_remaining = -1;
+		_conn.close_after = false;
+	}
+
+	void client::on_send(connection_t& _conn, DWORD _error, DWORD _transferred, int64_t _now)
+	{
+		_conn.sending = false;
+		if (_conn.sock == INVALID_SOCKET) return;
+
+		if (_conn.connecting)
+		{
+			_conn.connecting = false;
+			if (_error == ERROR_SUCCESS)
+			{
+				::setsockopt(_conn.sock, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0);
+				if (!post_recv(_conn)) _error = ::WSAGetLastError();
+			}
+		}
+		if (_error != ERROR_SUCCESS)
+		{
+			close(_conn, true);
+			return;
+		}
+
+		_conn.out.erase(0, _transferred);
+		if (!_conn.out.empty())
+		{
+			// 送り残しは溜まったものの前に戻す
+			_conn.queued.insert(0, _conn.out);
+			_conn.out.clear();
+		}
+		flush(_conn, _now);
+	}
+
+	void client::on_recv(connection_t& _conn, DWORD _error, DWORD _transferred, int64_t _now)
+	{
+		if (_conn.sock == INVALID_SOCKET) return;
+
+		if (_error != ERROR_SUCCESS || _transferred == 0)
+		{
+			close(_conn, _error != ERROR_SUCCESS);
+			return;
+		}
+		_conn.in_used += _transferred;
+		parse(_conn, _now);
+		if (_conn.sock != INVALID_SOCKET && !post_recv(_conn)) close(_conn, true);
+	}
+
+	DWORD client::wait_msec(int64_t _now) const noexcept
+	{
+		int64_t next = options_.until;
+		for (const auto& x : conns_)
+		{
+			if (x.has_pending && x.pending.due > 0 && x.inflight.size() < options_.pipeline) next = std::min(next, x.pending.due);
+		}
+		// 待ちはタイマーの粒度で遅れるので、近いものは待たずに回して予定の時刻を守る
+		auto msec = static_cast<int64_t>(to_usec(next - _now) / 1000.0);
+		if (msec < SPIN_MSEC) return 0;
+		return static_cast<DWORD>(std::min<int64_t>(msec - SPIN_MSEC, WAIT_MAX));
+	}
+
+	bool client::run()
+	{
+		if (port_ == NULL || connectex_ == nullptr) return false;
+
+		std::vector<OVERLAPPED_ENTRY> entries(ENTRY_COUNT);
+		bool stopping = false;
+		int64_t stop_at = 0;
+		while (true)
+		{
+			auto t = now();
+			if (!stopping)
+			{
+				bool idle = true;
+				for (auto& x : conns_)
+				{
+					fill(x, t);
+					if (!x.done || !x.inflight.empty() || x.has_pending) idle = false;
+				}
+				if (t >= options_.until || idle)
+				{
+					// 送りかけのものは数えずに切る
+					stopping = true;
+					stop_at = t;
+					for (auto& x : conns_)
+					{
+						for (auto& y : x.inflight) y.record = false;
+						close(x, false);
+					}
+				}
+			}
+			if (stopping && (outstanding_ == 0 || to_usec(t - stop_at) > DRAIN_MSEC * 1000.0)) break;
+
+			ULONG count = 0;
+			if (!::GetQueuedCompletionStatusEx(port_, entries.data(), ENTRY_COUNT, &count, stopping ? WAIT_MAX : wait_msec(t), FALSE))
+			{
+				if (::GetLastError() != WAIT_TIMEOUT) return false;
+				continue;
+			}
+
+			auto done = now();
+			for (ULONG i = 0; i < count; ++i)
+			{
+				const auto& entry = entries.at(i);
+				auto& conn = *reinterpret_cast<connection_t*>(entry.lpCompletionKey);
+				auto error = get_completion_error(entry);
+				conn.ops--;
+				outstanding_--;
+				if (entry.lpOverlapped == &conn.send_ov)
+				{
+					on_send(conn, error, entry.dwNumberOfBytesTransferred, done);
+				}
+				else
+				{
+					on_recv(conn, error, entry.dwNumberOfBytesTransferred, done);
+				}
+			}
+		}
+		return true;
+	}
+
+	summary_t summarize(std::vector<float>& _values)
+	{
+		summary_t r = {};
+		if (_values.empty()) return r;
+
+		std::sort(_values.begin(), _values.end());
+		auto at = [&](double _q) {
+			return static_cast<double>(_values.at(std::min(_values.size() - 1, static_cast<size_t>(_q * _values.size()))));
+		};
+		r.count = _values.size();
+		r.p50 = at(0.5);
+		r.p90 = at(0.9);
+		r.p99 = at(0.99);
+		r.p999 = at(0.999);
+		r.max = _values.back();
+		return r;
+	}
+
+	std::string option(const args_t& _args, std::string_view _name, std::string_view _def)
+	{
+		for (const auto& x : _args)
+		{
+			std::string_view arg(x);
+			if (arg.size() > _name.size() + 3 && arg.starts_with("--") && arg.substr(2, _name.size()) == _name && arg.at(_name.size() + 2) == '=')
+			{
+				return std::string(arg.substr(_name.size() + 3));
+			}
+		}
+		return std::string(_def);
+	}
+
+	uint64_t option_uint(const args_t& _args, std::string_view _name, uint64_t _def)
+	{
+		auto value = option(_args, _name, "");
+		uint64_t r = _def;
+		std::from_chars(value.data(), value.data() + value.size(), r);
+		return r;
+	}
+
+	double option_double(const args_t& _args, std::string_view _name, double _def)
+	{
+		auto value = option(_args, _name, "");
+		if (value.empty()) return _def;
+		char* end = nullptr;
+		auto r = std::strtod(value.c_str(), &end);
+		return end == value.c_str() ? _def : r;
+	}
+
+	bool resolve(const std::string& _host, uint16_t _port, SOCKADDR_IN& _address)
+	{
+		ADDRINFOA hints = {};
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+		PADDRINFOA result = nullptr;
+		if (::getaddrinfo(_host.c_str(), nullptr, &hints, &result) != 0 || result == nullptr)
+		{
+			std::printf("Error: cannot resolve %s\n", _host.c_str());
+			return false;
+		}
+		_address = *reinterpret_cast<const SOCKADDR_IN*>(result->ai_addr);
+		_address.sin_port = ::htons(_port);
+		::freeaddrinfo(result);
+		return true;
+	}
+}
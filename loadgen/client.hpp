@@ -0,0 +1,138 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <mswsock.h>
+
+namespace loadgen {
+
+	int64_t now() noexcept;
+	double to_usec(int64_t _ticks) noexcept;
+	int64_t from_usec(double _usec) noexcept;
+
+	struct request_t {
+		const std::string* data; // 送るリクエスト(ヘッダ)。clientより長く生きていること
+		int64_t due; // 送る予定の時刻(QPC)。0なら送れるようになった時点
+	};
+
+	struct client_stats_t {
+		uint64_t requests; // 応答を受け取り終えた数
+		uint64_t bytes; // 受け取ったボディ
+		uint64_t errors; // 接続の失敗と、応答を受け取る前の切断
+		uint64_t connects;
+		std::array<uint64_t, 6> status; // ステータスの百の位ごと。0は解析できなかったもの
+		std::vector<float> latency; // 送る予定の時刻から応答の最後まで(us)。協調的な取りこぼしを含まない
+		std::vector<float> service; // 実際に送ってから応答の最後まで(us)
+	};
+
+	struct client_options_t {
+		SOCKADDR_IN address;
+		size_t connections;
+		size_t pipeline; // 応答を待たずに送るリクエストの数
+		bool keepalive; // falseならリクエストごとに接続する
+		int64_t record_from; // 予定の時刻がこれより前のリクエストは数えない(QPC)
+		int64_t until; // この時刻で送るのをやめる(QPC)
+	};
+
+	// 1スレッドで複数の接続を完了ポートで動かすHTTP/1.1クライアント
+	// 次に送るものは_sourceが接続ごとに決め、予定の時刻が来るまで送らない。falseを返した接続はそこで終わる
+	class client
+	{
+	public:
+		using source_t = std::function<bool(size_t _conn, request_t& _request)>;
+
+	private:
+		struct inflight_t {
+			int64_t due;
+			int64_t sent;
+			bool record;
+			bool head; // HEADなのでボディが無い
+		};
+
+		struct connection_t {
+			size_t index;
+			SOCKET sock;
+			OVERLAPPED send_ov;
+			OVERLAPPED recv_ov;
+			size_t ops; // 完了を待っているI/O
+			bool connecting;
+			bool sending;
+			bool done; // _sourceが尽きた
+			bool has_pending;
+			request_t pending; // 予定の時刻を待っているもの
+			std::string out; // 送信中
+			std::string queued; // 送信中に溜まったもの
+			std::vector<char> in;
+			size_t in_used;
+			std::deque<inflight_t> inflight;
+			int64_t body_remaining; // 負ならヘッダを待っている
+			uint64_t body_length;
+			int status;
+			bool close_after;
+
+			connection_t();
+		};
+
+		client_options_t options_;
+		source_t source_;
+		HANDLE port_;
+		LPFN_CONNECTEX connectex_;
+		std::vector<connection_t> conns_;
+		size_t outstanding_;
+		client_stats_t stats_;
+
+		void fill(connection_t& _conn, int64_t _now);
+		void flush(connection_t& _conn, int64_t _now);
+		bool connect(connection_t& _conn);
+		bool post_recv(connection_t& _conn);
+		void parse(connection_t& _conn, int64_t _now);
+		void complete(connection_t& _conn, int64_t _now);
+		void close(connection_t& _conn, bool _error);
+		void on_send(connection_t& _conn, DWORD _error, DWORD _transferred, int64_t _now);
+		void on_recv(connection_t& _conn, DWORD _error, DWORD _transferred, int64_t _now);
+		DWORD wait_msec(int64_t _now) const noexcept;
+
+	public:
+		client(const client_options_t& _options, source_t _source);
+		~client();
+
+		// コピー不可
+		client(const client&) = delete;
+		client& operator = (const client&) = delete;
+		// ムーブ不可
+		client(client&&) = delete;
+		client& operator = (client&&) = delete;
+
+		// untilまで、または全ての接続で_sourceが尽きて応答が揃うまで
+		bool run();
+
+		const client_stats_t& stats() const noexcept;
+	};
+
+	struct summary_t {
+		size_t count;
+		double p50;
+		double p90;
+		double p99;
+		double p999;
+		double max;
+	};
+
+	// _valuesは並べ替える
+	summary_t summarize(std::vector<float>& _values);
+
+	// 引数は --name=value の形。無ければ_def
+	using args_t = std::vector<std::string>;
+	std::string option(const args_t& _args, std::string_view _name, std::string_view _def);
+	uint64_t option_uint(const args_t& _args, std::string_view _name, uint64_t _def);
+	double option_double(const args_t& _args, std::string_view _name, double _def);
+	bool resolve(const std::string& _host, uint16_t _port, SOCKADDR_IN& _address);
+}
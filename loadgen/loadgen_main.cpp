@@ -0,0 +1,246 @@
+﻿#include "client.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// サーバーに負荷をかけて、スループットと応答時間のパーセンタイルを出す
+// rateを指定すると予定の時刻どおりに送り(開ループ)、応答時間は予定の時刻から測るので協調的な取りこぼしを含まない
+// rateが0なら応答が返りしだい次を送り(閉ループ)、送れなかった分は平均の間隔から補って出す
+namespace {
+
+	struct url_t {
+		double weight;
+		std::string path;
+	};
+
+	// 1行に「重み パス」。#から後はコメント
+	bool load_urls(const std::string& _file, std::vector<url_t>& _urls)
+	{
+		std::ifstream in(_file);
+		if (!in)
+		{
+			std::printf("Error: cannot open %s\n", _file.c_str());
+			return false;
+		}
+		std::string line;
+		while (std::getline(in, line))
+		{
+			line = line.substr(0, line.find('#'));
+			std::istringstream fields(line);
+			url_t url = {};
+			if (!(fields >> url.weight >> url.path)) continue;
+			if (url.weight <= 0.0 || !url.path.starts_with("/")) continue;
+			_urls.push_back(url);
+		}
+		if (_urls.empty())
+		{
+			std::printf("Error: no urls in %s\n", _file.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	std::string make_request(const std::string& _host, const std::string& _path, bool _keepalive)
+	{
+		std::string r;
+		r.append("GET ").append(_path).append(" HTTP/1.1\r\n");
+		r.append("Host: ").append(_host).append("\r\n");
+		r.append("User-Agent: loadgen\r\n");
+		if (!_keepalive) r.append("Connection: close\r\n");
+		r.append("\r\n");
+		return r;
+	}
+
+	// 閉ループでは詰まっている間に送るはずだったリクエストが数に入らない
+	// 平均の間隔_intervalより長くかかったものは、その間に待たされたはずの分を足す(HdrHistogramのexpected interval)
+	std::vector<float> backfill(const std::vector<float>& _service, double _interval)
+	{
+		constexpr size_t MAX_PER_SAMPLE = 100000;
+
+		std::vector<float> r(_service);
+		if (_interval <= 0.0) return r;
+		for (auto x : _service)
+		{
+			size_t n = 0;
+			for (double missed = x - _interval; missed >= _interval && n < MAX_PER_SAMPLE; missed -= _interval, ++n)
+			{
+				r.push_back(static_cast<float>(missed));
+			}
+		}
+		return r;
+	}
+
+	void print(const char* _variant, loadgen::summary_t _summary)
+	{
+		std::printf("%-12s %-16s count=%-8llu p50=%.2fus p90=%.2fus p99=%.2fus p999=%.2fus max=%.2fus\n",
+			"loadgen", _variant, static_cast<unsigned long long>(_summary.count),
+			_summary.p50, _summary.p90, _summary.p99, _summary.p999, _summary.max);
+	}
+
+	void usage()
+	{
+		std::printf(
+			"usage: loadgen [--name=value ...]\n"
+			"  --host=127.0.0.1   server address\n"
+			"  --port=20082\n"
+			"  --connections=64   concurrent connections\n"
+			"  --threads=4        threads sharing the connections\n"
+			"  --pipeline=1       requests in flight per connection (keep-alive only)\n"
+			"  --keepalive=1      0 reconnects for every request\n"
+			"  --duration=10      measured seconds, after warmup\n"
+			"  --warmup=2         seconds that are not counted\n"
+			"  --rate=0           total requests per second; 0 sends as soon as a response arrives\n"
+			"  --urls=FILE        URL mix, one \"weight path\" per line\n"
+			"  --path=/           path when no urls file is given\n");
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	loadgen::args_t args(argv + 1, argv + argc);
+	if (std::find(args.begin(), args.end(), "--help") != args.end())
+	{
+		usage();
+		return 0;
+	}
+
+	auto host = loadgen::option(args, "host", "127.0.0.1");
+	auto port = static_cast<uint16_t>(loadgen::option_uint(args, "port", 20082));
+	auto connections = std::max<uint64_t>(loadgen::option_uint(args, "connections", 64), 1);
+	auto threads = std::clamp<uint64_t>(loadgen::option_uint(args, "threads", 4), 1, connections);
+	auto pipeline = std::max<uint64_t>(loadgen::option_uint(args, "pipeline", 1), 1);
+	auto keepalive = loadgen::option_uint(args, "keepalive", 1) != 0;
+	auto duration = loadgen::option_double(args, "duration", 10.0);
+	auto warmup = loadgen::option_double(args, "warmup", 2.0);
+	auto rate = loadgen::option_double(args, "rate", 0.0);
+	auto urls_file = loadgen::option(args, "urls", "");
+	if (!keepalive) pipeline = 1;
+
+	std::vector<url_t> urls;
+	if (urls_file.empty())
+	{
+		urls.push_back({ 1.0, loadgen::option(args, "path", "/") });
+	}
+	else if (!load_urls(urls_file, urls))
+	{
+		return 1;
+	}
+	std::vector<std::string> requests;
+	std::vector<double> weights;
+	for (const auto& x : urls)
+	{
+		requests.push_back(make_request(host, x.path, keepalive));
+		weights.push_back(x.weight);
+	}
+
+	WSADATA wsa;
+	if (::WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+	{
+		std::printf("Error: WSAStartup\n");
+		return 1;
+	}
+
+	loadgen::client_options_t base = {};
+	if (!loadgen::resolve(host, port, base.address))
+	{
+		::WSACleanup();
+		return 1;
+	}
+	base.pipeline = static_cast<size_t>(pipeline);
+	base.keepalive = keepalive;
+
+	std::printf("Info: %s:%u connections=%llu threads=%llu pipeline=%llu keepalive=%d rate=%.0f duration=%.1fs warmup=%.1fs urls=%zu\n",
+		host.c_str(), port, static_cast<unsigned long long>(connections), static_cast<unsigned long long>(threads),
+		static_cast<unsigned long long>(pipeline), keepalive ? 1 : 0, rate, duration, warmup, urls.size());
+
+	auto start = loadgen::now();
+	base.record_from = start + loadgen::from_usec(warmup * 1000000.0);
+	base.until = base.record_from + loadgen::from_usec(duration * 1000000.0);
+	// 開ループでは1接続あたりこの間隔で送る。接続ごとに始まりをずらす
+	auto interval = rate > 0.0 ? loadgen::from_usec(1000000.0 * static_cast<double>(connections) / rate) : 0;
+
+	std::vector<std::unique_ptr<loadgen::client>> clients;
+	std::vector<std::thread> workers;
+	std::atomic<bool> failed = false;
+	size_t first = 0;
+	for (uint64_t t = 0; t < threads; ++t)
+	{
+		auto options = base;
+		options.connections = static_cast<size_t>(connections / threads + (t < connections % threads ? 1 : 0));
+
+		std::vector<int64_t> next(options.connections);
+		for (size_t i = 0; i < next.size(); ++i)
+		{
+			next.at(i) = start + loadgen::from_usec(1000000.0 * static_cast<double>(first + i) / std::max(rate, 1.0));
+		}
+		first += options.connections;
+
+		auto source = [&requests, &weights, interval, next = std::move(next), random = std::mt19937(static_cast<uint32_t>(t + 1)),
+			mix = std::discrete_distribution<size_t>(weights.begin(), weights.end())](size_t _conn, loadgen::request_t& _request) mutable {
+			_request.data = &requests.at(mix(random));
+			_request.due = 0;
+			if (interval > 0)
+			{
+				_request.due = next.at(_conn);
+				next.at(_conn) += interval;
+			}
+			return true;
+		};
+		clients.push_back(std::make_unique<loadgen::client>(options, std::move(source)));
+	}
+	for (auto& x : clients)
+	{
+		workers.emplace_back([&x, &failed] {
+			if (!x->run()) failed = true;
+		});
+	}
+	for (auto& x : workers)
+	{
+		x.join();
+	}
+	if (failed) std::printf("Error: client could not start\n");
+
+	loadgen::client_stats_t total = {};
+	for (const auto& x : clients)
+	{
+		const auto& s = x->stats();
+		total.requests += s.requests;
+		total.bytes += s.bytes;
+		total.errors += s.errors;
+		total.connects += s.connects;
+		for (size_t i = 0; i < total.status.size(); ++i) total.status.at(i) += s.status.at(i);
+		total.latency.insert(total.latency.end(), s.latency.begin(), s.latency.end());
+		total.service.insert(total.service.end(), s.service.begin(), s.service.end());
+	}
+	clients.clear();
+	::WSACleanup();
+
+	std::printf("%-12s %-16s requests=%llu rps=%.1f MB/s=%.2f errors=%llu connects=%llu\n", "loadgen", "total",
+		static_cast<unsigned long long>(total.requests), static_cast<double>(total.requests) / duration,
+		static_cast<double>(total.bytes) / duration / (1024.0 * 1024.0),
+		static_cast<unsigned long long>(total.errors), static_cast<unsigned long long>(total.connects));
+	std::printf("%-12s %-16s 2xx=%llu 3xx=%llu 4xx=%llu 5xx=%llu other=%llu\n", "loadgen", "status",
+		total.status.at(2), total.status.at(3), total.status.at(4), total.status.at(5), total.status.at(0));
+
+	if (rate > 0.0)
+	{
+		print("latency", loadgen::summarize(total.latency));
+	}
+	else if (total.requests > 0)
+	{
+		// 送り口1つ(接続×パイプライン)あたりの平均の間隔
+		auto expected = duration * 1000000.0 * static_cast<double>(connections * pipeline) / static_cast<double>(total.requests);
+		auto corrected = backfill(total.service, expected);
+		print("latency", loadgen::summarize(corrected));
+	}
+	print("service", loadgen::summarize(total.service));
+	return failed || total.requests == 0 ? 1 : 0;
+}
@@ -0,0 +1,267 @@
+﻿#include "client.hpp"
+
+#include "capture_format.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// CAPTURE_FILEに記録したリクエストを記録した接続ごとに送り直す
+// --speed=1 で記録した間隔のまま、2なら2倍の速さ、maxなら応答が返りしだい次を送る
+// --check では記録の形式を書き出して読み戻し、元に戻るか確かめる
+namespace {
+
+	bool read_file(const std::string& _path, std::string& _data)
+	{
+		std::ifstream in(_path, std::ios::binary);
+		if (!in)
+		{
+			std::printf("Error: cannot open %s\n", _path.c_str());
+			return false;
+		}
+		_data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		return true;
+	}
+
+	void print(const char* _variant, loadgen::summary_t _summary)
+	{
+		std::printf("%-12s %-16s count=%-8llu p50=%.2fus p90=%.2fus p99=%.2fus p999=%.2fus max=%.2fus\n",
+			"replay", _variant, static_cast<unsigned long long>(_summary.count),
+			_summary.p50, _summary.p90, _summary.p99, _summary.p999, _summary.max);
+	}
+
+	// 可変長整数の桁の境目を多めに混ぜる
+	uint64_t random_varint(std::mt19937_64& _random)
+	{
+		static const uint64_t edges[] = { 0, 1, 127, 128, 16383, 16384, 2097151, 2097152, 0xffffffffull, 0x100000000ull, ~0ull };
+		if (_random() % 4 == 0) return edges[_random() % std::size(edges)];
+		return _random() >> (_random() % 64);
+	}
+
+	int check(const loadgen::args_t& _args)
+	{
+		struct expected_t {
+			uint64_t delta_usec;
+			uint64_t id;
+			std::string data;
+		};
+
+		auto cases = loadgen::option_uint(_args, "cases", 10000);
+		std::mt19937_64 random(loadgen::option_uint(_args, "seed", 1));
+		uint64_t mismatches = 0;
+
+		std::vector<expected_t> expected;
+		std::vector<char> buf;
+		FILETIME start = { 0x89abcdef, 0x01234567 };
+		app::append_capture_header(buf, start);
+		size_t last = buf.size();
+		for (uint64_t i = 0; i < cases; ++i)
+		{
+			expected_t x = { random_varint(random), random_varint(random), std::string(random() % 512, '\0') };
+			for (auto& c : x.data) c = static_cast<char>(random());
+			last = buf.size();
+			app::append_capture_record(buf, x.delta_usec, x.id, x.data.data(), x.data.size());
+			expected.push_back(std::move(x));
+		}
+
+		std::string_view data(buf.data(), buf.size());
+		app::capture_file_t file;
+		if (!app::parse_capture(data, file) || file.trailing != 0 || file.records.size() != expected.size()
+			|| file.start.dwLowDateTime != start.dwLowDateTime || file.start.dwHighDateTime != start.dwHighDateTime)
+		{
+			mismatches++;
+		}
+		for (size_t i = 0; i < std::min(file.records.size(), expected.size()); ++i)
+		{
+			const auto& r = file.records.at(i);
+			const auto& x = expected.at(i);
+			if (r.delta_usec != x.delta_usec || r.id != x.id || r.data != x.data) mismatches++;
+		}
+
+		// 書いている途中で止まったファイルは最後のレコードだけを除いて読める
+		for (size_t cut = last + 1; cases > 0 && cut < buf.size(); cut += 1 + (buf.size() - last) / 64)
+		{
+			if (!app::parse_capture(data.substr(0, cut), file) || file.records.size() != expected.size() - 1 || file.trailing != cut - last) mismatches++;
+		}
+		if (app::parse_capture(data.substr(0, app::CAPTURE_HEADER_SIZE - 1), file) || app::parse_capture("HSCAP002" + std::string(8, '\0'), file)) mismatches++;
+
+		// 実際の記録は読んで書き直すと同じバイト列になる
+		auto path = loadgen::option(_args, "file", "");
+		if (!path.empty())
+		{
+			std::string bytes;
+			if (!read_file(path, bytes)) return 1;
+			if (!app::parse_capture(bytes, file))
+			{
+				std::printf("Error: %s is not a capture file\n", path.c_str());
+				return 1;
+			}
+			std::vector<char> rewritten;
+			app::append_capture_header(rewritten, file.start);
+			for (const auto& r : file.records) app::append_capture_record(rewritten, r.delta_usec, r.id, r.data.data(), r.data.size());
+			if (rewritten.size() + file.trailing != bytes.size() || !std::equal(rewritten.begin(), rewritten.end(), bytes.begin())) mismatches++;
+			std::printf("%-12s %-16s records=%zu trailing=%zu\n", "replay", "file", file.records.size(), file.trailing);
+		}
+
+		std::printf("%-12s %-16s cases=%llu mismatches=%llu\n", "replay", "check",
+			static_cast<unsigned long long>(cases), static_cast<unsigned long long>(mismatches));
+		return mismatches == 0 ? 0 : 1;
+	}
+
+	int replay(const loadgen::args_t& _args)
+	{
+		auto path = loadgen::option(_args, "file", "");
+		auto host = loadgen::option(_args, "host", "127.0.0.1");
+		auto port = static_cast<uint16_t>(loadgen::option_uint(_args, "port", 20082));
+		auto speed_text = loadgen::option(_args, "speed", "1");
+		auto max_speed = speed_text == "max";
+		auto speed = max_speed ? 0.0 : loadgen::option_double(_args, "speed", 1.0);
+		auto fold = loadgen::option_uint(_args, "connections", 0);
+		auto threads = std::max<uint64_t>(loadgen::option_uint(_args, "threads", 1), 1);
+		auto pipeline = std::max<uint64_t>(loadgen::option_uint(_args, "pipeline", 1), 1);
+		auto timeout = loadgen::option_double(_args, "timeout", 60.0);
+		if (path.empty() || (!max_speed && speed <= 0.0))
+		{
+			std::printf("usage: replay --file=CAPTURE [--speed=1|<factor>|max] [--host=127.0.0.1 --port=20082 --connections=0 --threads=1 --pipeline=1 --timeout=60]\n");
+			std::printf("       replay --check [--file=CAPTURE --cases=10000 --seed=1]\n");
+			return 1;
+		}
+
+		std::string bytes;
+		if (!read_file(path, bytes)) return 1;
+		app::capture_file_t file;
+		if (!app::parse_capture(bytes, file))
+		{
+			std::printf("Error: %s is not a capture file\n", path.c_str());
+			return 1;
+		}
+		if (file.trailing > 0) std::printf("Info: ignored %zu bytes of an incomplete record at the end\n", file.trailing);
+		if (file.records.empty())
+		{
+			std::printf("Error: no records in %s\n", path.c_str());
+			return 1;
+		}
+
+		// 記録した接続ごとに時刻の順に並べる。--connectionsを指定すればその数に畳む
+		std::vector<std::string> requests;
+		std::vector<int64_t> offsets; // 最初のレコードからの経過(us)
+		std::vector<std::vector<size_t>> streams;
+		std::unordered_map<uint64_t, size_t> stream_of;
+		uint64_t elapsed = 0;
+		for (size_t i = 0; i < file.records.size(); ++i)
+		{
+			const auto& r = file.records.at(i);
+			if (i > 0) elapsed += r.delta_usec;
+			auto [it, added] = stream_of.try_emplace(r.id, stream_of.size());
+			auto index = fold > 0 ? it->second % fold : it->second;
+			if (index >= streams.size()) streams.resize(index + 1);
+			streams.at(index).push_back(i);
+			requests.emplace_back(r.data);
+			offsets.push_back(static_cast<int64_t>(elapsed));
+		}
+		threads = std::min<uint64_t>(threads, streams.size());
+
+		WSADATA wsa;
+		if (::WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+		{
+			std::printf("Error: WSAStartup\n");
+			return 1;
+		}
+		loadgen::client_options_t base = {};
+		if (!loadgen::resolve(host, port, base.address))
+		{
+			::WSACleanup();
+			return 1;
+		}
+		base.pipeline = static_cast<size_t>(pipeline);
+		base.keepalive = true;
+
+		auto span = max_speed ? 0.0 : static_cast<double>(elapsed) / speed;
+		std::printf("Info: %s:%u records=%zu connections=%zu span=%.1fs speed=%s threads=%llu pipeline=%llu\n",
+			host.c_str(), port, requests.size(), streams.size(), static_cast<double>(elapsed) / 1000000.0, speed_text.c_str(),
+			static_cast<unsigned long long>(threads), static_cast<unsigned long long>(pipeline));
+
+		auto start = loadgen::now();
+		base.record_from = 0;
+		base.until = start + loadgen::from_usec(span + timeout * 1000000.0);
+
+		// スレッドtは記録した接続のうちt番目からスレッドの数おきに受け持つ
+		std::vector<std::unique_ptr<loadgen::client>> clients;
+		for (uint64_t t = 0; t < threads; ++t)
+		{
+			std::vector<const std::vector<size_t>*> mine;
+			for (size_t i = static_cast<size_t>(t); i < streams.size(); i += static_cast<size_t>(threads)) mine.push_back(&streams.at(i));
+
+			auto options = base;
+			options.connections = mine.size();
+			std::vector<size_t> next(mine.size());
+			auto source = [&requests, &offsets, mine = std::move(mine), next = std::move(next), start, speed, max_speed]
+				(size_t _conn, loadgen::request_t& _request) mutable {
+				const auto& stream = *mine.at(_conn);
+				auto& pos = next.at(_conn);
+				if (pos >= stream.size()) return false;
+				auto i = stream.at(pos++);
+				_request.data = &requests.at(i);
+				_request.due = max_speed ? 0 : start + loadgen::from_usec(static_cast<double>(offsets.at(i)) / speed);
+				return true;
+			};
+			clients.push_back(std::make_unique<loadgen::client>(options, std::move(source)));
+		}
+
+		std::vector<std::thread> workers;
+		std::atomic<bool> failed = false;
+		for (auto& x : clients)
+		{
+			workers.emplace_back([&x, &failed] {
+				if (!x->run()) failed = true;
+			});
+		}
+		for (auto& x : workers)
+		{
+			x.join();
+		}
+		auto seconds = loadgen::to_usec(loadgen::now() - start) / 1000000.0;
+		if (failed) std::printf("Error: client could not start\n");
+
+		loadgen::client_stats_t total = {};
+		for (const auto& x : clients)
+		{
+			const auto& s = x->stats();
+			total.requests += s.requests;
+			total.bytes += s.bytes;
+			total.errors += s.errors;
+			total.connects += s.connects;
+			for (size_t i = 0; i < total.status.size(); ++i) total.status.at(i) += s.status.at(i);
+			total.latency.insert(total.latency.end(), s.latency.begin(), s.latency.end());
+			total.service.insert(total.service.end(), s.service.begin(), s.service.end());
+		}
+		clients.clear();
+		::WSACleanup();
+
+		std::printf("%-12s %-16s requests=%llu unanswered=%llu seconds=%.2f rps=%.1f MB/s=%.2f errors=%llu connects=%llu\n", "replay", "total",
+			static_cast<unsigned long long>(total.requests), static_cast<unsigned long long>(requests.size() - std::min<uint64_t>(total.requests, requests.size())),
+			seconds, static_cast<double>(total.requests) / seconds, static_cast<double>(total.bytes) / seconds / (1024.0 * 1024.0),
+			static_cast<unsigned long long>(total.errors), static_cast<unsigned long long>(total.connects));
+		std::printf("%-12s %-16s 2xx=%llu 3xx=%llu 4xx=%llu 5xx=%llu other=%llu\n", "replay", "status",
+			total.status.at(2), total.status.at(3), total.status.at(4), total.status.at(5), total.status.at(0));
+		// 記録どおりの時刻から測った応答時間。サーバーが追いつけなければここに遅れが出る
+		if (!max_speed) print("latency", loadgen::summarize(total.latency));
+		print("service", loadgen::summarize(total.service));
+		return failed || total.requests == 0 ? 1 : 0;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	loadgen::args_t args(argv + 1, argv + argc);
+	if (std::find(args.begin(), args.end(), "--check") != args.end()) return check(args);
+	return replay(args);
+}
@@ -0,0 +1,287 @@
+﻿<#
+.SYNOPSIS
+性能の回帰テスト。生成したhtdocsでサーバーを起動し、決まったシナリオをloadgenで流して、baseline.jsonの値と比べる。
+
+.DESCRIPTION
+作業フォルダにhttpserver.exeとhttpserver.iniを置いて起動するので、普段使っている設定やhtdocsには触らない。
+シナリオごとに前後でMETRICS_PATHを取得し、常駐メモリ、1リクエストあたりのI/O呼び出しとCPU時間を求める。
+ベースラインの許容幅より悪くなった値があるか、ベースラインに値が無い(nullの)項目があるか、loadgenがエラーを数えたら終了コード1で終わる。
+ベースラインが無い項目は -Update で記録してから比べる。
+
+.EXAMPLE
+powershell -ExecutionPolicy Bypass -File regress\regress.ps1
+powershell -ExecutionPolicy Bypass -File regress\regress.ps1 -Scenario small-keepalive,huge -Update
+#>
+param(
+	# httpserver.exeとloadgen.exeのあるフォルダ
+	[string]$Bin = (Join-Path $PSScriptRoot "..\bin\Release\x64"),
+	[string]$Baseline = (Join-Path $PSScriptRoot "baseline.json"),
+	# htdocsと作業用の設定を置くフォルダ。コーパスは次回も使い回す
+	[string]$Work = (Join-Path $env:TEMP "httpserver-regress"),
+	[int]$Port = 20182,
+	[int]$Duration = 10,
+	[int]$Warmup = 2,
+	# 大きなファイル1つあたりのMB
+	[int]$HugeMB = 256,
+	# 指定したシナリオだけ流す
+	[string[]]$Scenario = @(),
+	# 測った値でベースラインを書き換える(許容幅はそのまま)
+	[switch]$Update
+)
+
+$ErrorActionPreference = "Stop"
+# -File で起動すると "a,b" が1つの文字列で渡る
+$Scenario = @($Scenario | ForEach-Object { $_ -split "," } | Where-Object { $_ -ne "" })
+# .NETの書き込みはPowerShellのカレントを見ないので絶対パスにする
+$Baseline = (Resolve-Path $Baseline).Path
+
+$CorpusVersion = "1-$HugeMB"
+$MetricsPath = "/__metrics"
+
+# 名前, URLの混ぜ方, loadgenの引数
+$Scenarios = @(
+	@{ name = "small-keepalive"; urls = "small"; args = @("--connections=64", "--threads=4") },
+	@{ name = "small-pipeline"; urls = "small"; args = @("--connections=16", "--threads=4", "--pipeline=8") },
+	@{ name = "small-connect"; urls = "small"; args = @("--connections=16", "--threads=2", "--keepalive=0") },
+	@{ name = "deep"; urls = "deep"; args = @("--connections=64", "--threads=4") },
+	@{ name = "huge"; urls = "huge"; args = @("--connections=4", "--threads=2") },
+	@{ name = "notfound-storm"; urls = "missing"; args = @("--connections=64", "--threads=4") },
+	@{ name = "mixed-rate"; urls = "mixed"; args = @("--connections=64", "--threads=4", "--rate=5000") }
+)
+
+function Write-Bytes([string]$Path, [int]$Size, [System.Random]$Random)
+{
+	$bytes = New-Object byte[] $Size
+	$Random.NextBytes($bytes)
+	[System.IO.Directory]::CreateDirectory([System.IO.Path]::GetDirectoryName($Path)) | Out-Null
+	[System.IO.File]::WriteAllBytes($Path, $bytes)
+}
+
+# 小さなファイルを多数、大きなファイルを少し、深いフォルダ、存在しないパスを作る
+# 中身は毎回同じになるよう乱数の種を固定する
+function New-Corpus([string]$Root, [string]$Urls)
+{
+	$marker = Join-Path $Root ".corpus"
+	if ((Test-Path $marker) -and (Get-Content $marker) -eq $CorpusVersion) { return }
+
+	Write-Host "Info: generating corpus in $Root"
+	if (Test-Path $Root) { Remove-Item $Root -Recurse -Force }
+	New-Item -ItemType Directory -Force $Root, $Urls | Out-Null
+	$random = New-Object System.Random 44
+
+	$small = New-Object System.Collections.Generic.List[string]
+	for ($i = 0; $i -lt 2000; $i++)
+	{
+		$path = "/small/{0:d2}/file-{1:d4}.html" -f ($i % 50), $i
+		Write-Bytes (Join-Path $Root $path.Substring(1)) (512 + $random.Next(16384)) $random
+		$small.Add($path)
+	}
+
+	$deep = New-Object System.Collections.Generic.List[string]
+	$dir = "/deep"
+	for ($i = 0; $i -lt 32; $i++)
+	{
+		$dir += "/level-{0:d2}" -f $i
+		foreach ($name in "index.html", "style.css", "app.js")
+		{
+			Write-Bytes (Join-Path $Root ($dir + "/" + $name).Substring(1)) (1024 + $random.Next(4096)) $random
+			$deep.Add($dir + "/" + $name)
+		}
+	}
+
+	$huge = New-Object System.Collections.Generic.List[string]
+	$block = New-Object byte[] (1024 * 1024)
+	$random.NextBytes($block)
+	for ($i = 0; $i -lt 2; $i++)
+	{
+		$path = "/huge/huge-$i.bin"
+		$file = Join-Path $Root $path.Substring(1)
+		[System.IO.Directory]::CreateDirectory([System.IO.Path]::GetDirectoryName($file)) | Out-Null
+		$stream = [System.IO.File]::Create($file)
+		try { for ($mb = 0; $mb -lt $HugeMB; $mb++) { $stream.Write($block, 0, $block.Length) } }
+		finally { $stream.Close() }
+		$huge.Add($path)
+	}
+
+	# 404キャッシュに収まらない数の、別々の存在しないパス
+	$missing = New-Object System.Collections.Generic.List[string]
+	for ($i = 0; $i -lt 20000; $i++) { $missing.Add("/missing/{0:d2}/page-{1:d5}.html" -f ($i % 100), $i) }
+
+	# 1行に「重み パス」
+	$small | ForEach-Object { "1 $_" } | Set-Content -Encoding ASCII (Join-Path $Urls "small.txt")
+	$deep | ForEach-Object { "1 $_" } | Set-Content -Encoding ASCII (Join-Path $Urls "deep.txt")
+	$huge | ForEach-Object { "1 $_" } | Set-Content -Encoding ASCII (Join-Path $Urls "huge.txt")
+	$missing | ForEach-Object { "1 $_" } | Set-Content -Encoding ASCII (Join-Path $Urls "missing.txt")
+	$mixed = @()
+	$mixed += $small | ForEach-Object { "40 $_" }
+	$mixed += $deep | ForEach-Object { "20 $_" }
+	$mixed += $missing | Select-Object -First 1000 | ForEach-Object { "2 $_" }
+	$mixed += $huge | ForEach-Object { "1 $_" }
+	$mixed | Set-Content -Encoding ASCII (Join-Path $Urls "mixed.txt")
+
+	Set-Content -Encoding ASCII $marker $CorpusVersion
+}
+
+# "名前{ラベル} 値" の行をハッシュテーブルにする
+function Get-Metrics
+{
+	$text = (Invoke-WebRequest -UseBasicParsing "http://127.0.0.1:$Port$MetricsPath").Content
+	$r = @{}
+	foreach ($line in $text -split "`n")
+	{
+		$line = $line.Trim()
+		if ($line.StartsWith("#") -or $line -eq "") { continue }
+		$at = $line.LastIndexOf(" ")
+		$r[$line.Substring(0, $at)] = [double]$line.Substring($at + 1)
+	}
+	return $r
+}
+
+# ラベルの違うものを合計する
+function Get-Sum($Metrics, [string]$Name)
+{
+	$sum = 0.0
+	foreach ($key in $Metrics.Keys)
+	{
+		if ($key -eq $Name -or $key.StartsWith($Name + "{")) { $sum += $Metrics[$key] }
+	}
+	return $sum
+}
+
+function Start-Server([string]$Root)
+{
+	Copy-Item (Join-Path $Bin "httpserver.exe") $Root -Force
+	@(
+		"[MAIN]",
+		"IP=127.0.0.1",
+		"PORT=$Port",
+		"CONNECTIONS=1024",
+		"METRICS_PATH=$MetricsPath",
+		"LATENCY_DUMP=0",
+		"TRACE_EVENTS=0",
+		"CAPTURE_FILE="
+	) | Set-Content -Encoding ASCII (Join-Path $Root "httpserver.ini")
+
+	$process = Start-Process (Join-Path $Root "httpserver.exe") -WorkingDirectory $Root -PassThru
+	for ($i = 0; $i -lt 50; $i++)
+	{
+		Start-Sleep -Milliseconds 200
+		try
+		{
+			Get-Metrics | Out-Null
+			return $process
+		}
+		catch { }
+	}
+	Stop-Server $process
+	throw "server did not answer on port $Port"
+}
+
+function Stop-Server($Process)
+{
+	$Process.CloseMainWindow() | Out-Null
+	if (!$Process.WaitForExit(10000)) { $Process.Kill() }
+}
+
+# loadgenの出力から値を拾う
+function Invoke-Scenario($Definition, [string]$Urls)
+{
+	$loadgen = Join-Path $Bin "loadgen.exe"
+	$arguments = @("--port=$Port", "--duration=$Duration", "--warmup=$Warmup", "--urls=" + (Join-Path $Urls ($Definition.urls + ".txt"))) + $Definition.args
+
+	$before = Get-Metrics
+	$output = & $loadgen @arguments
+	$after = Get-Metrics
+	$output | ForEach-Object { Write-Host "  $_" }
+
+	$total = $output | Where-Object { $_ -match "^loadgen\s+total\s" }
+	$latency = $output | Where-Object { $_ -match "^loadgen\s+latency\s" }
+	if (!$total -or !$latency) { throw "loadgen failed in $($Definition.name)" }
+
+	$requests = (Get-Sum $after "httpserver_requests_total") - (Get-Sum $before "httpserver_requests_total")
+	if ($requests -le 0) { $requests = [double]([regex]::Match($total, "requests=(\d+)").Groups[1].Value) }
+	$io = (Get-Sum $after "process_io_operations_total") - (Get-Sum $before "process_io_operations_total")
+	$cpu = (Get-Sum $after "process_cpu_microseconds_total") - (Get-Sum $before "process_cpu_microseconds_total")
+
+	return [ordered]@{
+		errors = [double]([regex]::Match($total, "errors=(\d+)").Groups[1].Value)
+		values = [ordered]@{
+			rps = [double]([regex]::Match($total, "rps=([\d.]+)").Groups[1].Value)
+			mbps = [double]([regex]::Match($total, "MB/s=([\d.]+)").Groups[1].Value)
+			p99_us = [double]([regex]::Match($latency, "p99=([\d.]+)us").Groups[1].Value)
+			rss_bytes = $after["process_resident_memory_bytes"]
+			io_per_request = $io / [math]::Max($requests, 1)
+			cpu_us_per_request = $cpu / [math]::Max($requests, 1)
+		}
+	}
+}
+
+$root = Join-Path $Work "server"
+$urls = Join-Path $Work "urls"
+New-Item -ItemType Directory -Force $root | Out-Null
+New-Corpus (Join-Path $root "htdocs") $urls
+
+$baselineData = Get-Content -Raw -Encoding UTF8 $Baseline | ConvertFrom-Json
+$selected = $Scenarios | Where-Object { $Scenario.Count -eq 0 -or $Scenario -contains $_.name }
+$failed = $false
+$missing = $false
+$rows = @()
+
+$server = Start-Server $root
+try
+{
+	foreach ($definition in $selected)
+	{
+		Write-Host "Info: $($definition.name)"
+		$result = Invoke-Scenario $definition $urls
+		if ($result.errors -gt 0)
+		{
+			Write-Host "Error: $($definition.name) had $($result.errors) errors"
+			$failed = $true
+		}
+
+		$expected = $baselineData.scenarios.($definition.name)
+		foreach ($metric in $result.values.Keys)
+		{
+			$measured = $result.values[$metric]
+			$limit = if ($expected) { $expected.$metric } else { $null }
+			$status = "new"
+			$change = ""
+			if ($limit -and $null -ne $limit.value)
+			{
+				$ratio = $measured / $limit.value
+				$change = "{0:+0.0;-0.0}%" -f (($ratio - 1) * 100)
+				$worse = if ($limit.better -eq "higher") { $ratio -lt 1 - $limit.tolerance } else { $ratio -gt 1 + $limit.tolerance }
+				$status = if ($worse) { "REGRESSED" } else { "ok" }
+				if ($worse) { $failed = $true }
+			}
+			elseif (!$Update)
+			{
+				# 比べる値が無いまま通すと回帰を見逃すので失敗にする
+				$status = "NO BASELINE"
+				$missing = $true
+				$failed = $true
+			}
+			$rows += "{0,-18} {1,-20} {2,14} {3,14} {4,9} {5}" -f $definition.name, $metric, $(if ($limit) { $limit.value } else { "" }), [math]::Round($measured, 3), $change, $status
+			# エラーが出た回の値は記録しない
+			if ($Update -and $limit -and $result.errors -eq 0) { $limit.value = [math]::Round($measured, 3) }
+		}
+	}
+}
+finally
+{
+	Stop-Server $server
+}
+
+Write-Host ("{0,-18} {1,-20} {2,14} {3,14} {4,9} {5}" -f "scenario", "metric", "baseline", "measured", "change", "status")
+$rows | ForEach-Object { Write-Host $_ }
+
+if ($Update)
+{
+	[System.IO.File]::WriteAllText($Baseline, ($baselineData | ConvertTo-Json -Depth 6))
+	Write-Host "Info: baseline updated. $Baseline"
+	exit 0
+}
+if ($missing) { Write-Host "Error: baseline has no value for some metrics. Record them with -Update on this machine. $Baseline" }
+if ($failed) { exit 1 }
+exit 0
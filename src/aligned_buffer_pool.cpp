@@ -0,0 +1,61 @@
+﻿#include "aligned_buffer_pool.hpp"
+
+#include "log.hpp"
+
+namespace app {
+
+	aligned_buffer_pool::aligned_buffer_pool(size_t _block_size, size_t _max_blocks)
+		: block_size_(_block_size)
+		, max_blocks_(_max_blocks)
+		, allocated_(0)
+		, free_()
+	{
+		free_.reserve(_max_blocks);
+	}
+
+	aligned_buffer_pool::~aligned_buffer_pool()
+	{
+		for (auto p : free_)
+		{
+			::VirtualFree(p, 0, MEM_RELEASE);
+		}
+	}
+
+	size_t aligned_buffer_pool::block_size() const noexcept
+	{
+		return block_size_;
+	}
+
+	size_t aligned_buffer_pool::available() const noexcept
+	{
+		return free_.size() + (max_blocks_ - allocated_);
+	}
+
+	char* aligned_buffer_pool::acquire()
+	{
+		if (!free_.empty())
+		{
+			auto p = free_.back();
+			free_.pop_back();
+			return p;
+		}
+
+		if (allocated_ >= max_blocks_) return nullptr;
+
+		// VirtualAllocはページ境界に揃う
+		auto p = reinterpret_cast<char*>(::VirtualAlloc(NULL, block_size_, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+		if (p == nullptr)
+		{
+			log(L"Error: VirtualAlloc() failed. GetLastError()=%lu", ::GetLastError());
+			return nullptr;
+		}
+		allocated_++;
+		return p;
+	}
+
+	void aligned_buffer_pool::release(char* _block)
+	{
+		if (_block == nullptr) return;
+		free_.push_back(_block);
+	}
+}
@@ -0,0 +1,35 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include <vector>
+
+namespace app {
+
+	// FILE_FLAG_NO_BUFFERING用のページ境界に揃ったバッファを使い回す
+	class aligned_buffer_pool
+	{
+	private:
+		size_t block_size_;
+		size_t max_blocks_;
+		size_t allocated_;
+		std::vector<char*> free_;
+
+	public:
+		aligned_buffer_pool(size_t _block_size, size_t _max_blocks);
+		~aligned_buffer_pool();
+
+		// コピー不可
+		aligned_buffer_pool(const aligned_buffer_pool&) = delete;
+		aligned_buffer_pool& operator = (const aligned_buffer_pool&) = delete;
+		// ムーブ不可
+		aligned_buffer_pool(aligned_buffer_pool&&) = delete;
+		aligned_buffer_pool& operator = (aligned_buffer_pool&&) = delete;
+
+		size_t block_size() const noexcept;
+		size_t available() const noexcept;
+
+		char* acquire();
+		void release(char* _block);
+	};
+}
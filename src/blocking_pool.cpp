@@ -0,0 +1,129 @@
+﻿#include "blocking_pool.hpp"
+
+#include "log.hpp"
+
+#include <algorithm>
+
+namespace {
+	constexpr size_t MAX_THREADS = 64;
+}
+
+namespace app {
+
+	blocking_pool::blocking_pool()
+		: threads_()
+		, queue_(NULL)
+		, compport_(NULL)
+		, compkey_(0)
+		, submitted_(0)
+		, inflight_(0)
+	{
+	}
+
+	blocking_pool::~blocking_pool()
+	{
+		stop();
+	}
+
+	bool blocking_pool::start(size_t _threads, HANDLE _compport, ULONG_PTR _compkey)
+	{
+		if (_threads == 0 || queue_ != NULL) return false;
+
+		compport_ = _compport;
+		compkey_ = _compkey;
+		queue_ = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+		if (queue_ == NULL)
+		{
+			log(L"Error: blocking pool CreateIoCompletionPort() failed. GetLastError()=%lu", ::GetLastError());
+			return false;
+		}
+
+		for (size_t i = 0; i < std::min(_threads, MAX_THREADS); ++i)
+		{
+			auto thread = ::CreateThread(NULL, 0, proc_common, this, 0, NULL);
+			if (thread == NULL)
+			{
+				log(L"Error: blocking pool CreateThread() failed. GetLastError()=%lu", ::GetLastError());
+				break;
+			}
+			threads_.push_back(thread);
+		}
+
+		if (threads_.empty())
+		{
+			stop();
+			return false;
+		}
+		return true;
+	}
+
+	void blocking_pool::stop()
+	{
+		// 実行中の依頼は最後まで行い、完了も送ってから止まる
+		for (size_t i = 0; i < threads_.size(); ++i)
+		{
+			::PostQueuedCompletionStatus(queue_, 0, 0, NULL);
+		}
+		for (auto x : threads_)
+		{
+			::WaitForSingleObject(x, INFINITE);
+			::CloseHandle(x);
+		}
+		threads_.clear();
+
+		if (queue_ != NULL)
+		{
+			::CloseHandle(queue_);
+			queue_ = NULL;
+		}
+	}
+
+	bool blocking_pool::is_running() const noexcept
+	{
+		return !threads_.empty();
+	}
+
+	bool blocking_pool::submit(BLOCKING_JOB* _job)
+	{
+		if (threads_.empty()) return false;
+
+		inflight_.fetch_add(1, std::memory_order_relaxed);
+		if (!::PostQueuedCompletionStatus(queue_, 0, 0, &_job->ov))
+		{
+			inflight_.fetch_sub(1, std::memory_order_relaxed);
+			return false;
+		}
+		submitted_++;
+		return true;
+	}
+
+	blocking_stats_t blocking_pool::stats() const noexcept
+	{
+		return { submitted_, inflight_.load(std::memory_order_relaxed) };
+	}
+
+	DWORD WINAPI blocking_pool::proc_common(LPVOID _p)
+	{
+		return reinterpret_cast<blocking_pool*>(_p)->proc();
+	}
+
+	DWORD blocking_pool::proc()
+	{
+		while (true)
+		{
+			DWORD transferred = 0;
+			ULONG_PTR compkey = 0;
+			LPOVERLAPPED ov = NULL;
+			::GetQueuedCompletionStatus(queue_, &transferred, &compkey, &ov, INFINITE);
+
+			// OVERLAPPEDの無い通知は停止の合図
+			if (ov == NULL) break;
+
+			auto job = reinterpret_cast<BLOCKING_JOB*>(ov);
+			job->run(job);
+			inflight_.fetch_sub(1, std::memory_order_relaxed);
+			::PostQueuedCompletionStatus(compport_, 0, job->compkey != 0 ? job->compkey : compkey_, ov);
+		}
+		return 0;
+	}
+}
@@ -0,0 +1,59 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+namespace app {
+
+	// ブロッキングスレッドで実行する同期呼び出し。runが終わったらovをそのまま完了通知としてイベントループのポートに送る
+	struct BLOCKING_JOB {
+		OVERLAPPED ov;
+		void (*run)(BLOCKING_JOB* _job);
+		ULONG_PTR compkey; // 完了通知のキー。0ならstart()で指定したキー
+	};
+
+	struct blocking_stats_t {
+		uint64_t submitted;
+		uint64_t inflight;
+	};
+
+	// ファイルを開くなど、完了通知の無い同期呼び出しをイベントループの外で行うスレッドプール
+	// 依頼の受け渡しにも専用の完了ポートを使うので、キューもロックも持たない
+	class blocking_pool
+	{
+	private:
+		std::vector<HANDLE> threads_;
+		HANDLE queue_;
+		HANDLE compport_;
+		ULONG_PTR compkey_;
+		uint64_t submitted_;
+		std::atomic<uint64_t> inflight_;
+
+		static DWORD WINAPI proc_common(LPVOID);
+		DWORD proc();
+
+	public:
+		blocking_pool();
+		~blocking_pool();
+
+		// コピー不可
+		blocking_pool(const blocking_pool&) = delete;
+		blocking_pool& operator = (const blocking_pool&) = delete;
+		// ムーブ不可
+		blocking_pool(blocking_pool&&) = delete;
+		blocking_pool& operator = (blocking_pool&&) = delete;
+
+		// 完了は_compportに_compkeyで送る。_threadsが0なら起動しない
+		bool start(size_t _threads, HANDLE _compport, ULONG_PTR _compkey);
+		void stop();
+		bool is_running() const noexcept;
+
+		// イベントループのスレッドからのみ呼ぶ
+		bool submit(BLOCKING_JOB* _job);
+
+		blocking_stats_t stats() const noexcept;
+	};
+}
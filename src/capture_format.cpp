@@ -0,0 +1,75 @@
+﻿#include "capture_format.hpp"
+
+#include <cstring>
+
+namespace {
+	constexpr char CAPTURE_MAGIC[8] = { 'H', 'S', 'C', 'A', 'P', '0', '0', '1' };
+
+	void append_varint(std::vector<char>& _buf, uint64_t _value)
+	{
+		while (_value >= 0x80)
+		{
+			_buf.push_back(static_cast<char>((_value & 0x7f) | 0x80));
+			_value >>= 7;
+		}
+		_buf.push_back(static_cast<char>(_value));
+	}
+
+	// 途中で切れているか64ビットに収まらなければfalse
+	bool read_varint(std::string_view _data, size_t& _pos, uint64_t& _value)
+	{
+		_value = 0;
+		for (unsigned shift = 0; shift < 64 && _pos < _data.size(); shift += 7)
+		{
+			auto c = static_cast<uint8_t>(_data.at(_pos++));
+			_value |= static_cast<uint64_t>(c & 0x7f) << shift;
+			if ((c & 0x80) == 0) return true;
+		}
+		return false;
+	}
+}
+
+namespace app {
+
+	void append_capture_header(std::vector<char>& _buf, const FILETIME& _start)
+	{
+		_buf.insert(_buf.end(), std::begin(CAPTURE_MAGIC), std::end(CAPTURE_MAGIC));
+		_buf.insert(_buf.end(), reinterpret_cast<const char*>(&_start), reinterpret_cast<const char*>(&_start) + sizeof(_start));
+	}
+
+	void append_capture_record(std::vector<char>& _buf, uint64_t _delta_usec, uint64_t _id, const char* _data, size_t _size)
+	{
+		append_varint(_buf, _delta_usec);
+		append_varint(_buf, _id);
+		append_varint(_buf, _size);
+		_buf.insert(_buf.end(), _data, _data + _size);
+	}
+
+	bool parse_capture(std::string_view _data, capture_file_t& _file)
+	{
+		_file.start = {};
+		_file.records.clear();
+		_file.trailing = 0;
+		if (_data.size() < CAPTURE_HEADER_SIZE || std::memcmp(_data.data(), CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0) return false;
+		std::memcpy(&_file.start, _data.data() + sizeof(CAPTURE_MAGIC), sizeof(_file.start));
+
+		size_t pos = CAPTURE_HEADER_SIZE;
+		while (pos < _data.size())
+		{
+			auto begin = pos;
+			capture_record_t r = {};
+			uint64_t size = 0;
+			if (!read_varint(_data, pos, r.delta_usec) || !read_varint(_data, pos, r.id) || !read_varint(_data, pos, size)
+				|| size > _data.size() - pos)
+			{
+				// 書いている途中で止まったもの
+				_file.trailing = _data.size() - begin;
+				break;
+			}
+			r.data = _data.substr(pos, static_cast<size_t>(size));
+			pos += static_cast<size_t>(size);
+			_file.records.push_back(r);
+		}
+		return true;
+	}
+}
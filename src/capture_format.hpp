@@ -0,0 +1,35 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace app {
+
+	// CAPTURE_FILEの形式
+	// 先頭に "HSCAP001" と記録開始時刻(FILETIME, 8バイト)
+	// 以降はレコードごとに 前のレコードからの経過(us), 接続ID, 長さ をLEB128の可変長整数で並べ、その後にヘッダ本体
+	constexpr size_t CAPTURE_HEADER_SIZE = 16;
+	// 1レコードの可変長整数の最大(10バイト×3)
+	constexpr size_t CAPTURE_RECORD_OVERHEAD = 30;
+
+	struct capture_record_t {
+		uint64_t delta_usec;
+		uint64_t id;
+		std::string_view data; // 読んだバッファを指す
+	};
+
+	struct capture_file_t {
+		FILETIME start;
+		std::vector<capture_record_t> records;
+		size_t trailing; // 末尾の途中で切れたレコードのバイト数
+	};
+
+	void append_capture_header(std::vector<char>& _buf, const FILETIME& _start);
+	void append_capture_record(std::vector<char>& _buf, uint64_t _delta_usec, uint64_t _id, const char* _data, size_t _size);
+
+	// 先頭が "HSCAP001" でなければfalse。レコードは_dataを指すので、_dataより長く使わない
+	bool parse_capture(std::string_view _data, capture_file_t& _file);
+}
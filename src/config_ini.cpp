@@ -3,6 +3,7 @@
 #include "utils.hpp"
 
 #include <vector>
+#include <cwchar>
 
 namespace {
 	std::wstring get_ini_path()
@@ -81,6 +82,26 @@ namespace app {
 		return buffer.data();
 	}
 
+	std::vector<std::pair<std::wstring, std::wstring>> config_ini::get_section(const std::wstring& _section)
+	{
+		std::vector<WCHAR> buffer(32767, L'\0');
+		auto readed = ::GetPrivateProfileSectionW(_section.c_str(), buffer.data(), buffer.size(), path_.c_str());
+
+		// key=value\0key=value\0\0
+		std::vector<std::pair<std::wstring, std::wstring>> r;
+		const WCHAR* p = buffer.data();
+		while (p < buffer.data() + readed && *p != L'\0')
+		{
+			std::wstring line = p;
+			p += line.size() + 1;
+
+			auto pos = line.find(L'=');
+			if (pos == std::wstring::npos) continue;
+			r.push_back({ line.substr(0, pos), line.substr(pos + 1) });
+		}
+		return r;
+	}
+
 	bool config_ini::set_ipaddress(const std::string& _ip)
 	{
 		auto wip = s_to_ws(_ip);
@@ -116,4 +137,381 @@ namespace app {
 	{
 		return ::GetPrivateProfileIntW(section_name, L"CONNECTIONS", 64, path_.c_str());
 	}
+
+	bool config_ini::set_reserved_connections(UINT _connections)
+	{
+		return set_value(L"RESERVED_CONNECTIONS", uint_to_ws(_connections));
+	}
+
+	UINT config_ini::get_reserved_connections()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"RESERVED_CONNECTIONS", 0, path_.c_str());
+	}
+
+	bool config_ini::set_healthcheck_ip(const std::string& _ip)
+	{
+		auto wip = s_to_ws(_ip);
+		return set_value(L"HEALTHCHECK_IP", wip);
+	}
+
+	std::string config_ini::get_healthcheck_ip()
+	{
+		auto value = ws_to_s(get_value(L"HEALTHCHECK_IP"));
+		if (value == "")
+		{
+			return "127.0.0.1";
+		}
+		return value;
+	}
+
+	bool config_ini::set_retry_after(UINT _seconds)
+	{
+		return set_value(L"RETRY_AFTER", uint_to_ws(_seconds));
+	}
+
+	UINT config_ini::get_retry_after()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"RETRY_AFTER", 5, path_.c_str());
+	}
+
+	bool config_ini::set_accept_posted(UINT _count)
+	{
+		return set_value(L"ACCEPT_POSTED", uint_to_ws(_count));
+	}
+
+	UINT config_ini::get_accept_posted()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"ACCEPT_POSTED", 8, path_.c_str());
+	}
+
+	bool config_ini::set_listen_backlog(UINT _backlog)
+	{
+		return set_value(L"LISTEN_BACKLOG", uint_to_ws(_backlog));
+	}
+
+	UINT config_ini::get_listen_backlog()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"LISTEN_BACKLOG", 0, path_.c_str());
+	}
+
+	bool config_ini::set_accept_data(bool _enable)
+	{
+		return set_value(L"ACCEPT_DATA", _enable ? L"1" : L"0");
+	}
+
+	bool config_ini::get_accept_data()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"ACCEPT_DATA", 0, path_.c_str()) != 0;
+	}
+
+	bool config_ini::set_accept_data_timeout(UINT _sec)
+	{
+		return set_value(L"ACCEPT_DATA_TIMEOUT", uint_to_ws(_sec));
+	}
+
+	UINT config_ini::get_accept_data_timeout()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"ACCEPT_DATA_TIMEOUT", 10, path_.c_str());
+	}
+
+	bool config_ini::set_tcp_nodelay(bool _enable)
+	{
+		return set_value(L"TCP_NODELAY", _enable ? L"1" : L"0");
+	}
+
+	bool config_ini::get_tcp_nodelay()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"TCP_NODELAY", 1, path_.c_str()) != 0;
+	}
+
+	bool config_ini::set_send_buffer(UINT _kb)
+	{
+		return set_value(L"SEND_BUFFER", uint_to_ws(_kb));
+	}
+
+	UINT config_ini::get_send_buffer()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"SEND_BUFFER", 0, path_.c_str());
+	}
+
+	bool config_ini::set_recv_buffer(UINT _kb)
+	{
+		return set_value(L"RECV_BUFFER", uint_to_ws(_kb));
+	}
+
+	UINT config_ini::get_recv_buffer()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"RECV_BUFFER", 0, path_.c_str());
+	}
+
+	bool config_ini::set_tcp_fastopen(bool _enable)
+	{
+		return set_value(L"TCP_FASTOPEN", _enable ? L"1" : L"0");
+	}
+
+	bool config_ini::get_tcp_fastopen()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"TCP_FASTOPEN", 0, path_.c_str()) != 0;
+	}
+
+	bool config_ini::set_completion_batch(UINT _count)
+	{
+		return set_value(L"COMPLETION_BATCH", uint_to_ws(_count));
+	}
+
+	UINT config_ini::get_completion_batch()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"COMPLETION_BATCH", 64, path_.c_str());
+	}
+
+	bool config_ini::set_blocking_threads(UINT _threads)
+	{
+		return set_value(L"BLOCKING_THREADS", uint_to_ws(_threads));
+	}
+
+	UINT config_ini::get_blocking_threads()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"BLOCKING_THREADS", 2, path_.c_str());
+	}
+
+	bool config_ini::set_send_quantum(UINT _kb)
+	{
+		return set_value(L"SEND_QUANTUM", uint_to_ws(_kb));
+	}
+
+	UINT config_ini::get_send_quantum()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"SEND_QUANTUM", 256, path_.c_str());
+	}
+
+	bool config_ini::set_bandwidth_total(UINT _kbps)
+	{
+		return set_value(L"BANDWIDTH_TOTAL", uint_to_ws(_kbps));
+	}
+
+	UINT config_ini::get_bandwidth_total()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"BANDWIDTH_TOTAL", 0, path_.c_str());
+	}
+
+	bool config_ini::set_rate_limit(UINT _per_second)
+	{
+		return set_value(L"RATE_LIMIT", uint_to_ws(_per_second));
+	}
+
+	UINT config_ini::get_rate_limit()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"RATE_LIMIT", 0, path_.c_str());
+	}
+
+	bool config_ini::set_rate_burst(UINT _requests)
+	{
+		return set_value(L"RATE_BURST", uint_to_ws(_requests));
+	}
+
+	UINT config_ini::get_rate_burst()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"RATE_BURST", 0, path_.c_str());
+	}
+
+	bool config_ini::set_connections_per_ip(UINT _connections)
+	{
+		return set_value(L"CONNECTIONS_PER_IP", uint_to_ws(_connections));
+	}
+
+	UINT config_ini::get_connections_per_ip()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"CONNECTIONS_PER_IP", 0, path_.c_str());
+	}
+
+	bool config_ini::set_rate_table(UINT _slots)
+	{
+		return set_value(L"RATE_TABLE", uint_to_ws(_slots));
+	}
+
+	UINT config_ini::get_rate_table()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"RATE_TABLE", 4096, path_.c_str());
+	}
+
+	bool config_ini::set_metrics_path(const std::string& _path)
+	{
+		return set_value(L"METRICS_PATH", s_to_ws(_path));
+	}
+
+	std::string config_ini::get_metrics_path()
+	{
+		auto value = ws_to_s(get_value(L"METRICS_PATH"));
+		if (value == "")
+		{
+			return "/__metrics";
+		}
+		return value;
+	}
+
+	bool config_ini::set_latency_dump(UINT _seconds)
+	{
+		return set_value(L"LATENCY_DUMP", uint_to_ws(_seconds));
+	}
+
+	UINT config_ini::get_latency_dump()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"LATENCY_DUMP", 60, path_.c_str());
+	}
+
+	bool config_ini::set_trace_events(UINT _events)
+	{
+		return set_value(L"TRACE_EVENTS", uint_to_ws(_events));
+	}
+
+	UINT config_ini::get_trace_events()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"TRACE_EVENTS", 0, path_.c_str());
+	}
+
+	bool config_ini::set_trace_path(const std::string& _path)
+	{
+		return set_value(L"TRACE_PATH", s_to_ws(_path));
+	}
+
+	std::string config_ini::get_trace_path()
+	{
+		auto value = ws_to_s(get_value(L"TRACE_PATH"));
+		if (value == "")
+		{
+			return "/__trace";
+		}
+		return value;
+	}
+
+	bool config_ini::set_stall_threshold(UINT _ms)
+	{
+		return set_value(L"STALL_THRESHOLD", uint_to_ws(_ms));
+	}
+
+	UINT config_ini::get_stall_threshold()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"STALL_THRESHOLD", 20, path_.c_str());
+	}
+
+	bool config_ini::set_capture_file(const std::string& _path)
+	{
+		return set_value(L"CAPTURE_FILE", s_to_ws(_path));
+	}
+
+	std::string config_ini::get_capture_file()
+	{
+		return ws_to_s(get_value(L"CAPTURE_FILE"));
+	}
+
+	bool config_ini::set_capture_limit(UINT _mb)
+	{
+		return set_value(L"CAPTURE_LIMIT", uint_to_ws(_mb));
+	}
+
+	UINT config_ini::get_capture_limit()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"CAPTURE_LIMIT", 256, path_.c_str());
+	}
+
+	bool config_ini::set_notfound_cache(UINT _entries)
+	{
+		return set_value(L"NOTFOUND_CACHE", uint_to_ws(_entries));
+	}
+
+	UINT config_ini::get_notfound_cache()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"NOTFOUND_CACHE", 1024, path_.c_str());
+	}
+
+	bool config_ini::set_read_ahead(UINT _buffers)
+	{
+		return set_value(L"READ_AHEAD", uint_to_ws(_buffers));
+	}
+
+	UINT config_ini::get_read_ahead()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"READ_AHEAD", 4, path_.c_str());
+	}
+
+	bool config_ini::set_read_chunk_max(UINT _kb)
+	{
+		return set_value(L"READ_CHUNK_MAX", uint_to_ws(_kb));
+	}
+
+	UINT config_ini::get_read_chunk_max()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"READ_CHUNK_MAX", 1024, path_.c_str());
+	}
+
+	bool config_ini::set_direct_io_threshold(UINT _mb)
+	{
+		return set_value(L"DIRECT_IO_THRESHOLD", uint_to_ws(_mb));
+	}
+
+	UINT config_ini::get_direct_io_threshold()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"DIRECT_IO_THRESHOLD", 0, path_.c_str());
+	}
+
+	bool config_ini::set_direct_io_streams(UINT _streams)
+	{
+		return set_value(L"DIRECT_IO_STREAMS", uint_to_ws(_streams));
+	}
+
+	UINT config_ini::get_direct_io_streams()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"DIRECT_IO_STREAMS", 4, path_.c_str());
+	}
+
+	bool config_ini::set_early_hints_prefetch(bool _prefetch)
+	{
+		return set_value(L"EARLYHINTS_PREFETCH", _prefetch ? L"1" : L"0");
+	}
+
+	bool config_ini::get_early_hints_prefetch()
+	{
+		return ::GetPrivateProfileIntW(section_name, L"EARLYHINTS_PREFETCH", 1, path_.c_str()) != 0;
+	}
+
+	std::vector<std::pair<std::string, uint32_t>> config_ini::get_bandwidth()
+	{
+		// [BANDWIDTH]
+		// /videos/=2048
+		// video/=1024
+		std::vector<std::pair<std::string, uint32_t>> r;
+		for (const auto& [key, value] : get_section(L"BANDWIDTH"))
+		{
+			auto kbps = std::wcstoul(value.c_str(), nullptr, 10);
+			if (key != L"") r.push_back({ ws_to_s(key), static_cast<uint32_t>(kbps) });
+		}
+		return r;
+	}
+
+	std::unordered_map<std::string, std::vector<std::string>> config_ini::get_early_hints()
+	{
+		// [EARLYHINTS]
+		// /index.html=/css/style.css,/js/app.js
+		std::unordered_map<std::string, std::vector<std::string>> r;
+		for (const auto& [key, value] : get_section(L"EARLYHINTS"))
+		{
+			std::vector<std::string> resources;
+			auto s = ws_to_s(value);
+			size_t pos = 0;
+			while (pos <= s.size())
+			{
+				auto next = s.find(',', pos);
+				if (next == std::string::npos) next = s.size();
+				auto a = s.find_first_not_of(" \t", pos);
+				auto b = s.find_last_not_of(" \t", next - 1);
+				if (a != std::string::npos && a < next && b != std::string::npos && b >= a)
+				{
+					resources.push_back(s.substr(a, b - a + 1));
+				}
+				pos = next + 1;
+			}
+			if (!resources.empty()) r.insert({ ws_to_s(key), resources });
+		}
+		return r;
+	}
 }
@@ -3,6 +3,8 @@
 #include "common.hpp"
 
 #include <string>
+#include <vector>
+#include <unordered_map>
 
 namespace app
 {
@@ -14,6 +16,7 @@ namespace app
 
 		bool set_value(const std::wstring& _key, const std::wstring& _value);
 		std::wstring get_value(const std::wstring& _key);
+		std::vector<std::pair<std::wstring, std::wstring>> get_section(const std::wstring& _section);
 
 	public:
 		config_ini();
@@ -27,5 +30,80 @@ namespace app
 
 		bool set_connections(UINT _connections);
 		UINT get_connections();
+
+		bool set_reserved_connections(UINT _connections);
+		UINT get_reserved_connections();
+
+		bool set_healthcheck_ip(const std::string& _ipaddress);
+		std::string get_healthcheck_ip();
+
+		bool set_retry_after(UINT _seconds);
+		UINT get_retry_after();
+		bool set_accept_posted(UINT _count);
+		UINT get_accept_posted();
+		bool set_listen_backlog(UINT _backlog);
+		UINT get_listen_backlog();
+		bool set_accept_data(bool _enable);
+		bool get_accept_data();
+		bool set_accept_data_timeout(UINT _sec);
+		UINT get_accept_data_timeout();
+		bool set_tcp_nodelay(bool _enable);
+		bool get_tcp_nodelay();
+		bool set_send_buffer(UINT _kb);
+		UINT get_send_buffer();
+		bool set_recv_buffer(UINT _kb);
+		UINT get_recv_buffer();
+		bool set_tcp_fastopen(bool _enable);
+		bool get_tcp_fastopen();
+		bool set_completion_batch(UINT _count);
+		UINT get_completion_batch();
+		bool set_blocking_threads(UINT _threads);
+		UINT get_blocking_threads();
+		bool set_send_quantum(UINT _kb);
+		UINT get_send_quantum();
+		bool set_bandwidth_total(UINT _kbps);
+		UINT get_bandwidth_total();
+		std::vector<std::pair<std::string, uint32_t>> get_bandwidth();
+		bool set_rate_limit(UINT _per_second);
+		UINT get_rate_limit();
+		bool set_rate_burst(UINT _requests);
+		UINT get_rate_burst();
+		bool set_connections_per_ip(UINT _connections);
+		UINT get_connections_per_ip();
+		bool set_rate_table(UINT _slots);
+		UINT get_rate_table();
+		bool set_metrics_path(const std::string& _path);
+		std::string get_metrics_path();
+		bool set_latency_dump(UINT _seconds);
+		UINT get_latency_dump();
+		bool set_trace_events(UINT _events);
+		UINT get_trace_events();
+		bool set_trace_path(const std::string& _path);
+		std::string get_trace_path();
+		bool set_stall_threshold(UINT _ms);
+		UINT get_stall_threshold();
+		bool set_capture_file(const std::string& _path);
+		std::string get_capture_file();
+		bool set_capture_limit(UINT _mb);
+		UINT get_capture_limit();
+
+		bool set_notfound_cache(UINT _entries);
+		UINT get_notfound_cache();
+
+		bool set_read_ahead(UINT _buffers);
+		UINT get_read_ahead();
+
+		bool set_read_chunk_max(UINT _kb);
+		UINT get_read_chunk_max();
+
+		bool set_direct_io_threshold(UINT _mb);
+		UINT get_direct_io_threshold();
+
+		bool set_direct_io_streams(UINT _streams);
+		UINT get_direct_io_streams();
+
+		bool set_early_hints_prefetch(bool _prefetch);
+		bool get_early_hints_prefetch();
+		std::unordered_map<std::string, std::vector<std::string>> get_early_hints();
 	};
 }
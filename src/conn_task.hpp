@@ -0,0 +1,57 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include "frame_pool.hpp"
+#include "http_server.hpp"
+
+#include <coroutine>
+#include <exception>
+
+namespace app {
+
+	// 接続ごとのコルーチン。起動したら完了まで自走し、終わるとフレームを破棄する
+	struct conn_task {
+		struct promise_type {
+			conn_task get_return_object() noexcept { return {}; }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() noexcept {}
+			void unhandled_exception() noexcept { std::terminate(); }
+
+			// フレームはスレッドごとのプールから取る
+			static void* operator new(size_t _size)
+			{
+				return frame_pool::current().allocate(_size);
+			}
+
+			static void operator delete(void* _p, size_t _size) noexcept
+			{
+				frame_pool::current().deallocate(_p, _size);
+			}
+		};
+	};
+
+	// 発行済みのI/Oの完了を待つ。発行できなかった場合は待たずに0を返す
+	struct io_awaiter {
+		http_conn_t* conn;
+		UINT type;
+		bool issued;
+
+		bool await_ready() const noexcept
+		{
+			return !issued;
+		}
+
+		void await_suspend(std::coroutine_handle<> _handle) noexcept
+		{
+			conn->waiter = _handle;
+			conn->waiting = type;
+		}
+
+		DWORD await_resume() const noexcept
+		{
+			return issued ? conn->io_transferred : 0;
+		}
+	};
+}
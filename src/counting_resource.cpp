@@ -0,0 +1,38 @@
+﻿#include "counting_resource.hpp"
+
+namespace app {
+
+	counting_resource::counting_resource(std::pmr::memory_resource* _upstream)
+		: upstream_(_upstream)
+		, count_(0)
+		, bytes_(0)
+	{
+	}
+
+	void* counting_resource::do_allocate(size_t _bytes, size_t _alignment)
+	{
+		count_++;
+		bytes_ += _bytes;
+		return upstream_->allocate(_bytes, _alignment);
+	}
+
+	void counting_resource::do_deallocate(void* _p, size_t _bytes, size_t _alignment)
+	{
+		upstream_->deallocate(_p, _bytes, _alignment);
+	}
+
+	bool counting_resource::do_is_equal(const std::pmr::memory_resource& _other) const noexcept
+	{
+		return this == &_other;
+	}
+
+	uint64_t counting_resource::count() const noexcept
+	{
+		return count_;
+	}
+
+	uint64_t counting_resource::bytes() const noexcept
+	{
+		return bytes_;
+	}
+}
@@ -0,0 +1,29 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include <memory_resource>
+#include <cstdint>
+
+namespace app {
+
+	// 上流のリソースへ回った確保を数える
+	// アリーナの上流に置いて、アリーナから溢れた確保を検出する
+	class counting_resource : public std::pmr::memory_resource
+	{
+	private:
+		std::pmr::memory_resource* upstream_;
+		uint64_t count_;
+		uint64_t bytes_;
+
+		void* do_allocate(size_t _bytes, size_t _alignment) override;
+		void do_deallocate(void* _p, size_t _bytes, size_t _alignment) override;
+		bool do_is_equal(const std::pmr::memory_resource& _other) const noexcept override;
+
+	public:
+		counting_resource(std::pmr::memory_resource* _upstream = std::pmr::new_delete_resource());
+
+		uint64_t count() const noexcept;
+		uint64_t bytes() const noexcept;
+	};
+}
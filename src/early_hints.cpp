@@ -0,0 +1,219 @@
+﻿#include "early_hints.hpp"
+
+#include "log.hpp"
+#include "stall_watchdog.hpp"
+#include "utils.hpp"
+
+namespace {
+	constexpr auto PREFETCH_CONTEXTS = 4;
+	constexpr auto PREFETCH_BUFFER_SIZE = 64 * 1024; // 64KB
+	constexpr auto PREFETCH_MAX_SIZE = 4 * 1024 * 1024; // 4MB以上は先頭のみ
+	constexpr auto PREFETCH_INTERVAL = 30 * 1000; // 30秒以内に先読みしたものは再度読まない
+
+	std::string get_preload_as(const std::string& _path)
+	{
+		auto pos = _path.find_last_of("./");
+		if (pos == std::string::npos || _path.at(pos) != '.') return "fetch";
+		auto ext = _path.substr(pos + 1);
+
+		if (ext == "css") return "style";
+		if (ext == "js" || ext == "mjs") return "script";
+		if (ext == "woff" || ext == "woff2" || ext == "ttf" || ext == "otf") return "font";
+		if (ext == "png" || ext == "jpg" || ext == "jpeg" || ext == "gif" || ext == "webp" || ext == "avif" || ext == "svg" || ext == "ico") return "image";
+		return "fetch";
+	}
+
+	// ブロッキングスレッドで実行する
+	void prefetch_open(app::BLOCKING_JOB* _job)
+	{
+		auto& ctx = *reinterpret_cast<app::PREFETCH_CONTEXT*>(_job);
+		app::stall_call_scope scope(app::CALL_CREATE_FILE);
+		ctx.file = ::CreateFileW(ctx.path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	}
+}
+
+namespace app {
+
+	early_hints::early_hints(const early_hints_map& _manifest, const std::wstring& _htdocs, bool _prefetch)
+		: htdocs_(_htdocs)
+		, responses_()
+		, resources_()
+		, prefetch_(_prefetch)
+		, compport_(NULL)
+		, compkey_(0)
+		, pool_(nullptr)
+		, prefetch_ctx_(PREFETCH_CONTEXTS)
+		, prefetched_()
+	{
+		for (const auto& [key, values] : _manifest)
+		{
+			if (key == "" || values.empty()) continue;
+
+			// スラッシュで終わってたらindex.html
+			auto path = key;
+			if (path.back() == '/') path += "index.html";
+
+			// 103レスポンスは予め組み立てておく
+			std::string res = "HTTP/1.1 103 Early Hints\r\n";
+			for (const auto& x : values)
+			{
+				auto as = get_preload_as(x);
+				res += "Link: <" + x + ">; rel=preload; as=" + as;
+				if (as == "font" || as == "fetch") res += "; crossorigin";
+				res += "\r\n";
+			}
+			res += "\r\n";
+
+			responses_.insert({ path, res });
+			resources_.insert({ path, values });
+			log(L"Info: early hints %s (%llu resources)", s_to_ws(path).c_str(), static_cast<uint64_t>(values.size()));
+		}
+
+		for (auto& x : prefetch_ctx_)
+		{
+			x.job.run = prefetch_open;
+			x.job.compkey = 0;
+			x.opening = false;
+			x.file = INVALID_HANDLE_VALUE;
+			x.buf.resize(PREFETCH_BUFFER_SIZE);
+		}
+	}
+
+	early_hints::~early_hints()
+	{
+		// ブロッキングスレッドは先に止めてあるので、開いている途中だったものも閉じてよい
+		for (auto& x : prefetch_ctx_)
+		{
+			x.opening = false;
+			prefetch_close(&x);
+		}
+	}
+
+	void early_hints::set_completion_port(HANDLE _compport, ULONG_PTR _compkey)
+	{
+		compport_ = _compport;
+		compkey_ = _compkey;
+		for (auto& x : prefetch_ctx_)
+		{
+			x.job.compkey = _compkey;
+		}
+	}
+
+	void early_hints::set_blocking_pool(blocking_pool* _pool)
+	{
+		pool_ = _pool;
+	}
+
+	const std::string* early_hints::find(std::string_view _path) const
+	{
+		auto it = responses_.find(_path);
+		if (it == responses_.end()) return nullptr;
+		return &it->second;
+	}
+
+	void early_hints::prefetch(std::string_view _path)
+	{
+		if (!prefetch_ || compport_ == NULL || pool_ == nullptr) return;
+
+		auto it = resources_.find(_path);
+		if (it == resources_.end()) return;
+
+		auto now = ::GetTickCount64();
+		for (const auto& x : it->second)
+		{
+			// 外部URLやクエリ付きは対象外
+			if (x.empty() || x.front() != '/' || x.find_first_of("?#") != std::string::npos) continue;
+
+			// 最近読んだものはOSのキャッシュに載っているはず
+			if (prefetched_.contains(x) && now - prefetched_.at(x) < PREFETCH_INTERVAL) continue;
+
+			PREFETCH_CONTEXT* ctx = nullptr;
+			for (auto& y : prefetch_ctx_)
+			{
+				if (y.file == INVALID_HANDLE_VALUE && !y.opening)
+				{
+					ctx = &y;
+					break;
+				}
+			}
+			if (ctx == nullptr) return;
+
+			// 開くのはブロッキングスレッドに任せ、完了が届いたら読み始める
+			ctx->path = htdocs_ + absolute_path_to_winpath(x);
+			ctx->offset = 0;
+			std::memset(&ctx->job.ov, 0, sizeof(OVERLAPPED));
+			ctx->opening = true;
+			if (!pool_->submit(&ctx->job))
+			{
+				ctx->opening = false;
+				return;
+			}
+			prefetched_[x] = now;
+		}
+	}
+
+	void early_hints::on_prefetch(PREFETCH_CONTEXT* _ctx, bool _ok, DWORD _transferred)
+	{
+		if (_ctx->opening)
+		{
+			// 開き終わった
+			_ctx->opening = false;
+			if (_ctx->file == INVALID_HANDLE_VALUE) return;
+
+			HANDLE port;
+			{
+				stall_call_scope scope(CALL_ASSOCIATE_PORT);
+				port = ::CreateIoCompletionPort(_ctx->file, compport_, compkey_, 0);
+			}
+			if (port == NULL || !prefetch_read(_ctx))
+			{
+				prefetch_close(_ctx);
+			}
+			return;
+		}
+
+		if (_ctx->file == INVALID_HANDLE_VALUE) return;
+
+		_ctx->offset += _transferred;
+		if (!_ok || _transferred == 0 || _ctx->offset >= PREFETCH_MAX_SIZE)
+		{
+			prefetch_close(_ctx);
+			return;
+		}
+
+		if (!prefetch_read(_ctx))
+		{
+			prefetch_close(_ctx);
+		}
+	}
+
+	bool early_hints::prefetch_read(PREFETCH_CONTEXT* _ctx)
+	{
+		std::memset(&_ctx->job.ov, 0, sizeof(OVERLAPPED));
+		_ctx->job.ov.Offset = _ctx->offset & 0xffffffff;
+		_ctx->job.ov.OffsetHigh = (_ctx->offset >> 32) & 0xffffffff;
+
+		if (::ReadFile(_ctx->file, _ctx->buf.data(), _ctx->buf.size(), NULL, &_ctx->job.ov))
+		{
+			return true;
+		}
+
+		auto error = ::GetLastError();
+		if (error != ERROR_IO_PENDING)
+		{
+			// ERROR_HANDLE_EOFは読み終わり
+			return false;
+		}
+		return true;
+	}
+
+	void early_hints::prefetch_close(PREFETCH_CONTEXT* _ctx)
+	{
+		if (_ctx->file != INVALID_HANDLE_VALUE)
+		{
+			::CancelIo(_ctx->file);
+			::CloseHandle(_ctx->file);
+		}
+		_ctx->file = INVALID_HANDLE_VALUE;
+	}
+}
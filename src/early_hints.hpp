@@ -0,0 +1,65 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include "blocking_pool.hpp"
+
+#include "utils.hpp"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+namespace app {
+
+	using early_hints_map = std::unordered_map<std::string, std::vector<std::string>>;
+
+	// jobは先頭に置き、開く依頼と読込の完了通知のどちらのOVERLAPPEDからも戻せるようにする
+	struct PREFETCH_CONTEXT {
+		BLOCKING_JOB job;
+		std::wstring path;
+		bool opening; // ブロッキングスレッドで開いている途中
+		HANDLE file;
+		uint64_t offset;
+		std::vector<char> buf;
+	};
+
+	// HTMLのパスに対応する103 Early Hintsとサブリソースの先読み
+	class early_hints
+	{
+	private:
+		std::wstring htdocs_;
+		std::unordered_map<std::string, std::string, string_hash, std::equal_to<>> responses_;
+		std::unordered_map<std::string, std::vector<std::string>, string_hash, std::equal_to<>> resources_;
+		bool prefetch_;
+		HANDLE compport_;
+		ULONG_PTR compkey_;
+		blocking_pool* pool_;
+		std::vector<PREFETCH_CONTEXT> prefetch_ctx_;
+		std::unordered_map<std::string, ULONGLONG> prefetched_;
+
+		bool prefetch_read(PREFETCH_CONTEXT* _ctx);
+		void prefetch_close(PREFETCH_CONTEXT* _ctx);
+
+	public:
+		early_hints(const early_hints_map& _manifest, const std::wstring& _htdocs, bool _prefetch);
+		~early_hints();
+
+		// コピー不可
+		early_hints(const early_hints&) = delete;
+		early_hints& operator = (const early_hints&) = delete;
+		// ムーブ不可
+		early_hints(early_hints&&) = delete;
+		early_hints& operator = (early_hints&&) = delete;
+
+		void set_completion_port(HANDLE _compport, ULONG_PTR _compkey);
+		// 先読みのファイルはブロッキングスレッドで開く。無ければ先読みしない
+		void set_blocking_pool(blocking_pool* _pool);
+
+		const std::string* find(std::string_view _path) const;
+		void prefetch(std::string_view _path);
+		void on_prefetch(PREFETCH_CONTEXT* _ctx, bool _ok, DWORD _transferred);
+	};
+}
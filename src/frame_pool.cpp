@@ -0,0 +1,75 @@
+﻿#include "frame_pool.hpp"
+
+#include <algorithm>
+#include <new>
+
+namespace app {
+
+	frame_pool::frame_pool()
+		: buckets_()
+		, stats_()
+	{
+		// フレームの種類はコルーチンの数だけなので少ない
+		buckets_.reserve(8);
+	}
+
+	frame_pool::~frame_pool()
+	{
+		for (auto& b : buckets_)
+		{
+			while (b.head != nullptr)
+			{
+				auto next = b.head->next;
+				::operator delete(b.head);
+				b.head = next;
+			}
+		}
+	}
+
+	void* frame_pool::allocate(size_t _size)
+	{
+		for (auto& b : buckets_)
+		{
+			if (b.size == _size && b.head != nullptr)
+			{
+				auto block = b.head;
+				b.head = block->next;
+				stats_.reused++;
+				return block;
+			}
+		}
+
+		stats_.allocated++;
+		return ::operator new(std::max(_size, sizeof(free_block)));
+	}
+
+	void frame_pool::deallocate(void* _p, size_t _size) noexcept
+	{
+		if (_p == nullptr) return;
+
+		auto block = static_cast<free_block*>(_p);
+		for (auto& b : buckets_)
+		{
+			if (b.size == _size)
+			{
+				block->next = b.head;
+				b.head = block;
+				return;
+			}
+		}
+
+		buckets_.push_back({ _size, block });
+		block->next = nullptr;
+	}
+
+	frame_pool_stats_t frame_pool::stats() const noexcept
+	{
+		return stats_;
+	}
+
+	frame_pool& frame_pool::current()
+	{
+		thread_local frame_pool pool;
+		return pool;
+	}
+}
@@ -0,0 +1,50 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include <vector>
+#include <cstdint>
+
+namespace app {
+
+	struct frame_pool_stats_t {
+		uint64_t allocated;
+		uint64_t reused;
+	};
+
+	// コルーチンフレーム用のプール。同じサイズのブロックを使い回す
+	// スレッドごとに持つのでロックしない
+	class frame_pool
+	{
+	private:
+		struct free_block {
+			free_block* next;
+		};
+
+		struct bucket {
+			size_t size;
+			free_block* head;
+		};
+
+		std::vector<bucket> buckets_;
+		frame_pool_stats_t stats_;
+
+	public:
+		frame_pool();
+		~frame_pool();
+
+		// コピー不可
+		frame_pool(const frame_pool&) = delete;
+		frame_pool& operator = (const frame_pool&) = delete;
+		// ムーブ不可
+		frame_pool(frame_pool&&) = delete;
+		frame_pool& operator = (frame_pool&&) = delete;
+
+		void* allocate(size_t _size);
+		void deallocate(void* _p, size_t _size) noexcept;
+
+		frame_pool_stats_t stats() const noexcept;
+
+		static frame_pool& current();
+	};
+}
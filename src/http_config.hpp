@@ -0,0 +1,50 @@
+﻿#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <utility>
+#include <cstdint>
+
+namespace app
+{
+	struct http_config_t {
+		std::string ip = "127.0.0.1";
+		uint16_t port = 20082;
+		uint16_t maxconn = 16;
+		uint16_t reserved_connections = 0;
+		std::string healthcheck_ip = "127.0.0.1";
+		uint32_t retry_after = 5; // 秒
+		uint32_t accept_posted = 8;
+		uint32_t listen_backlog = 0; // 0はSOMAXCONN
+		bool accept_data = false;
+		uint32_t accept_data_timeout = 10; // 秒。接続したまま最初のデータを送らないAcceptExを打ち切る。0は無効
+		bool tcp_nodelay = true;
+		uint32_t send_buffer = 0; // KB。0はOS任せ
+		uint32_t recv_buffer = 0; // KB。0はOS任せ
+		bool tcp_fastopen = false;
+		uint32_t completion_batch = 64;
+		uint32_t blocking_threads = 2; // 0はイベントループで開く
+		uint32_t send_quantum = 256; // KB。0は無制限
+		uint32_t bandwidth_total = 0; // KB/s。0は無制限
+		std::vector<std::pair<std::string, uint32_t>> bandwidth; // パスの前方一致またはContent-Typeの前方一致と1接続あたりのKB/s
+		uint32_t rate_limit = 0; // 接続元IPごとのリクエスト数/秒。0は無制限
+		uint32_t rate_burst = 0; // 0はrate_limitと同じ
+		uint32_t connections_per_ip = 0; // 0は無制限
+		uint32_t rate_table = 4096; // 記憶する接続元IPの数
+		std::string metrics_path = "/__metrics"; // /で始まらなければ無効
+		uint32_t latency_dump = 60; // 秒。0は終了時のみ
+		uint32_t trace_events = 0; // 0は無効
+		std::string trace_path = "/__trace";
+		uint32_t stall_threshold = 20; // ミリ秒。0は無効
+		std::string capture_file; // 空は無効
+		uint32_t capture_limit = 256; // MB
+		uint32_t notfound_cache = 1024;
+		uint32_t read_ahead = 4;
+		uint32_t read_chunk_max = 1024; // KB
+		uint32_t direct_io_threshold = 0; // MB
+		uint32_t direct_io_streams = 4;
+		std::unordered_map<std::string, std::vector<std::string>> early_hints;
+		bool early_hints_prefetch = true;
+	};
+}
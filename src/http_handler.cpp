@@ -0,0 +1,765 @@
+﻿#include "http_handler.hpp"
+
+#include "http_parser.hpp"
+#include "log.hpp"
+#include "loopback_backend.hpp"
+
+#include "utils.hpp"
+
+#include <limits>
+#include <memory_resource>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+	const std::string response_not_found =
+		"HTTP/1.1 404 Not Found\r\n"
+		"Content-Length: 0\r\n"
+		"\r\n";
+
+	const std::string response_bad_request =
+		"HTTP/1.1 400 Bad Request\r\n"
+		"Content-Length: 0\r\n"
+		"\r\n";
+
+	const std::string response_too_many_requests =
+		"HTTP/1.1 429 Too Many Requests\r\n"
+		"Retry-After: 1\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n"
+		"\r\n";
+
+	const std::string response_method_not_allowed =
+		"HTTP/1.1 405 Method Not Allowed\r\n"
+		"Allow: GET, HEAD\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n"
+		"\r\n";
+
+	bool check_ascii(const std::vector<char>& _s, size_t _size)
+	{
+		for (size_t i = 0; i < _size; ++i)
+		{
+			auto c = _s.at(i);
+			if (!app::is_http_char(c))
+			{
+				app::log(L"Error: Invalid char is %d.", (DWORD)c);
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+
+namespace app {
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::basic_http_handler(Backend& _io, CachePolicy& _notfound, early_hints& _earlyhints, const std::wstring& _htdocs)
+		: io_(_io)
+		, notfound_(_notfound)
+		, earlyhints_(_earlyhints)
+		, htdocs_(_htdocs)
+		, serving_()
+		, endpoints_()
+		, capture_(nullptr)
+		, limiter_(nullptr)
+		, quantum_(0)
+		, deferred_()
+		, running_()
+		, total_()
+		, bandwidth_()
+		, throttled_()
+		, throttle_until_(0)
+	{
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::~basic_http_handler()
+	{
+		// 完了待ちのまま残ったコルーチンを破棄する
+		for (auto conn : serving_)
+		{
+			if (conn->waiter)
+			{
+				conn->waiter.destroy();
+				conn->waiter = nullptr;
+			}
+		}
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	void basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::add_endpoint(const std::string& _path, const char* _content_type, std::function<void(std::string&)> _writer)
+	{
+		endpoints_.push_back({ _path, _content_type, std::move(_writer) });
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	void basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::set_capture(request_capture* _capture)
+	{
+		capture_ = _capture;
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	void basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::set_rate_limiter(rate_limiter* _limiter)
+	{
+		limiter_ = _limiter;
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	void basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::set_send_quantum(size_t _bytes)
+	{
+		quantum_ = static_cast<int64_t>(_bytes);
+	}
+
+	// 前のターンで持ち分を使い切った接続に持ち分を足して順に再開する
+	// 再開した接続がまた使い切ると次のターンに回るので、大きなファイルの送信が他の接続の応答を塞がない
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	void basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::run_deferred()
+	{
+		if (deferred_.empty()) return;
+
+		running_.swap(deferred_);
+		for (auto conn : running_)
+		{
+			conn->deficit += quantum_;
+			resume(conn, HTTP_SCHED_YIELD, ERROR_SUCCESS, 1);
+		}
+		running_.clear();
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	bool basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::has_deferred() const noexcept
+	{
+		return !deferred_.empty();
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	void basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::set_bandwidth(uint32_t _total_kbps, const std::vector<std::pair<std::string, uint32_t>>& _rules)
+	{
+		int64_t rate = static_cast<int64_t>(_total_kbps) * 1024;
+		total_.reset(rate, rate, latency_now());
+
+		bandwidth_.clear();
+		for (const auto& [match, kbps] : _rules)
+		{
+			bandwidth_.push_back({ match, static_cast<int64_t>(kbps) * 1024 });
+		}
+	}
+
+	// パスの指定を優先し、長く一致したものを選ぶ。無ければContent-Type
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	int64_t basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::find_bandwidth(std::string_view _path, std::string_view _content_type) const noexcept
+	{
+		int64_t rate = 0;
+		size_t matched = 0;
+		for (const auto& [match, bps] : bandwidth_)
+		{
+			if (match.front() == '/' && _path.starts_with(match) && match.size() > matched)
+			{
+				rate = bps;
+				matched = match.size();
+			}
+		}
+		if (matched > 0) return rate;
+
+		for (const auto& [match, bps] : bandwidth_)
+		{
+			if (match.front() != '/' && _content_type.starts_with(match) && match.size() > matched)
+			{
+				rate = bps;
+				matched = match.size();
+			}
+		}
+		return rate;
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	bool basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::bandwidth_ready(http_conn_t* _conn, int64_t _now) noexcept
+	{
+		_conn->bucket.refill(_now);
+		total_.refill(_now);
+		return _conn->bucket.ready() && total_.ready();
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	void basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::run_throttled()
+	{
+		throttle_until_ = 0;
+		if (throttled_.empty()) return;
+
+		auto now = latency_now();
+		running_.swap(throttled_);
+		for (auto conn : running_)
+		{
+			if (bandwidth_ready(conn, now))
+			{
+				resume(conn, HTTP_SCHED_THROTTLE, ERROR_SUCCESS, 1);
+			}
+			else if (conn->waiting == HTTP_SCHED_THROTTLE)
+			{
+				throttled_.push_back(conn);
+				auto until = now + std::max(conn->bucket.wait(), total_.wait());
+				if (throttle_until_ == 0 || until < throttle_until_) throttle_until_ = until;
+			}
+		}
+		running_.clear();
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	DWORD basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::throttle_timeout() const noexcept
+	{
+		if (throttled_.empty() || throttle_until_ == 0) return INFINITE;
+
+		auto ticks = throttle_until_ - latency_now();
+		if (ticks <= 0) return 0;
+		return static_cast<DWORD>((ticks * 1000 + qpc_frequency() - 1) / qpc_frequency());
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	io_awaiter basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::recv(http_conn_t* _conn)
+	{
+		return { _conn, HTTP_TCP_RECV, io_.tcp_read(_conn) };
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	io_awaiter basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::send(http_conn_t* _conn, const std::string& _data)
+	{
+		return { _conn, HTTP_TCP_SEND, io_.tcp_send(_conn, _data) };
+	}
+
+	// 次のバッファが読めていれば送信完了を、まだなら読込完了を待つ
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	io_awaiter basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::send_file(http_conn_t* _conn)
+	{
+		if (!io_.tcp_send_file(_conn))
+		{
+			return { _conn, HTTP_TCP_SEND, false };
+		}
+		return { _conn, _conn->fio_ctx.sending ? HTTP_TCP_SEND : HTTP_FILE_READ, true };
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	io_awaiter basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::yield(http_conn_t* _conn)
+	{
+		deferred_.push_back(_conn);
+		return { _conn, HTTP_SCHED_YIELD, true };
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	io_awaiter basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::throttle(http_conn_t* _conn)
+	{
+		throttled_.push_back(_conn);
+		return { _conn, HTTP_SCHED_THROTTLE, true };
+	}
+
+	// ブロッキングスレッドに回したファイルが開き終わるのを待つ。その場で開いていれば待たない
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	io_awaiter basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::opened(http_conn_t* _conn, bool _opening)
+	{
+		return { _conn, HTTP_FILE_OPEN, _opening };
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	void basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::resume(http_conn_t* _conn, UINT _type, DWORD _error, DWORD _transferred)
+	{
+		// 待っていない完了は切断済みの接続のもの
+		if (!_conn->waiter || _conn->waiting != _type) return;
+
+		auto handle = _conn->waiter;
+		_conn->waiter = nullptr;
+		_conn->waiting = 0;
+		_conn->io_transferred = _error == ERROR_SUCCESS ? _transferred : 0;
+		handle.resume();
+	}
+
+	// ファイル読込の失敗。読込を待っていれば起こし、送信中なら切断して送信を失敗させる
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	void basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::fail(http_conn_t* _conn)
+	{
+		if (_conn->waiter && _conn->waiting == HTTP_FILE_READ)
+		{
+			resume(_conn, HTTP_FILE_READ, ERROR_READ_FAULT, 0);
+		}
+		else
+		{
+			io_.connection_close(_conn);
+		}
+	}
+
+	// 接続元IPの接続数を戻す。2回呼んでも1回だけ数える
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	void basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::release_address(http_conn_t* _conn)
+	{
+		if (limiter_ != nullptr && _conn->address != 0)
+		{
+			limiter_->disconnect(_conn->address);
+		}
+		_conn->address = 0;
+	}
+
+	// 本体はその場でheaderに書き出し、前にステータス行とヘッダを付ける
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	void basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::respond_endpoint(http_conn_t* _conn, const http_endpoint_t& _endpoint, bool _head)
+	{
+		_conn->header.clear();
+		_endpoint.writer(_conn->header);
+
+		std::pmr::string head(&_conn->arena);
+		append_ok_header(head, _endpoint.content_type, _conn->header.size());
+
+		if (_head)
+		{
+			_conn->header.assign(head);
+		}
+		else
+		{
+			_conn->header.insert(0, head);
+		}
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	http_reply_t basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::respond(http_conn_t* _conn, DWORD _received)
+	{
+		http_reply_t reply = { false, false, &_conn->header, nullptr, false, false, false, 0 };
+
+		// 前回のリクエストで使った一時データを捨てる
+		_conn->arena.release();
+		std::pmr::memory_resource* mr = &_conn->arena;
+
+		const auto &[rc, method, request, version, kvs] = parse_http_header(_conn->ior_ctx.buf, _received, mr);
+		auto parsed_at = MetricsPolicy::now();
+		MetricsPolicy::record(PHASE_PARSE, _conn->received_at, parsed_at);
+		if (rc < 0)
+		{
+			// HTTPプロトコルを話していない
+			reply.close = true;
+			return reply;
+		}
+
+		// ログに表示
+		if constexpr (LogPolicy::enabled)
+		{
+			LogPolicy::write(L"Info: sock=%llu << %s %s %s", _conn->sock, s_to_ws(method).c_str(), s_to_ws(request).c_str(), s_to_ws(version).c_str());
+		}
+
+		// 前回の応答を破棄
+		_conn->header.clear();
+		_conn->fio_ctx.size = 0;
+		_conn->fio_ctx.total_sent = 0;
+
+		// keep-aliveチェック
+		if (kvs.contains("Connection") && kvs.at("Connection") == "close")
+		{
+			_conn->keepalive = false;
+		}
+		else
+		{
+			_conn->keepalive = true;
+		}
+
+		// 接続元IPごとのリクエスト数の制限
+		if (limiter_ != nullptr && _conn->address != 0 && !limiter_->acquire(_conn->address, latency_now()))
+		{
+			LogPolicy::write(L"Info: sock=%llu >> HTTP/1.1 429 Too Many Requests", _conn->sock);
+			MetricsPolicy::add(METRIC_REQUESTS_429);
+			_conn->keepalive = false;
+			reply.response = &response_too_many_requests;
+			return reply;
+		}
+
+		if (version != "HTTP/1.1")
+		{
+			LogPolicy::write(L"Info: sock=%llu >> HTTP/1.1 505 HTTP Version Not Supported", _conn->sock);
+			MetricsPolicy::add(METRIC_REQUESTS_505);
+			_conn->header.assign(version).append(
+				" 505 HTTP Version Not Supported\r\n"
+				"X-Server-Message: Only support HTTP/1.1.\r\n"
+				"Content-Length: 0\r\n"
+				"Connection: close\r\n"
+				"\r\n");
+			_conn->keepalive = false;
+			return reply;
+		}
+
+		if (method != "GET" && method != "HEAD")
+		{
+			LogPolicy::write(L"Info: sock=%llu >> HTTP/1.1 405 Method Not Allowed", _conn->sock);
+			MetricsPolicy::add(METRIC_REQUESTS_405);
+			_conn->keepalive = false;
+			reply.response = &response_method_not_allowed;
+			return reply;
+		}
+
+		auto absolutepath = get_absolute_path(request, mr);
+		if (absolutepath == "")
+		{
+			LogPolicy::write(L"Info: sock=%llu >> HTTP/1.1 400 Bad Request", _conn->sock);
+			MetricsPolicy::add(METRIC_REQUESTS_400);
+			reply.response = &response_bad_request;
+			return reply;
+		}
+
+		// 統計などは外から見えないように、信頼できる接続元にだけ返す
+		for (const auto& x : endpoints_)
+		{
+			if (_conn->trusted && std::string_view(absolutepath) == x.path)
+			{
+				if constexpr (LogPolicy::enabled)
+				{
+					LogPolicy::write(L"Info: sock=%llu >> HTTP/1.1 200 OK (%s)", _conn->sock, s_to_ws(x.path).c_str());
+				}
+				MetricsPolicy::add(METRIC_REQUESTS_200);
+				respond_endpoint(_conn, x, method == "HEAD");
+				return reply;
+			}
+		}
+
+		// スラッシュで終わってたらindex.html表示を試みる
+		if (absolutepath.back() == '/')
+		{
+			absolutepath += "index.html";
+		}
+
+		auto notfound_generation = notfound_.generation();
+		if (notfound_.contains(absolutepath))
+		{
+			LogPolicy::write(L"Info: sock=%llu >> HTTP/1.1 404 Not Found (cached)", _conn->sock);
+			MetricsPolicy::add(METRIC_NOTFOUND_CACHE_HITS);
+			MetricsPolicy::add(METRIC_REQUESTS_404);
+			reply.response = &response_not_found;
+			return reply;
+		}
+
+		MetricsPolicy::add(METRIC_NOTFOUND_CACHE_MISSES);
+
+		std::pmr::wstring path(mr);
+		path.reserve(htdocs_.size() + absolutepath.size());
+		path.append(htdocs_);
+		append_winpath(path, absolutepath);
+		// 開くのはブロッキングスレッドに任せ、続きはrespond_file()で作る
+		_conn->path.assign(absolutepath);
+		_conn->open_ctx.notfound_generation = notfound_generation;
+		reply.open = true;
+		reply.opening = io_.file_open_start(_conn, path.c_str());
+		reply.head = method == "HEAD";
+		reply.parsed_at = parsed_at;
+		return reply;
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	void basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::respond_file(http_conn_t* _conn, http_reply_t& _reply)
+	{
+		const auto& absolutepath = _conn->path;
+		if (_conn->open_ctx.missing)
+		{
+			notfound_.insert(absolutepath, _conn->open_ctx.notfound_generation);
+			LogPolicy::write(L"Info: sock=%llu >> HTTP/1.1 404 Not Found", _conn->sock);
+			MetricsPolicy::add(METRIC_REQUESTS_404);
+			_reply.response = &response_not_found;
+			return;
+		}
+
+		if (!io_.file_open_complete(_conn))
+		{
+			LogPolicy::write(L"Info: sock=%llu >> HTTP/1.1 404 Not Found", _conn->sock);
+			MetricsPolicy::add(METRIC_REQUESTS_404);
+			_reply.response = &response_not_found;
+			return;
+		}
+		MetricsPolicy::add(METRIC_FILE_OPENS);
+		MetricsPolicy::record(PHASE_OPEN, _reply.parsed_at, MetricsPolicy::now());
+
+		const auto& content_type = get_content_type(_conn->open_ctx.path);
+		if (!_reply.head && _conn->fio_ctx.size > 0)
+		{
+			if (!io_.file_read(_conn))
+			{
+				LogPolicy::write(L"Error: sock=%llu http_sever::file_read() failed", _conn->sock);
+				io_.file_close(_conn);
+				LogPolicy::write(L"Info: sock=%llu >> HTTP/1.1 404 Not Found", _conn->sock);
+				MetricsPolicy::add(METRIC_REQUESTS_404);
+				_reply.response = &response_not_found;
+				return;
+			}
+
+			// ヘッダは最初のファイル読込が終わってからボディと一緒に送る
+			_reply.body = true;
+
+			// 帯域制限は応答ごとに選び直す
+			auto rate = find_bandwidth(absolutepath, content_type);
+			_conn->bucket.reset(rate, rate, latency_now());
+
+			// 読込を待つ間にサブリソースを知らせる
+			_reply.hints = earlyhints_.find(absolutepath);
+			if (_reply.hints != nullptr)
+			{
+				LogPolicy::write(L"Info: sock=%llu >> HTTP/1.1 103 Early Hints", _conn->sock);
+				MetricsPolicy::add(METRIC_EARLY_HINTS);
+				earlyhints_.prefetch(absolutepath);
+			}
+		}
+		else if (_conn->fio_ctx.size == 0)
+		{
+			io_.file_close(_conn);
+		}
+
+		LogPolicy::write(L"Info: sock=%llu >> HTTP/1.1 200 OK", _conn->sock);
+		MetricsPolicy::add(METRIC_REQUESTS_200);
+		// headerは接続ごとに使い回すので、容量が足りていれば確保は起きない
+		_conn->header.clear();
+		append_ok_header(_conn->header, content_type, _conn->fio_ctx.size);
+
+		if (_reply.head)
+		{
+			_conn->fio_ctx.size = 0;
+			io_.file_close(_conn);
+		}
+	}
+
+	// 接続ごとの処理。受信→応答→(ボディの読込と送信)→keep-aliveなら受信に戻る
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	conn_task basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::serve(http_conn_t* _conn, DWORD _received)
+	{
+		serving_.insert(_conn);
+
+		while (true)
+		{
+			// 接続と同時に受け取ったデータが無ければ受信を待つ
+			DWORD received = _received;
+			_received = 0;
+			if (received == 0) received = co_await recv(_conn);
+			if (received == 0) break;
+
+			_conn->received_at = MetricsPolicy::now();
+			auto trace_start = TracePolicy::now();
+			if (capture_ != nullptr)
+			{
+				capture_->record(_conn->sock, _conn->ior_ctx.buf.data(), received);
+			}
+			if (_conn->accepted_at != 0)
+			{
+				MetricsPolicy::record(PHASE_FIRST_BYTE, _conn->accepted_at, _conn->received_at);
+				_conn->accepted_at = 0;
+			}
+
+			auto reply = respond(_conn, received);
+			if (reply.open)
+			{
+				co_await opened(_conn, reply.opening);
+				respond_file(_conn, reply);
+			}
+			if (reply.close) break;
+
+			if (reply.hints != nullptr)
+			{
+				if (co_await send(_conn, *reply.hints) == 0) break;
+			}
+
+			if (reply.body)
+			{
+				// ヘッダは最初のボディと一緒に送られる
+				auto& fctx = _conn->fio_ctx;
+				bool ok = true;
+				bool first_body = true;
+				_conn->deficit = quantum_;
+				while (ok && fctx.total_sent < fctx.size)
+				{
+					// 持ち分を使い切ったら他の接続に順番を譲る
+					if (quantum_ > 0 && _conn->deficit <= 0)
+					{
+						MetricsPolicy::add(METRIC_SEND_DEFERRALS);
+						co_await yield(_conn);
+					}
+
+					// 帯域制限の残りが無ければ補充を待つ
+					bool shaping = _conn->bucket.rate != 0 || total_.rate != 0;
+					if (shaping && !bandwidth_ready(_conn, latency_now()))
+					{
+						MetricsPolicy::add(METRIC_THROTTLE_WAITS);
+						co_await throttle(_conn);
+					}
+
+					// 持ち分を超えては送らない。残りは次のターンに回す
+					int64_t limit = quantum_ > 0 ? _conn->deficit : std::numeric_limits<DWORD>::max();
+					// 帯域制限の間はバケットに溜められる量より多くは送らない
+					if (_conn->bucket.rate != 0) limit = std::min(limit, _conn->bucket.burst);
+					if (total_.rate != 0) limit = std::min(limit, total_.burst);
+					fctx.send_limit = static_cast<DWORD>(std::clamp<int64_t>(limit, 1, std::numeric_limits<DWORD>::max()));
+
+					// 送信を出す前に使う分を引いておき、送信中に他の接続が同じ残りを使わないようにする
+					auto reserved = next_send_size(fctx);
+					if (shaping && reserved > 0)
+					{
+						_conn->bucket.take(reserved);
+						total_.take(reserved);
+						MetricsPolicy::add(METRIC_SHAPED_BYTES, reserved);
+					}
+
+					auto transferred = co_await send_file(_conn);
+					if (transferred == 0)
+					{
+						ok = false;
+					}
+					else if (fctx.sending)
+					{
+						auto sent = fctx.total_sent;
+						io_.tcp_send_file_complete(_conn, transferred);
+						_conn->deficit -= static_cast<int64_t>(fctx.total_sent - sent);
+						if (first_body)
+						{
+							MetricsPolicy::record(PHASE_FIRST_BODY, _conn->received_at, MetricsPolicy::now());
+							first_body = false;
+						}
+
+						// 空いたバッファで先読み
+						if (fctx.file != INVALID_HANDLE_VALUE && fctx.size > fctx.total_read && !io_.file_read(_conn))
+						{
+							LogPolicy::write(L"Error: sock=%llu http_server::file_read() failed", _conn->sock);
+							ok = false;
+						}
+					}
+				}
+				if (!ok) break;
+			}
+			else if (co_await send(_conn, *reply.response) == 0)
+			{
+				break;
+			}
+			if constexpr (MetricsPolicy::enabled)
+			{
+				auto now = MetricsPolicy::now();
+				MetricsPolicy::record(PHASE_TOTAL, _conn->received_at, now);
+				if (_conn->fio_ctx.size <= 64 * 1024) MetricsPolicy::record(PHASE_SMALL_TOTAL, _conn->received_at, now);
+			}
+			TracePolicy::complete("request", _conn->sock, trace_start, _conn->fio_ctx.total_sent);
+
+			if (!_conn->keepalive) break;
+		}
+
+		serving_.erase(_conn);
+		release_address(_conn);
+		io_.connection_close(_conn);
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	void basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::on_accept(http_conn_t* _conn, ULONG _address, bool _trusted, DWORD _received)
+	{
+		// 前の接続のコルーチンが完了待ちのまま残っていたら破棄
+		if (_conn->waiter)
+		{
+			_conn->waiter.destroy();
+			_conn->waiter = nullptr;
+		}
+		release_address(_conn);
+		_conn->address = _address;
+		_conn->trusted = _trusted;
+		_conn->waiting = 0;
+		_conn->accepted_at = MetricsPolicy::now();
+		std::erase(deferred_, _conn);
+		std::erase(throttled_, _conn);
+
+		serve(_conn, _received);
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	void basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::on_file_open(FILE_OPEN_CONTEXT* _ctx)
+	{
+		// 切断済みの接続への完了は捨てる。ハンドルはfile_open_finish()が閉じる
+		if (!io_.file_open_finish(_ctx)) return;
+
+		// 待っている接続が無ければ、開いたハンドルは次のfile_open_start()か切断で閉じる
+		resume(_ctx->conn, HTTP_FILE_OPEN, ERROR_SUCCESS, 0);
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	void basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::on_socket(HTTP_IO_CONTEXT* _ctx, DWORD _error, DWORD _transferred)
+	{
+		http_conn_t* conn = _ctx->conn;
+
+		if (_error != ERROR_SUCCESS)
+		{
+			LogPolicy::write(L"Error: socket I/O completion failed. sock=%llu,type=%u,ErrorCode=%lu", conn->sock, _ctx->type, _error);
+		}
+
+		if (_error == ERROR_SUCCESS && _ctx->type == HTTP_TCP_SEND)
+		{
+			MetricsPolicy::add(METRIC_BYTES_SENT, _transferred);
+		}
+
+		// 失敗と転送バイト0はコルーチン側で切断する
+		resume(conn, _ctx->type, _error, _transferred);
+	}
+
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	void basic_http_handler<Backend, LogPolicy, CachePolicy, MetricsPolicy, TracePolicy>::on_file_read(FILE_READ_CONTEXT* _slot, DWORD _error, DWORD _transferred)
+	{
+		http_conn_t* conn = _slot->conn;
+		FILE_IO_CONTEXT* ctx = &conn->fio_ctx;
+
+		// 出した読込は結果によらず1回だけ完了する
+		ctx->reading--;
+		_slot->pending = false;
+
+		// 閉じたファイルへの読込(file_close()で取り消したものを含む)は捨てる
+		// 次のファイルを開いていれば、この枠を待っていた先読みを出す
+		if (_slot->issued != ctx->generation)
+		{
+			if (ctx->file != INVALID_HANDLE_VALUE && !io_.file_read(conn))
+			{
+				LogPolicy::write(L"Error: sock=%llu http_server::file_read() failed", conn->sock);
+				io_.file_close(conn);
+				fail(conn);
+			}
+			return;
+		}
+
+		if (_error != ERROR_SUCCESS)
+		{
+			LogPolicy::write(L"Error: file read completion failed. sock=%llu, ErrorCode=%lu", conn->sock, _error);
+			io_.file_close(conn);
+			fail(conn);
+			return;
+		}
+
+		if (_transferred != _slot->length)
+		{
+			LogPolicy::write(L"Error: sock=%llu short file read. offset=%llu length=%lu transferred=%lu", conn->sock, _slot->offset, _slot->length, _transferred);
+			io_.file_close(conn);
+			fail(conn);
+			return;
+		}
+		_slot->transferred = _transferred;
+		_slot->ready = true;
+		ctx->total_read += _transferred;
+
+		// log(L"Info: file read total=%llu current=%llu count=%llu.", ctx->size, ctx->total_read, ctx->read_count);
+
+		// 次のファイル読込
+		if (!io_.file_read(conn))
+		{
+			LogPolicy::write(L"Error: sock=%llu http_server::file_read() failed", conn->sock);
+			io_.file_close(conn);
+			fail(conn);
+			return;
+		}
+
+		// 読込が完了した
+		if (ctx->size == ctx->total_read)
+		{
+			LogPolicy::write(L"Info: sock=%llu file read complete", conn->sock);
+			io_.file_close(conn);
+		}
+
+		// 読込を待っていれば送信に進む
+		resume(conn, HTTP_FILE_READ, ERROR_SUCCESS, _transferred);
+	}
+
+	template class basic_http_handler<http_server, http_log_policy, http_cache_policy, http_metrics_policy, http_trace_policy>;
+	template class basic_http_handler<loopback_backend, http_log_policy, http_cache_policy, http_metrics_policy, http_trace_policy>;
+	// 全ての機能を外したビルドでは上と同じ型になる
+#if !(defined(HTTPSERVER_NO_LOG) && defined(HTTPSERVER_NO_NOTFOUND_CACHE) && defined(HTTPSERVER_NO_METRICS) && defined(HTTPSERVER_NO_TRACE))
+	template class basic_http_handler<loopback_backend, log_policy_disabled, null_not_found_cache, metrics_policy_disabled, trace_policy_disabled>;
+#endif
+}
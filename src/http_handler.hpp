@@ -0,0 +1,119 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include "conn_task.hpp"
+#include "early_hints.hpp"
+#include "http_policy.hpp"
+#include "http_server.hpp"
+#include "io_backend.hpp"
+#include "rate_limiter.hpp"
+#include "request_capture.hpp"
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace app {
+
+	// サーバー自身の情報を返すパス。本体はリクエストのたびにwriterで作る
+	struct http_endpoint_t {
+		std::string path;
+		const char* content_type;
+		std::function<void(std::string&)> writer;
+	};
+
+	// 受信したリクエストへの応答方法
+	struct http_reply_t {
+		bool close; // 応答せずに切断する
+		bool body; // ヘッダ(conn->header)とファイル本体を送る
+		const std::string* response; // bodyでない場合に送る応答
+		const std::string* hints; // 応答より先に送る103 Early Hints
+		bool open; // ファイルを開いた。開き終わったらrespond_file()で応答を作る
+		bool opening; // ブロッキングスレッドで開いている
+		bool head;
+		int64_t parsed_at;
+	};
+
+	// リクエストの解析と応答。ソケットやファイルの操作はBackend経由で行う
+	// ログと404キャッシュ、統計、トレースはビルド時に選んだポリシーで差し替える
+	template <io_backend Backend, typename LogPolicy, typename CachePolicy, typename MetricsPolicy, typename TracePolicy>
+	class basic_http_handler
+	{
+	private:
+		Backend& io_;
+		CachePolicy& notfound_;
+		early_hints& earlyhints_;
+		std::wstring htdocs_;
+		std::unordered_set<http_conn_t*> serving_;
+		std::vector<http_endpoint_t> endpoints_;
+		request_capture* capture_;
+		rate_limiter* limiter_;
+		int64_t quantum_;
+		std::vector<http_conn_t*> deferred_; // 次のターンに送信を回す接続
+		std::vector<http_conn_t*> running_;
+		token_bucket total_; // 全体の帯域制限
+		std::vector<std::pair<std::string, int64_t>> bandwidth_; // 1接続あたりの帯域制限(bytes/s)
+		std::vector<http_conn_t*> throttled_; // 帯域制限の補充待ち
+		int64_t throttle_until_; // throttled_の中で最も早く送れるようになる時刻
+
+		io_awaiter recv(http_conn_t* _conn);
+		io_awaiter send(http_conn_t* _conn, const std::string& _data);
+		io_awaiter send_file(http_conn_t* _conn);
+		io_awaiter yield(http_conn_t* _conn);
+		io_awaiter throttle(http_conn_t* _conn);
+		io_awaiter opened(http_conn_t* _conn, bool _opening);
+		bool bandwidth_ready(http_conn_t* _conn, int64_t _now) noexcept;
+		int64_t find_bandwidth(std::string_view _path, std::string_view _content_type) const noexcept;
+		void resume(http_conn_t* _conn, UINT _type, DWORD _error, DWORD _transferred);
+		void fail(http_conn_t* _conn);
+		void release_address(http_conn_t* _conn);
+
+		void respond_endpoint(http_conn_t* _conn, const http_endpoint_t& _endpoint, bool _head);
+		http_reply_t respond(http_conn_t* _conn, DWORD _received);
+		void respond_file(http_conn_t* _conn, http_reply_t& _reply);
+		conn_task serve(http_conn_t* _conn, DWORD _received);
+
+	public:
+		basic_http_handler(Backend& _io, CachePolicy& _notfound, early_hints& _earlyhints, const std::wstring& _htdocs);
+		~basic_http_handler();
+
+		// コピー不可
+		basic_http_handler(const basic_http_handler&) = delete;
+		basic_http_handler& operator = (const basic_http_handler&) = delete;
+		// ムーブ不可
+		basic_http_handler(basic_http_handler&&) = delete;
+		basic_http_handler& operator = (basic_http_handler&&) = delete;
+
+		// _pathへのリクエストに_writerが書き出した内容を返す
+		void add_endpoint(const std::string& _path, const char* _content_type, std::function<void(std::string&)> _writer);
+		// 受信したリクエストヘッダを_captureに記録する。nullptrで止める
+		void set_capture(request_capture* _capture);
+		// 接続元IPごとのリクエスト数の制限。接続の受付はhttp_threadがconnect()で見る。nullptrで止める
+		void set_rate_limiter(rate_limiter* _limiter);
+		// 1接続が1ターンに送るボディの上限。0は無制限
+		void set_send_quantum(size_t _bytes);
+
+		// 送信を譲った接続を再開する。完了を待つ前に毎回呼ぶ
+		void run_deferred();
+		bool has_deferred() const noexcept;
+
+		// 全体と1接続あたりの帯域制限。1接続あたりはパスかContent-Typeの前方一致で選ぶ(KB/s)
+		void set_bandwidth(uint32_t _total_kbps, const std::vector<std::pair<std::string, uint32_t>>& _rules);
+		// 補充が済んだ接続を再開する。完了を待つ前に毎回呼ぶ
+		void run_throttled();
+		// 次に補充待ちの接続が送れるようになるまでの時間(ミリ秒)
+		DWORD throttle_timeout() const noexcept;
+
+		// _addressは接続元IP。0はレート制限の対象外。_trustedでなければ統計などのパスも静的ファイルとして扱う
+		void on_accept(http_conn_t* _conn, ULONG _address, bool _trusted, DWORD _received);
+		void on_socket(HTTP_IO_CONTEXT* _ctx, DWORD _error, DWORD _transferred);
+		void on_file_read(FILE_READ_CONTEXT* _slot, DWORD _error, DWORD _transferred);
+		void on_file_open(FILE_OPEN_CONTEXT* _ctx);
+	};
+
+	using http_handler = basic_http_handler<http_server, http_log_policy, http_cache_policy, http_metrics_policy, http_trace_policy>;
+}
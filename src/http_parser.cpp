@@ -0,0 +1,340 @@
+﻿#include "http_parser.hpp"
+
+#include "utils.hpp"
+
+#include <array>
+#include <unordered_map>
+
+namespace {
+
+	const std::array<bool, 0x80> http_available_ascii_codes =
+	{
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 1, 1, 0, 0, 1, 0, 0, // \t, \n, \r
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 0
+	};
+
+	const std::array<bool, 0x80> absolute_path_codes =
+	{
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 1, 1, 1, // 0x2D(-) 0x2E(.) 0x2F(/)
+		1, 1, 1, 1, 1, 1, 1, 1, // 0x30-
+		1, 1, 0, 0, 0, 0, 0, 0, // -0x39 数字
+		1, 1, 1, 1, 1, 1, 1, 1, // 0x40(@) 0x41-
+		1, 1, 1, 1, 1, 1, 1, 1, // -
+		1, 1, 1, 1, 1, 1, 1, 1, // -
+		1, 1, 1, 0, 0, 0, 0, 1, // -0x5A ALPHA 0x5F(_)
+		0, 1, 1, 1, 1, 1, 1, 1, // 0x61-
+		1, 1, 1, 1, 1, 1, 1, 1, // -
+		1, 1, 1, 1, 1, 1, 1, 1, // -
+		1, 1, 1, 0, 0, 0, 1, 0  // -0x7A alpha 0x7E(~)
+	};
+
+	const std::unordered_map<std::string, std::string, app::string_hash, std::equal_to<>> ext_map = {
+		{"css", "text/css"},
+		{"csv", "text/csv"},
+		{"txt", "text/plain"},
+		{"vtt", "text/vtt"},
+		{"html", "text/html"},
+		{"htm", "text/html"},
+		{"wgsl", "text/wgsl"},
+		{"apng", "image/apng"},
+		{"avif", "image/avif"},
+		{"bmp", "image/bmp"},
+		{"gif", "image/gif"},
+		{"png", "image/png"},
+		{"svg", "image/svg+xml"},
+		{"webp", "image/webp"},
+		{"ico", "image/x-icon"},
+		{"tif", "image/tiff"},
+		{"tiff", "image/tiff"},
+		{"jpeg", "image/jpeg"},
+		{"jpg", "image/jpeg"},
+		{"mp4", "video/mp4"},
+		{"mpeg", "video/mpeg"},
+		{"webm", "video/webm"},
+		{"mp3", "audio/mp3"},
+		{"mpga", "audio/mpeg"},
+		{"weba", "audio/webm"},
+		{"wav", "audio/wave"},
+		{"otf", "font/otf"},
+		{"ttf", "font/ttf"},
+		{"woff", "font/woff"},
+		{"woff2", "font/woff2"},
+		{"7z", "application/x-7z-compressed"},
+		{"atom", "application/atom+xml"},
+		{"pdf", "application/pdf"},
+		{"mjs", "application/javascript"},
+		{"js", "application/javascript"},
+		{"json", "application/json"},
+		{"rss", "application/rss+xml"},
+		{"tar", "application/x-tar"},
+		{"xhtml", "application/xhtml+xml"},
+		{"xht", "application/xhtml+xml"},
+		{"xslt", "application/xslt+xml"},
+		{"xml", "application/xml"},
+		{"gz", "application/gzip"},
+		{"zip", "application/zip"},
+		{"wasm", "application/wasm"}
+	};
+
+	inline std::string_view trim(std::string_view s)
+	{
+		auto a = s.find_first_not_of(" \t\r\n");
+		if (a == std::string_view::npos) return "";
+		auto b = s.find_last_not_of(" \t\r\n");
+		return s.substr(a, b - a + 1);
+	}
+}
+
+
+namespace app {
+
+	bool is_http_char(char _c)
+	{
+		auto c = static_cast<unsigned char>(_c);
+		return c < 0x80 && http_available_ascii_codes[c];
+	}
+
+	// 1文字ずつ検査し、区切りに来たら開始位置からの範囲をまとめて取り出す
+	std::tuple<int, std::pmr::string, std::pmr::string, std::pmr::string, http_header_map>
+		parse_http_header(const std::vector<char>& _header, size_t _size, std::pmr::memory_resource* _mr)
+	{
+		enum : int {
+			SEC_METHOD,
+			SEC_REQUEST,
+			SEC_VERSION,
+			SEC_KEY,
+			SEC_VALUE
+		};
+
+		int sec = SEC_METHOD;
+		int rc = -1;
+		char prev_c = 0;
+
+		bool invalid_char = false;
+		std::pmr::string method(_mr);
+		bool method_oversize = false;
+		std::pmr::string request(_mr);
+		bool request_oversize = false;
+		std::pmr::string version(_mr);
+		bool version_oversize = false;
+		bool header_end = false;
+		bool invalid_keyvalue = false;
+		http_header_map key_values(_mr);
+
+		const char* p = _header.data();
+		const size_t n = std::min(_header.size(), _size);
+		size_t start = 0; // 解析中の区間の開始位置
+		size_t key_end = 0;
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			char c = p[i];
+
+			// check valid char
+			if (!is_http_char(c))
+			{
+				invalid_char = true;
+			}
+			else
+			{
+
+				switch (sec)
+				{
+				case SEC_METHOD:
+					if (c == ' ')
+					{
+						method.assign(p + start, i - start);
+						sec = SEC_REQUEST;
+						start = i + 1;
+					}
+					else if (i - start > 7)
+					{
+						// CONNECT/OPTIONS = 7chars
+						method_oversize = true;
+					}
+					break;
+				case SEC_REQUEST:
+					if (c == ' ')
+					{
+						request.assign(p + start, i - start);
+						sec = SEC_VERSION;
+						start = i + 1;
+					}
+					else if (i - start > 4096)
+					{
+						request_oversize = true;
+					}
+					break;
+				case SEC_VERSION:
+					if (c == '\n' && prev_c == '\r')
+					{
+						version.assign(p + start, i - 1 - start); // 末尾の\rは含めない
+						sec = SEC_KEY;
+						start = i + 1;
+					}
+					else if (i - start > 8)
+					{
+						// HTTP/1.1 = 8chars
+						version_oversize = true;
+					}
+					break;
+				case SEC_KEY:
+					if (c == '\n' && prev_c == '\r')
+					{
+						// 末尾の\rを除いて空なら空行
+						if (i - 1 == start)
+						{
+							header_end = true;
+						}
+						else
+						{
+							invalid_keyvalue = true;
+						}
+					}
+					else if (c == ':')
+					{
+						key_end = i;
+						sec = SEC_VALUE;
+					}
+					break;
+				case SEC_VALUE:
+					if (c == '\n' && prev_c == '\r')
+					{
+						sec = SEC_KEY;
+
+						// key valueの格納
+						const auto trimed_key = trim(std::string_view(p + start, key_end - start));
+						const auto trimed_value = trim(std::string_view(p + key_end + 1, i - 1 - (key_end + 1)));
+						if (trimed_key == "" || trimed_value == "")
+						{
+							invalid_keyvalue = true;
+						}
+						else
+						{
+							std::pmr::string k(trimed_key, _mr);
+							auto it = key_values.find(k);
+							if (it != key_values.end())
+							{
+								it->second.append(", ").append(trimed_value);
+							}
+							else
+							{
+								key_values.emplace(std::move(k), std::pmr::string(trimed_value, _mr));
+							}
+						}
+						start = i + 1;
+					}
+					break;
+				}
+			}
+
+			prev_c = c;
+
+			if (invalid_char) break;
+			if (method_oversize) break;
+			if (request_oversize) break;
+			if (version_oversize) break;
+			if (invalid_keyvalue) break;
+			if (header_end) break;
+		}
+
+		// 解析終了後のチェック
+		if (invalid_char) rc = -1;
+		else if (method_oversize) rc = -2;
+		else if (request_oversize) rc = -3;
+		else if (version_oversize) rc = -4;
+		else if (invalid_keyvalue) rc = -5;
+		else if (!header_end) rc = -6;
+		else rc = 0;
+
+		return {
+			rc,
+			std::move(method),
+			std::move(request),
+			std::move(version),
+			std::move(key_values)
+		};
+	}
+
+	// 検査だけ1文字ずつ行い、結果はリクエストの先頭からクエリの手前までを1回で取り出す
+	std::pmr::string get_absolute_path(std::string_view _request, std::pmr::memory_resource* _mr)
+	{
+		char prev_c = 0;
+		size_t end = 0;
+
+		for (; end < _request.size(); ++end)
+		{
+			char c = _request[end];
+			if (end == 0 && c != '/') // スラッシュで始まらないURL禁止
+				return std::pmr::string(_mr);
+
+			if (c == '/' && prev_c == '/') // 連続スラッシュ禁止
+				return std::pmr::string(_mr);
+			if (c == '/' && prev_c == '.') // .で終わるフォルダ禁止
+				return std::pmr::string(_mr);
+			if (c == '.' && prev_c == '/') // .で始まるファイル/フォルダは禁止
+				return std::pmr::string(_mr);
+			if (c == '.' && prev_c == '.') // 連続ドット禁止
+				return std::pmr::string(_mr);
+
+			if (c == '?') // クエリ以降は無視
+				break;
+
+			auto u = static_cast<unsigned char>(c);
+			if (u >= 0x80 || absolute_path_codes[u] == 0) // 許可されていない文字が含まれていた
+				return std::pmr::string(_mr);
+
+			prev_c = c;
+		}
+
+		if (end == 0 || prev_c == '.') // 空、または.で終わるファイルは禁止
+			return std::pmr::string(_mr);
+
+		return std::pmr::string(_request.substr(0, end), _mr);
+	}
+
+	const std::string& get_content_type(std::wstring_view _path)
+	{
+		static const std::string octet_stream = "application/octet-stream";
+
+		// 最後の\より後ろにある最後の.以降が拡張子
+		auto pos = _path.find_last_of(L"\\.");
+		if (pos == std::wstring_view::npos || _path.at(pos) != L'.')
+			return octet_stream;
+
+		std::array<char, 16> buf;
+		auto ext = _path.substr(pos + 1);
+		if (ext.empty() || ext.size() > buf.size())
+			return octet_stream;
+
+		for (size_t i = 0; i < ext.size(); ++i)
+		{
+			buf.at(i) = static_cast<char>(ext.at(i) & 0xff);
+		}
+
+		auto it = ext_map.find(std::string_view(buf.data(), ext.size()));
+		if (it == ext_map.end())
+			return octet_stream;
+
+		return it->second;
+	}
+}
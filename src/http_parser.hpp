@@ -0,0 +1,46 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+namespace app {
+
+	using http_header_map = std::pmr::unordered_map<std::pmr::string, std::pmr::string>;
+
+	// ヘッダに使える文字(0x80以上と制御文字は\t\r\n以外不可)
+	bool is_http_char(char _c);
+
+	// リクエストのヘッダを解析する。戻り値は(結果, メソッド, リクエストURI, バージョン, ヘッダ)
+	// 結果は0で成功、負なら不正(-1 文字, -2 メソッド長, -3 URI長, -4 バージョン長, -5 ヘッダ行, -6 空行が無い)
+	// 解析結果は全て_mrから確保する
+	std::tuple<int, std::pmr::string, std::pmr::string, std::pmr::string, http_header_map>
+		parse_http_header(const std::vector<char>& _header, size_t _size, std::pmr::memory_resource* _mr);
+
+	// リクエストURIからクエリを除いたパス。htdocsの外やドットファイルを指すものは空を返す
+	std::pmr::string get_absolute_path(std::string_view _request, std::pmr::memory_resource* _mr);
+
+	// 拡張子からContent-Type。不明ならapplication/octet-stream
+	const std::string& get_content_type(std::wstring_view _path);
+
+	// 200 OKのステータス行とヘッダを_outの後ろに書く
+	template <typename String>
+	void append_ok_header(String& _out, std::string_view _content_type, uint64_t _length)
+	{
+		std::array<char, 24> length;
+		auto [length_end, ec] = std::to_chars(length.data(), length.data() + length.size(), _length);
+		_out.append("HTTP/1.1 200 OK\r\n");
+		_out.append("Content-Type: ").append(_content_type).append("\r\n");
+		_out.append("Content-Length: ").append(length.data(), length_end).append("\r\n");
+		_out.append("Cache-Control: no-store\r\n");
+		_out.append("\r\n");
+	}
+}
@@ -0,0 +1,148 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include "log.hpp"
+#include "metrics.hpp"
+#include "not_found_cache.hpp"
+#include "stall_watchdog.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+
+namespace app {
+
+	// ログ出力あり
+	struct log_policy_enabled {
+		static constexpr bool enabled = true;
+
+		template <typename... Args>
+		static void write(const wchar_t* _str, Args... _args)
+		{
+			stall_call_scope scope(CALL_LOG);
+			log(_str, _args...);
+		}
+	};
+
+	// ログ出力無し。呼び出しごと消える
+	struct log_policy_disabled {
+		static constexpr bool enabled = false;
+
+		template <typename... Args>
+		static void write(const wchar_t*, Args...)
+		{
+		}
+	};
+
+	// 統計あり。スレッドごとのカウンタに加算する
+	struct metrics_policy_enabled {
+		static constexpr bool enabled = true;
+
+		static void add(metric_id _id, uint64_t _n = 1) noexcept
+		{
+			thread_local thread_metrics& metrics = metrics_registry::instance().local();
+			metrics.add(_id, _n);
+		}
+
+		static int64_t now() noexcept
+		{
+			return latency_now();
+		}
+
+		static void record(latency_phase _phase, int64_t _start, int64_t _end) noexcept
+		{
+			thread_local thread_metrics& metrics = metrics_registry::instance().local();
+			metrics.record(_phase, _start, _end);
+		}
+	};
+
+	// 統計無し
+	struct metrics_policy_disabled {
+		static constexpr bool enabled = false;
+
+		static void add(metric_id, uint64_t = 1) noexcept
+		{
+		}
+
+		static constexpr int64_t now() noexcept
+		{
+			return 0;
+		}
+
+		static void record(latency_phase, int64_t, int64_t) noexcept
+		{
+		}
+	};
+
+	// トレースあり。記録を始めていないスレッドでは時刻も取らない
+	struct trace_policy_enabled {
+		static constexpr bool enabled = true;
+
+		static int64_t now() noexcept
+		{
+			return trace_ring::current() != nullptr ? latency_now() : 0;
+		}
+
+		// _startからの区間。_startが0なら記録しない
+		static void complete(const char* _name, uint64_t _id, int64_t _start, uint64_t _bytes = 0) noexcept
+		{
+			auto ring = trace_ring::current();
+			if (ring == nullptr || _start == 0) return;
+			ring->push({ _name, _id, _start, std::max<int64_t>(latency_now() - _start, 1), _bytes });
+		}
+
+		static void instant(const char* _name, uint64_t _id, uint64_t _bytes = 0) noexcept
+		{
+			auto ring = trace_ring::current();
+			if (ring == nullptr) return;
+			ring->push({ _name, _id, latency_now(), 0, _bytes });
+		}
+	};
+
+	// トレース無し
+	struct trace_policy_disabled {
+		static constexpr bool enabled = false;
+
+		static constexpr int64_t now() noexcept
+		{
+			return 0;
+		}
+
+		static void complete(const char*, uint64_t, int64_t, uint64_t = 0) noexcept
+		{
+		}
+
+		static void instant(const char*, uint64_t, uint64_t = 0) noexcept
+		{
+		}
+	};
+
+	// ビルド時に選ぶ機能
+	// HTTPSERVER_NO_LOG: 接続処理のログを出さない
+	// HTTPSERVER_NO_NOTFOUND_CACHE: 404キャッシュを外す
+	// HTTPSERVER_NO_METRICS: 統計のカウンタを外す
+	// HTTPSERVER_NO_TRACE: イベントのトレースを外す
+#if defined(HTTPSERVER_NO_LOG)
+	using http_log_policy = log_policy_disabled;
+#else
+	using http_log_policy = log_policy_enabled;
+#endif
+
+#if defined(HTTPSERVER_NO_NOTFOUND_CACHE)
+	using http_cache_policy = null_not_found_cache;
+#else
+	using http_cache_policy = not_found_cache;
+#endif
+
+#if defined(HTTPSERVER_NO_METRICS)
+	using http_metrics_policy = metrics_policy_disabled;
+#else
+	using http_metrics_policy = metrics_policy_enabled;
+#endif
+
+#if defined(HTTPSERVER_NO_TRACE)
+	using http_trace_policy = trace_policy_disabled;
+#else
+	using http_trace_policy = trace_policy_enabled;
+#endif
+}
@@ -2,8 +2,11 @@
 
 #include "log.hpp"
 
+#include "stall_watchdog.hpp"
 #include "utils.hpp"
 
+#include <algorithm>
+
 #include <Ws2tcpip.h>
 #include <mswsock.h>
 
@@ -13,6 +16,86 @@
 namespace {
 	constexpr auto HTTP_BUFFER_SIZE = 16 * 1024; // 16KB
 	constexpr auto FILE_BUFFER_SIZE = 64 * 1024; // 64KB
+	constexpr auto FILE_CHUNK_GROW_USEC = 1000; // 1ms未満で送信完了したらチャンクを倍にする
+	constexpr auto FILE_CHUNK_SHRINK_USEC = 100000; // 100ms以上掛かったらチャンクを半分にする
+	constexpr ULONGLONG LINGER_MSEC = 1000; // 503/429を返した接続を閉じるまでの時間
+	constexpr size_t LINGER_MAX = 1024; // 閉じるのを待つ接続の上限。超えたら古いものから閉じる
+
+	// 受信済みのデータを読み捨てる。ノンブロッキングのソケットに対して使う
+	void drain_socket(SOCKET _sock)
+	{
+		char buf[4096];
+		for (int i = 0; i < 16; ++i)
+		{
+			if (::recv(_sock, buf, sizeof(buf), 0) <= 0) break;
+		}
+	}
+
+	// チャンク上限はFILE_BUFFER_SIZEの倍数に丸める
+	size_t get_chunk_max(const app::http_config_t& _config)
+	{
+		uint64_t chunk_max = static_cast<uint64_t>(_config.read_chunk_max) * 1024;
+		chunk_max = std::min<uint64_t>(chunk_max, 64 * 1024 * 1024);
+		chunk_max -= chunk_max % FILE_BUFFER_SIZE;
+		return static_cast<size_t>(std::max<uint64_t>(chunk_max, FILE_BUFFER_SIZE));
+	}
+
+	// ブロッキングスレッドで実行する。ファイルの有無を確かめてから開き、大きさを取る
+	void open_file(app::BLOCKING_JOB* _job)
+	{
+		auto& ctx = *reinterpret_cast<app::FILE_OPEN_CONTEXT*>(_job);
+
+		DWORD attr;
+		{
+			app::stall_call_scope scope(app::CALL_GET_FILE_ATTRIBUTES);
+			attr = ::GetFileAttributesW(ctx.path.c_str());
+		}
+		if (attr == INVALID_FILE_ATTRIBUTES || (attr & FILE_ATTRIBUTE_DIRECTORY))
+		{
+			ctx.missing = true;
+			return;
+		}
+
+		{
+			app::stall_call_scope scope(app::CALL_CREATE_FILE);
+			ctx.file = ::CreateFileW(ctx.path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		}
+		if (ctx.file == INVALID_HANDLE_VALUE) return;
+
+		LARGE_INTEGER size;
+		if (!::GetFileSizeEx(ctx.file, &size))
+		{
+			::CloseHandle(ctx.file);
+			ctx.file = INVALID_HANDLE_VALUE;
+			return;
+		}
+		ctx.size = size.QuadPart;
+
+		// バッファリング無しで読めるかはバッファの空き次第なので、両方開いておいてイベントループで選ぶ
+		if (ctx.direct_threshold > 0 && ctx.size >= ctx.direct_threshold)
+		{
+			app::stall_call_scope scope(app::CALL_CREATE_FILE);
+			ctx.direct_file = ::CreateFileW(ctx.path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING, NULL);
+		}
+	}
+
+	size_t get_read_ahead(const app::http_config_t& _config)
+	{
+		return std::clamp<uint32_t>(_config.read_ahead, 2, 64);
+	}
+
+	size_t get_accept_posted(const app::http_config_t& _config)
+	{
+		return std::clamp<uint32_t>(_config.accept_posted, 1, 256);
+	}
+
+	// 0はSOMAXCONN(OS任せ)。200を超える値はSOMAXCONN_HINTで渡さないと切り詰められる
+	int get_backlog(const app::http_config_t& _config)
+	{
+		if (_config.listen_backlog == 0) return SOMAXCONN;
+		if (_config.listen_backlog <= 200) return static_cast<int>(_config.listen_backlog);
+		return SOMAXCONN_HINT(static_cast<int>(std::min<uint32_t>(_config.listen_backlog, 0xffff)));
+	}
 }
 
 namespace app {
@@ -35,14 +118,73 @@ namespace app {
 
 	}
 
-	http_server::http_server(const std::string address, uint16_t port, uint16_t maxconn)
-		: listen_address_(address)
-		, listen_port_(port)
-		, addr_buffer_()
-		, accept_ctx_()
-		, conns_(maxconn)
+	ULONG get_remote_address(LPVOID _buffer, DWORD _len)
+	{
+		SOCKADDR_IN* l;
+		SOCKADDR_IN* r;
+		INT llen = sizeof(SOCKADDR_IN);
+		INT rlen = sizeof(SOCKADDR_IN);
+		::GetAcceptExSockaddrs(_buffer, _len, llen + 16, rlen + 16, reinterpret_cast<sockaddr**>(&l), &llen, reinterpret_cast<sockaddr**>(&r), &rlen);
+
+		return r->sin_addr.s_addr;
+	}
+
+	template <typename LogPolicy>
+	basic_http_server<LogPolicy>::basic_http_server(const http_config_t& _config)
+		: listen_address_(_config.ip)
+		, listen_port_(_config.port)
+		, backlog_(get_backlog(_config))
+		, nodelay_(_config.tcp_nodelay)
+		, send_buffer_(static_cast<int>(std::min<uint32_t>(_config.send_buffer, 64 * 1024) * 1024))
+		, recv_buffer_(static_cast<int>(std::min<uint32_t>(_config.recv_buffer, 64 * 1024) * 1024))
+		, fastopen_(_config.tcp_fastopen)
+		, accept_ctxs_(get_accept_posted(_config))
+		, accept_timeout_(_config.accept_data ? _config.accept_data_timeout : 0)
+		, conns_(_config.maxconn)
+		, chunk_max_(FILE_BUFFER_SIZE)
+		, qpc_freq_()
+		, direct_threshold_(static_cast<uint64_t>(_config.direct_io_threshold) * 1024 * 1024)
+		, direct_pool_(get_chunk_max(_config), get_read_ahead(_config) * _config.direct_io_streams)
+		, reserved_(std::min<size_t>(_config.reserved_connections, _config.maxconn))
+		, healthcheck_address_(INADDR_NONE)
+		, response_unavailable_()
+		, response_too_many_()
+		, lingering_()
+		, admission_()
+		, compport_(NULL)
+		, file_compkey_(0)
+		, pool_(nullptr)
 		, sock_(INVALID_SOCKET)
 	{
+		inet_pton(AF_INET, _config.healthcheck_ip.c_str(), &healthcheck_address_);
+
+		// 接続数超過時の応答は予め組み立てておく
+		response_unavailable_ =
+			"HTTP/1.1 503 Service Unavailable\r\n"
+			"Retry-After: " + std::to_string(_config.retry_after) + "\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: close\r\n"
+			"\r\n";
+		response_too_many_ =
+			"HTTP/1.1 429 Too Many Requests\r\n"
+			"Retry-After: 1\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: close\r\n"
+			"\r\n";
+
+		chunk_max_ = static_cast<DWORD>(get_chunk_max(_config));
+		size_t read_ahead = get_read_ahead(_config);
+
+		::QueryPerformanceFrequency(&qpc_freq_);
+
+		// 接続待ちは複数同時に出しておく。最初のデータも受け取る場合は受信バッファ分を足す
+		for (auto& x : accept_ctxs_)
+		{
+			x.sock = INVALID_SOCKET;
+			x.recv_len = _config.accept_data ? HTTP_BUFFER_SIZE : 0;
+			x.buf.resize(x.recv_len + (sizeof(SOCKADDR_IN) + 16) * 2);
+		}
+
 		// 初期化
 		for (auto& x : conns_)
 		{
@@ -56,17 +198,31 @@ namespace app {
 			x.iow_ctx.wsabuf.len = 0;
 			x.iow_ctx.type = HTTP_TCP_SEND;
 
-			x.fio_ctx.buf.at(0).resize(FILE_BUFFER_SIZE);
-			x.fio_ctx.buf.at(1).resize(FILE_BUFFER_SIZE);
+			x.open_ctx.job.run = open_file;
+			x.open_ctx.job.compkey = 0;
+
+			x.fio_ctx.slots.resize(read_ahead);
+			for (auto& slot : x.fio_ctx.slots)
+			{
+				slot.buf.resize(FILE_BUFFER_SIZE);
+				slot.direct_buf = nullptr;
+				slot.pending = false;
+				slot.conn = &x;
+			}
 		}
 	}
 
-	http_server::~http_server()
+	template <typename LogPolicy>
+	basic_http_server<LogPolicy>::~basic_http_server()
 	{
 		// 各接続の切断
 		for (auto& x : conns_)
 		{
 			if (x.sock != INVALID_SOCKET) connection_close(&x);
+
+			// ブロッキングスレッドは先に止めてあるので、届かなかった完了の分を閉じる
+			x.open_ctx.pending = false;
+			release_opened(&x);
 		}
 
 		// Listenポートを閉じる
@@ -74,20 +230,56 @@ namespace app {
 		{
 			::closesocket(sock_);
 		}
+
+		close_lingering(true);
+
+		// 未完了のAcceptEx()用ソケット
+		for (auto& x : accept_ctxs_)
+		{
+			if (x.sock != INVALID_SOCKET) ::closesocket(x.sock);
+		}
 	}
 
-	bool http_server::tcp_socket()
+	template <typename LogPolicy>
+	bool basic_http_server<LogPolicy>::tcp_socket()
 	{
 		sock_ = ::WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_IP, NULL, 0, WSA_FLAG_OVERLAPPED);
 		if (sock_ == INVALID_SOCKET)
 		{
-			log(L"Error: WSASocket() failed. WSAGetLstError()=%d", ::WSAGetLastError());
+			LogPolicy::write(L"Error: WSASocket() failed. WSAGetLstError()=%d", ::WSAGetLastError());
 			return false;
 		}
+
+		// 受信バッファはウィンドウスケールが決まる接続前に設定しておく
+		set_buffer_sizes(sock_);
+
+		// TCP Fast Openはlisten()の前に設定する。非対応のOSでは無視して続ける
+		if (fastopen_)
+		{
+			DWORD enable = 1;
+			if (::setsockopt(sock_, IPPROTO_TCP, TCP_FASTOPEN, reinterpret_cast<const char*>(&enable), sizeof(enable)) != 0)
+			{
+				LogPolicy::write(L"Error: setsockopt(TCP_FASTOPEN) failed. WSAGetLastError()=%d", ::WSAGetLastError());
+			}
+		}
 		return true;
 	}
 
-	bool http_server::tcp_bind()
+	template <typename LogPolicy>
+	void basic_http_server<LogPolicy>::set_buffer_sizes(SOCKET _sock)
+	{
+		if (send_buffer_ > 0)
+		{
+			::setsockopt(_sock, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char*>(&send_buffer_), sizeof(send_buffer_));
+		}
+		if (recv_buffer_ > 0)
+		{
+			::setsockopt(_sock, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char*>(&recv_buffer_), sizeof(recv_buffer_));
+		}
+	}
+
+	template <typename LogPolicy>
+	bool basic_http_server<LogPolicy>::tcp_bind()
 	{
 		struct sockaddr_in addr;
 		addr.sin_family = AF_INET;
@@ -95,67 +287,214 @@ namespace app {
 		inet_pton(AF_INET, listen_address_.c_str(), &addr.sin_addr.s_addr);
 		if (::bind(sock_, (struct sockaddr*)&addr, sizeof(addr)) != 0)
 		{
-			log(L"Error: bind() failed. WSAGetLastError()=%d", ::WSAGetLastError());
+			LogPolicy::write(L"Error: bind() failed. WSAGetLastError()=%d", ::WSAGetLastError());
 			return false;
 		}
 		return true;
 	}
 
-	bool http_server::tcp_listen()
+	template <typename LogPolicy>
+	bool basic_http_server<LogPolicy>::tcp_listen()
 	{
-		if (::listen(sock_, 16) != 0)
+		if (::listen(sock_, backlog_) != 0)
 		{
-			log(L"Error: listen() failed. WSAGetLastError()=%d", ::WSAGetLastError());
+			LogPolicy::write(L"Error: listen() failed. WSAGetLastError()=%d", ::WSAGetLastError());
 			return false;
 		}
 		return true;
 	}
 
-	http_conn_t* http_server::insert(SOCKET _sock)
+	template <typename LogPolicy>
+	http_conn_t* basic_http_server<LogPolicy>::insert(SOCKET _sock, bool _healthcheck)
 	{
+		// 予約分はヘルスチェック元だけが使える
+		size_t limit = conns_.size() - (_healthcheck ? 0 : reserved_);
+		if (admission_.active >= limit) return nullptr;
+
 		for (auto& x : conns_)
 		{
-			if (x.sock == INVALID_SOCKET)
+			// ファイルを開いている途中の枠は、完了が届くまで使わない
+			if (x.sock == INVALID_SOCKET && !x.open_ctx.pending)
 			{
 				x.sock = _sock;
+
+				// AcceptEx()で受けたソケットにリスンソケットの属性を引き継ぐ(shutdown()やgetpeername()用)
+				::setsockopt(_sock, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, reinterpret_cast<const char*>(&sock_), sizeof(sock_));
+
+				// 103 Early Hintsやヘッダだけの応答の後に続く送信をNagleで待たせない
+				if (nodelay_)
+				{
+					BOOL enable = TRUE;
+					::setsockopt(_sock, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&enable), sizeof(enable));
+				}
+
+				admission_.accepted++;
+				if (admission_.active >= conns_.size() - reserved_) admission_.reserved_accepted++;
+				admission_.active++;
+				admission_.peak = std::max(admission_.peak, admission_.active);
 				return &x;
 			}
 		}
 		return nullptr;
 	}
 
-	bool http_server::prepare()
+	template <typename LogPolicy>
+	void basic_http_server<LogPolicy>::reject(SOCKET _sock)
+	{
+		admission_.shed++;
+		close_with(_sock, response_unavailable_);
+	}
+
+	template <typename LogPolicy>
+	void basic_http_server<LogPolicy>::reject_too_many(SOCKET _sock)
+	{
+		close_with(_sock, response_too_many_);
+	}
+
+	template <typename LogPolicy>
+	void basic_http_server<LogPolicy>::close_with(SOCKET _sock, const std::string& _response)
+	{
+		// 待たせずに応答を返して送信側だけ閉じる
+		u_long nonblocking = 1;
+		::ioctlsocket(_sock, FIONBIO, &nonblocking);
+		::setsockopt(_sock, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, reinterpret_cast<const char*>(&sock_), sizeof(sock_));
+		::send(_sock, _response.data(), static_cast<int>(_response.size()), 0);
+		::shutdown(_sock, SD_SEND);
+
+		// 未読のリクエストが残ったまま閉じるとRSTになり、応答が相手に読まれずに捨てられることがある
+		// 受信済みの分を読み捨て、すぐには閉じずに少し待ってから閉じる
+		drain_socket(_sock);
+		if (lingering_.size() >= LINGER_MAX)
+		{
+			::closesocket(lingering_.front().first);
+			lingering_.erase(lingering_.begin());
+		}
+		lingering_.emplace_back(_sock, ::GetTickCount64());
+		admission_.lingering = lingering_.size();
+	}
+
+	template <typename LogPolicy>
+	void basic_http_server<LogPolicy>::close_lingering(bool _all)
+	{
+		auto now = ::GetTickCount64();
+		auto it = lingering_.begin();
+		for (; it != lingering_.end(); ++it)
+		{
+			if (!_all && now - it->second < LINGER_MSEC) break;
+			drain_socket(it->first);
+			::closesocket(it->first);
+		}
+		lingering_.erase(lingering_.begin(), it);
+		admission_.lingering = lingering_.size();
+	}
+
+	template <typename LogPolicy>
+	void basic_http_server<LogPolicy>::queue_accepts(size_t _count) noexcept
+	{
+		admission_.queued += _count;
+		admission_.queue_peak = std::max(admission_.queue_peak, admission_.queued);
+	}
+
+	template <typename LogPolicy>
+	void basic_http_server<LogPolicy>::dequeue_accept() noexcept
+	{
+		if (admission_.queued > 0) admission_.queued--;
+	}
+
+	template <typename LogPolicy>
+	void basic_http_server<LogPolicy>::count_reaped_accept() noexcept
+	{
+		admission_.accept_reaped++;
+	}
+
+	// 開いたファイルの読込完了を受け取るポート
+	template <typename LogPolicy>
+	void basic_http_server<LogPolicy>::set_completion_port(HANDLE _compport, ULONG_PTR _file_compkey)
+	{
+		compport_ = _compport;
+		file_compkey_ = _file_compkey;
+	}
+
+	template <typename LogPolicy>
+	void basic_http_server<LogPolicy>::set_blocking_pool(blocking_pool* _pool)
+	{
+		pool_ = _pool;
+	}
+
+	template <typename LogPolicy>
+	bool basic_http_server<LogPolicy>::prepare()
 	{
 		if (!tcp_socket()) return false;
 		if (!tcp_bind()) return false;
 		if (!tcp_listen()) return false;
-		log(L"Info: listen websocket server at %s:%d", s_to_ws(listen_address_).c_str(), listen_port_);
+		LogPolicy::write(L"Info: listen websocket server at %s:%d", s_to_ws(listen_address_).c_str(), listen_port_);
+		LogPolicy::write(L"Info: backlog=%d accept_posted=%llu accept_data=%lu accept_data_timeout=%lu", backlog_, static_cast<uint64_t>(accept_ctxs_.size()), accept_ctxs_.front().recv_len, accept_timeout_);
+		LogPolicy::write(L"Info: tcp_nodelay=%d send_buffer=%d recv_buffer=%d tcp_fastopen=%d", nodelay_ ? 1 : 0, send_buffer_, recv_buffer_, fastopen_ ? 1 : 0);
 		return true;
 	}
 
-	size_t http_server::count() const noexcept
+	template <typename LogPolicy>
+	size_t basic_http_server<LogPolicy>::count() const noexcept
+	{
+		return admission_.active;
+	}
+
+	template <typename LogPolicy>
+	admission_stats_t basic_http_server<LogPolicy>::admission_stats() const noexcept
+	{
+		return admission_;
+	}
+
+	// アリーナに収まらずヒープから確保した回数。定常状態で増えなければリクエスト処理はヒープを使っていない
+	template <typename LogPolicy>
+	arena_stats_t basic_http_server<LogPolicy>::arena_stats() const noexcept
 	{
-		size_t i = 0;
+		arena_stats_t r = {};
 		for (const auto& x : conns_)
-			if (x.sock != INVALID_SOCKET) i++;
-		return i;
+		{
+			r.overflows += x.arena_upstream.count();
+			r.bytes += x.arena_upstream.bytes();
+		}
+		return r;
+	}
+
+	// 発行済みで完了していないファイル読込の数
+	template <typename LogPolicy>
+	size_t basic_http_server<LogPolicy>::inflight_reads() const noexcept
+	{
+		size_t r = 0;
+		for (const auto& x : conns_)
+		{
+			r += x.fio_ctx.reading;
+		}
+		return r;
 	}
 
-	bool http_server::tcp_send(http_conn_t* _conn, const std::vector<char*>& _data)
+	template <typename LogPolicy>
+	bool basic_http_server<LogPolicy>::is_healthcheck(ULONG _address) const noexcept
+	{
+		// 予約が0でも接続元IPごとの制限からは外す
+		return _address == healthcheck_address_;
+	}
+
+	template <typename LogPolicy>
+	bool basic_http_server<LogPolicy>::is_trusted(ULONG _address) const noexcept
+	{
+		// 127.0.0.0/8
+		return (::ntohl(_address) >> 24) == 127 || _address == healthcheck_address_;
+	}
+
+	// 複数バッファを1回で送信する。バッファの中身は送信完了まで保持すること
+	template <typename LogPolicy>
+	bool basic_http_server<LogPolicy>::tcp_send(http_conn_t* _conn, const WSABUF* _bufs, DWORD _count)
 	{
 		if (_conn->sock == INVALID_SOCKET) return false;
 
 		HTTP_IO_CONTEXT& ctx = _conn->iow_ctx;
 
-		// バッファコピー
-		if (_data.size() > ctx.buf.size()) ctx.buf.resize(_data.size());
-		std::memcpy(ctx.buf.data(), _data.data(), _data.size());
-
-		// バッファに情報を格納
+		// WSABUF配列自体はWSASend()内で取り込まれる
 		std::memset(&ctx.ov, 0, sizeof(WSAOVERLAPPED));
-		ctx.wsabuf.buf = ctx.buf.data();
-		ctx.wsabuf.len = _data.size();
-		auto rc = ::WSASend(_conn->sock, &ctx.wsabuf, 1, nullptr, 0, &ctx.ov, nullptr);
+		auto rc = ::WSASend(_conn->sock, const_cast<LPWSABUF>(_bufs), _count, nullptr, 0, &ctx.ov, nullptr);
 		if (rc == 0)
 		{
 			return true;
@@ -164,7 +503,7 @@ namespace app {
 		auto error = ::WSAGetLastError();
 		if (error != ERROR_IO_PENDING)
 		{
-			log(L"Error: WSASend() failed. ErrorCode=%d", error);
+			LogPolicy::write(L"Error: WSASend() failed. ErrorCode=%d", error);
 			connection_close(_conn);
 			return false;
 		}
@@ -172,7 +511,8 @@ namespace app {
 		return true;
 	}
 
-	bool http_server::tcp_send(http_conn_t* _conn, const std::string& _str)
+	template <typename LogPolicy>
+	bool basic_http_server<LogPolicy>::tcp_send(http_conn_t* _conn, const std::string& _str)
 	{
 		if (_conn->sock == INVALID_SOCKET) return false;
 
@@ -182,62 +522,98 @@ namespace app {
 		if (_str.size() > ctx.buf.size()) ctx.buf.resize(_str.size());
 		std::copy(_str.begin(), _str.end(), ctx.buf.begin());
 
-		// バッファに情報を格納
-		std::memset(&ctx.ov, 0, sizeof(WSAOVERLAPPED));
 		ctx.wsabuf.buf = ctx.buf.data();
 		ctx.wsabuf.len = _str.size();
-		auto rc = ::WSASend(_conn->sock, &ctx.wsabuf, 1, nullptr, 0, &ctx.ov, nullptr);
-		if (rc == 0)
-		{
-			return true;
-		}
+		return tcp_send(_conn, &ctx.wsabuf, 1);
+	}
 
-		auto error = ::WSAGetLastError();
-		if (error != ERROR_IO_PENDING)
+	template <typename LogPolicy>
+	bool basic_http_server<LogPolicy>::tcp_send_file(http_conn_t* _conn)
+	{
+		if (_conn->sock == INVALID_SOCKET) return false;
+
+		FILE_IO_CONTEXT& fctx = _conn->fio_ctx;
+
+		// 送信中もしくは次のバッファが読込中なら何もしない
+		DWORD length = next_send_size(fctx);
+		if (length == 0) return true;
+		FILE_READ_CONTEXT& slot = fctx.slots.at(fctx.sent_count % fctx.slots.size());
+
+		// 未送信のヘッダがあれば最初のボディと一緒に送る
+		std::array<WSABUF, 2> bufs;
+		DWORD count = 0;
+		fctx.header_size = static_cast<DWORD>(_conn->header.size());
+		if (fctx.header_size > 0)
 		{
-			log(L"Error: WSASend() failed. ErrorCode=%d", error);
-			connection_close(_conn);
-			return false;
+			bufs.at(count).buf = _conn->header.data();
+			bufs.at(count).len = fctx.header_size;
+			count++;
 		}
+		bufs.at(count).buf = slot.data + slot.sent;
+		bufs.at(count).len = length;
+		count++;
 
+		::QueryPerformanceCounter(&fctx.send_start);
+		if (!tcp_send(_conn, bufs.data(), count)) return false;
 
+		fctx.sending = true;
 		return true;
 	}
 
-	bool http_server::tcp_send_file(http_conn_t* _conn)
+	template <typename LogPolicy>
+	void basic_http_server<LogPolicy>::tcp_send_file_complete(http_conn_t* _conn, DWORD _transferred)
 	{
-		if (_conn->sock == INVALID_SOCKET) return false;
-
-		HTTP_IO_CONTEXT& ctx = _conn->iow_ctx;
 		FILE_IO_CONTEXT& fctx = _conn->fio_ctx;
-		size_t index = (fctx.sent_count % 2);
-		std::vector<char>& buf = fctx.buf.at(index);
-		DWORD transferred = fctx.transferred.at(index);
+		FILE_READ_CONTEXT& slot = fctx.slots.at(fctx.sent_count % fctx.slots.size());
 
-		// バッファに情報を格納
-		std::memset(&ctx.ov, 0, sizeof(WSAOVERLAPPED));
-		ctx.wsabuf.buf = buf.data();
-		ctx.wsabuf.len = transferred;
-		auto rc = ::WSASend(_conn->sock, &ctx.wsabuf, 1, nullptr, 0, &ctx.ov, nullptr);
-		if (rc == 0)
+		// ヘッダ分を差し引く
+		if (fctx.header_size > 0)
 		{
-			fctx.sending = true;
-			return true;
+			_transferred -= std::min(_transferred, fctx.header_size);
+			fctx.header_size = 0;
+			_conn->header.clear();
 		}
 
-		auto error = ::WSAGetLastError();
-		if (error != ERROR_IO_PENDING)
+		// バッファを送り切ったら次のバッファに進む
+		slot.sent += _transferred;
+		if (slot.sent >= slot.transferred)
 		{
-			log(L"Error: WSASend() failed. ErrorCode=%d", error);
-			connection_close(_conn);
-			return false;
+			slot.ready = false;
+			fctx.sent_count++;
+		}
+		fctx.total_sent += _transferred;
+		fctx.sending = false;
+
+		// 送信の捌け具合から次回以降の読込サイズを調整
+		LARGE_INTEGER now;
+		::QueryPerformanceCounter(&now);
+		auto usec = (now.QuadPart - fctx.send_start.QuadPart) * 1000000 / qpc_freq_.QuadPart;
+		if (usec < FILE_CHUNK_GROW_USEC && _transferred == fctx.chunk && fctx.chunk < chunk_max_)
+		{
+			fctx.chunk = std::min<DWORD>(fctx.chunk * 2, chunk_max_);
+		}
+		else if (usec >= FILE_CHUNK_SHRINK_USEC && fctx.chunk > FILE_BUFFER_SIZE)
+		{
+			fctx.chunk = std::max<DWORD>(fctx.chunk / 2, FILE_BUFFER_SIZE);
 		}
 
-		fctx.sending = true;
-		return true;
+		// 送信し終わったら拡大したバッファを戻す
+		if (fctx.total_sent >= fctx.size && fctx.reading == 0)
+		{
+			for (auto& x : fctx.slots)
+			{
+				if (x.buf.size() > FILE_BUFFER_SIZE)
+				{
+					x.buf.resize(FILE_BUFFER_SIZE);
+					x.buf.shrink_to_fit();
+				}
+			}
+			release_direct_buffers(_conn);
+		}
 	}
 
-	bool http_server::tcp_read(http_conn_t *_conn)
+	template <typename LogPolicy>
+	bool basic_http_server<LogPolicy>::tcp_read(http_conn_t *_conn)
 	{
 		if (_conn->sock == INVALID_SOCKET) return false;
 
@@ -256,7 +632,7 @@ namespace app {
 		auto error = ::WSAGetLastError();
 		if (error != WSA_IO_PENDING)
 		{
-			log(L"Error: WSARecv() failed. WSAGetLastError()=%d", error);
+			LogPolicy::write(L"Error: WSARecv() failed. WSAGetLastError()=%d", error);
 			connection_close(_conn);
 			return false;
 		}
@@ -264,13 +640,30 @@ namespace app {
 		return true;
 	}
 
-	bool http_server::tcp_acceptex()
+	template <typename LogPolicy>
+	bool basic_http_server<LogPolicy>::tcp_acceptex()
+	{
+		for (auto& x : accept_ctxs_)
+		{
+			if (!tcp_acceptex(&x)) return false;
+		}
+		return true;
+	}
+
+	template <typename LogPolicy>
+	bool basic_http_server<LogPolicy>::tcp_acceptex(HTTP_ACCEPT_CONTEXT* _ctx)
 	{
-		accept_ctx_.sock = ::WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_IP, NULL, 0, WSA_FLAG_OVERLAPPED);
-		accept_ctx_.data = addr_buffer_.data();
+		_ctx->sock = ::WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_IP, NULL, 0, WSA_FLAG_OVERLAPPED);
+		if (_ctx->sock == INVALID_SOCKET)
+		{
+			LogPolicy::write(L"Error: WSASocket() failed. WSAGetLstError()=%d", ::WSAGetLastError());
+			return false;
+		}
+		set_buffer_sizes(_ctx->sock);
 
-		auto rc = ::AcceptEx(sock_, accept_ctx_.sock, addr_buffer_.data(), 0,
-			sizeof(SOCKADDR_IN) + 16, sizeof(SOCKADDR_IN) + 16, NULL, &accept_ctx_.ov);
+		std::memset(&_ctx->ov, 0, sizeof(WSAOVERLAPPED));
+		auto rc = ::AcceptEx(sock_, _ctx->sock, _ctx->buf.data(), _ctx->recv_len,
+			sizeof(SOCKADDR_IN) + 16, sizeof(SOCKADDR_IN) + 16, NULL, &_ctx->ov);
 
 		if (rc == TRUE)
 		{
@@ -280,50 +673,159 @@ namespace app {
 		auto error = ::WSAGetLastError();
 		if (error != ERROR_IO_PENDING)
 		{
-			log(L"Error: AcceptEx() failed. WSAGetLastError()=", error);
+			LogPolicy::write(L"Error: AcceptEx() failed. WSAGetLastError()=%d", error);
+			::closesocket(_ctx->sock);
+			_ctx->sock = INVALID_SOCKET;
 			return false;
 		}
 
 		return true;
 	}
 
-	bool http_server::file_open(http_conn_t* _conn, const std::wstring& _path)
+	template <typename LogPolicy>
+	void basic_http_server<LogPolicy>::reap_accepts()
 	{
-		FILE_IO_CONTEXT& ctx = _conn->fio_ctx;
-		if (ctx.file != INVALID_HANDLE_VALUE)
+		if (accept_timeout_ == 0) return;
+
+		for (auto& x : accept_ctxs_)
 		{
-			return false;
+			if (x.sock == INVALID_SOCKET) continue;
+
+			// 接続してからの秒数。まだ接続されていなければ0xFFFFFFFF
+			DWORD seconds = 0xFFFFFFFF;
+			int len = sizeof(seconds);
+			if (::getsockopt(x.sock, SOL_SOCKET, SO_CONNECT_TIME, reinterpret_cast<char*>(&seconds), &len) != 0) continue;
+			if (seconds == 0xFFFFFFFF || seconds < accept_timeout_) continue;
+
+			// 閉じるとAcceptExが完了するので、そこで数えて接続待ちを出し直す
+			::closesocket(x.sock);
+			x.sock = INVALID_SOCKET;
 		}
+	}
 
-		ctx.file = ::CreateFileW(_path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
-		if (ctx.file == INVALID_HANDLE_VALUE)
+	template <typename LogPolicy>
+	bool basic_http_server<LogPolicy>::file_open_start(http_conn_t* _conn, const wchar_t* _path)
+	{
+		FILE_OPEN_CONTEXT& ctx = _conn->open_ctx;
+		if (ctx.pending)
 		{
+			// 前の依頼の完了を待たずにジョブを使い回すと、ブロッキングスレッドと同じ領域を書き換えてしまう
+			LogPolicy::write(L"Error: sock=%llu file open is still pending", _conn->sock);
+			ctx.missing = true;
 			return false;
 		}
-		log(L"Info: sock=%llu handle=%p open", _conn->sock, ctx.file);
+		release_opened(_conn);
+		ctx.path.assign(_path);
+		ctx.direct_threshold = direct_threshold_;
+		ctx.missing = false;
+		ctx.size = 0;
+		std::memset(&ctx.job.ov, 0, sizeof(OVERLAPPED));
+
+		if (pool_ != nullptr)
+		{
+			ctx.pending = true;
+			ctx.issued = ctx.generation;
+			if (pool_->submit(&ctx.job)) return true;
+			ctx.pending = false;
+		}
 
-		std::memset(&ctx.ov, 0, sizeof(OVERLAPPED));
+		// ブロッキングスレッドが無ければその場で開く
+		ctx.job.run(&ctx.job);
+		return false;
+	}
 
-		LARGE_INTEGER size;
-		if (!::GetFileSizeEx(ctx.file, &size))
+	template <typename LogPolicy>
+	bool basic_http_server<LogPolicy>::file_open_finish(FILE_OPEN_CONTEXT* _ctx)
+	{
+		_ctx->pending = false;
+		if (_ctx->issued == _ctx->generation) return true;
+
+		// 開いている間に切断された。待っているコルーチンも無いのでここで閉じる
+		release_opened(_ctx->conn);
+		return false;
+	}
+
+	template <typename LogPolicy>
+	bool basic_http_server<LogPolicy>::file_open_complete(http_conn_t* _conn)
+	{
+		FILE_OPEN_CONTEXT& opened = _conn->open_ctx;
+		FILE_IO_CONTEXT& ctx = _conn->fio_ctx;
+		if (opened.file == INVALID_HANDLE_VALUE || ctx.file != INVALID_HANDLE_VALUE)
 		{
-			file_close(_conn);
+			release_opened(_conn);
 			return false;
 		}
-		ctx.size = size.QuadPart;
-		log(L"Info: sock=%llu handle=%p size=%llu", _conn->sock, ctx.file, ctx.size);
+
+		ctx.file = opened.file;
+		ctx.size = opened.size;
+		opened.file = INVALID_HANDLE_VALUE;
+		LogPolicy::write(L"Info: sock=%llu handle=%p open", _conn->sock, ctx.file);
+
+		// 大きなファイルはキャッシュを汚さないようにバッファリング無しで開いた方を使う
+		ctx.direct = false;
+		if (opened.direct_file != INVALID_HANDLE_VALUE)
+		{
+			size_t needed = 0;
+			for (const auto& slot : ctx.slots)
+			{
+				if (slot.direct_buf == nullptr) needed++;
+			}
+
+			if (direct_pool_.available() >= needed)
+			{
+				bool acquired = true;
+				for (auto& slot : ctx.slots)
+				{
+					if (slot.direct_buf == nullptr) slot.direct_buf = direct_pool_.acquire();
+					if (slot.direct_buf == nullptr) acquired = false;
+				}
+
+				if (acquired)
+				{
+					::CloseHandle(ctx.file);
+					ctx.file = opened.direct_file;
+					opened.direct_file = INVALID_HANDLE_VALUE;
+					ctx.direct = true;
+				}
+			}
+		}
+		release_opened(_conn);
+		if (!ctx.direct)
+		{
+			release_direct_buffers(_conn);
+		}
+		LogPolicy::write(L"Info: sock=%llu handle=%p size=%llu direct=%d", _conn->sock, ctx.file, ctx.size, ctx.direct ? 1 : 0);
 
 		ctx.read_count = 0;
 		ctx.sent_count = 0;
 		ctx.total_read = 0;
 		ctx.total_sent = 0;
+		ctx.next_offset = 0;
+		ctx.send_limit = 0;
 		ctx.sending = false;
-		ctx.reading = false;
+		for (auto& slot : ctx.slots)
+		{
+			slot.ready = false;
+		}
+
+		// 大きいファイルほど1回の読込サイズを大きくする
+		ctx.chunk = FILE_BUFFER_SIZE;
+		while (ctx.chunk < chunk_max_ && static_cast<uint64_t>(ctx.chunk) * 16 < ctx.size)
+		{
+			ctx.chunk = std::min<DWORD>(ctx.chunk * 2, chunk_max_);
+		}
+
+		if (compport_ != NULL)
+		{
+			stall_call_scope scope(CALL_ASSOCIATE_PORT);
+			::CreateIoCompletionPort(ctx.file, compport_, file_compkey_, 0);
+		}
 
 		return true;
 	}
 
-	bool http_server::file_read(http_conn_t* _conn)
+	template <typename LogPolicy>
+	bool basic_http_server<LogPolicy>::file_read(http_conn_t* _conn)
 	{
 		FILE_IO_CONTEXT& ctx = _conn->fio_ctx;
 		if (ctx.file == INVALID_HANDLE_VALUE)
@@ -331,24 +833,60 @@ namespace app {
 			return false;
 		}
 
-		if (::ReadFile(ctx.file, ctx.buf.at(ctx.read_count % 2).data(), ctx.buf.at(ctx.read_count % 2).size(), NULL, &ctx.ov))
+		// 空きバッファがある限り先読みする
+		while (ctx.next_offset < ctx.size && ctx.read_count < ctx.sent_count + ctx.slots.size())
 		{
-			ctx.reading = true;
-			return true;
-		}
+			FILE_READ_CONTEXT& slot = ctx.slots.at(ctx.read_count % ctx.slots.size());
+			// 閉じたファイルへの読込がまだ完了していなければ、届いたときにon_file_read()から出し直す
+			if (slot.pending) break;
+
+			uint64_t remaining = ctx.size - ctx.next_offset;
+			DWORD length = static_cast<DWORD>(std::min<uint64_t>(ctx.chunk, remaining));
+			DWORD request = length;
+			if (ctx.direct)
+			{
+				// バッファリング無しではサイズをセクタ境界に揃える(末尾は実サイズ分だけ返ってくる)
+				request = static_cast<DWORD>(std::min<uint64_t>(ctx.chunk, (remaining + FILE_BUFFER_SIZE - 1) / FILE_BUFFER_SIZE * FILE_BUFFER_SIZE));
+				slot.data = slot.direct_buf;
+			}
+			else
+			{
+				if (slot.buf.size() < length) slot.buf.resize(length);
+				slot.data = slot.buf.data();
+			}
 
-		auto error = ::GetLastError();
-		if (error != ERROR_IO_PENDING)
-		{
-			log(L"Error: ReadFile() failed. GetLastError()=", error);
-			return false;
+			std::memset(&slot.ov, 0, sizeof(OVERLAPPED));
+			slot.ov.Offset = ctx.next_offset & 0xffffffff;
+			slot.ov.OffsetHigh = (ctx.next_offset >> 32) & 0xffffffff;
+			slot.offset = ctx.next_offset;
+			slot.length = length;
+			slot.request = request;
+			slot.transferred = 0;
+			slot.sent = 0;
+			slot.ready = false;
+
+			if (!::ReadFile(ctx.file, slot.data, request, NULL, &slot.ov))
+			{
+				auto error = ::GetLastError();
+				if (error != ERROR_IO_PENDING)
+				{
+					LogPolicy::write(L"Error: ReadFile() failed. GetLastError()=%lu", error);
+					return false;
+				}
+			}
+
+			slot.pending = true;
+			slot.issued = ctx.generation;
+			ctx.read_count++;
+			ctx.reading++;
+			ctx.next_offset += length;
 		}
 
-		ctx.reading = true;
 		return true;
 	}
 
-	void http_server::file_close(http_conn_t* _conn)
+	template <typename LogPolicy>
+	void basic_http_server<LogPolicy>::file_close(http_conn_t* _conn)
 	{
 		FILE_IO_CONTEXT& ctx = _conn->fio_ctx;
 
@@ -356,20 +894,71 @@ namespace app {
 		{
 			::CancelIo(ctx.file);
 			::CloseHandle(ctx.file);
-			log(L"Info: sock=%llu handle=%p close file", _conn->sock, ctx.file);
+			LogPolicy::write(L"Info: sock=%llu handle=%p close file", _conn->sock, ctx.file);
 		}
 		ctx.file = INVALID_HANDLE_VALUE;
+		// 取り消した読込の完了はこの後に届く
+		ctx.generation++;
+	}
+
+	// 開いたまま取り込まれなかったハンドルを閉じる
+	template <typename LogPolicy>
+	void basic_http_server<LogPolicy>::release_opened(http_conn_t* _conn)
+	{
+		FILE_OPEN_CONTEXT& ctx = _conn->open_ctx;
+
+		if (ctx.file != INVALID_HANDLE_VALUE)
+		{
+			::CloseHandle(ctx.file);
+			ctx.file = INVALID_HANDLE_VALUE;
+		}
+		if (ctx.direct_file != INVALID_HANDLE_VALUE)
+		{
+			::CloseHandle(ctx.direct_file);
+			ctx.direct_file = INVALID_HANDLE_VALUE;
+		}
 	}
 
-	void http_server::connection_close(http_conn_t *_conn)
+	template <typename LogPolicy>
+	void basic_http_server<LogPolicy>::release_direct_buffers(http_conn_t* _conn)
 	{
+		FILE_IO_CONTEXT& ctx = _conn->fio_ctx;
+
+		for (auto& slot : ctx.slots)
+		{
+			direct_pool_.release(slot.direct_buf);
+			slot.direct_buf = nullptr;
+		}
+	}
+
+	template <typename LogPolicy>
+	void basic_http_server<LogPolicy>::connection_close(http_conn_t *_conn)
+	{
+		if (_conn == nullptr) return;
+
 		file_close(_conn);
 
+		// ブロッキングスレッドが開いている途中ならハンドルはまだ書き込まれていない。完了が届いたらfile_open_finish()で閉じる
+		_conn->open_ctx.generation++;
+		if (!_conn->open_ctx.pending)
+		{
+			release_opened(_conn);
+		}
+
+		// 読込中のバッファは次のfile_open()まで持ち越す
+		if (_conn->fio_ctx.reading == 0)
+		{
+			release_direct_buffers(_conn);
+		}
+
 		if (_conn->sock != INVALID_SOCKET)
 		{
-			log(L"Info: sock=%llu close socket", _conn->sock);
+			LogPolicy::write(L"Info: sock=%llu close socket", _conn->sock);
 			::closesocket(_conn->sock);
 			_conn->sock = INVALID_SOCKET;
+			admission_.active--;
 		}
 	}
+
+	template class basic_http_server<http_log_policy>;
 }
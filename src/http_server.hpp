@@ -2,7 +2,16 @@
 
 #include "common.hpp"
 
+#include "aligned_buffer_pool.hpp"
+#include "blocking_pool.hpp"
+#include "counting_resource.hpp"
+#include "http_config.hpp"
+#include "http_policy.hpp"
+#include "token_bucket.hpp"
+
 #include <array>
+#include <coroutine>
+#include <memory_resource>
 #include <vector>
 #include <string>
 #include <cstdint>
@@ -12,11 +21,18 @@ namespace app {
 	constexpr UINT HTTP_TCP_RECV = 1001;
 	constexpr UINT HTTP_TCP_SEND = 1002;
 	constexpr UINT HTTP_FILE_READ = 1003;
+	constexpr UINT HTTP_SCHED_YIELD = 1004; // I/Oではなく送信の順番待ち
+	constexpr UINT HTTP_SCHED_THROTTLE = 1005; // I/Oではなく帯域制限の補充待ち
+	constexpr UINT HTTP_FILE_OPEN = 1006; // ブロッキングスレッドでファイルを開く
+
+	// リクエスト処理中の一時データ用アリーナの大きさ
+	constexpr size_t HTTP_ARENA_SIZE = 32 * 1024;
 
 	struct HTTP_ACCEPT_CONTEXT {
 		WSAOVERLAPPED ov;
 		SOCKET sock;
-		char* data;
+		DWORD recv_len;
+		std::vector<char> buf;
 	};
 
 	struct http_conn_t;
@@ -29,75 +45,225 @@ namespace app {
 		http_conn_t* conn;
 	};
 
-	struct FILE_IO_CONTEXT {
+	struct FILE_READ_CONTEXT {
 		OVERLAPPED ov;
+		uint64_t offset;
+		DWORD length;
+		DWORD request;
+		DWORD transferred;
+		DWORD sent; // 送信済みのバイト数。1回で送り切らないときは残りを次の送信に回す
+		bool ready;
+		bool pending; // 読込を出して完了がまだ届いていない。閉じたファイルの分でも届くまでは次の読込に使わない
+		uint64_t issued; // 読込を出したときのFILE_IO_CONTEXT::generation
+		char* data;
+		std::vector<char> buf;
+		char* direct_buf;
+		http_conn_t* conn;
+	};
+
+	// ファイルを開く依頼と結果。jobは先頭に置き、完了通知のOVERLAPPEDから戻せるようにする
+	struct FILE_OPEN_CONTEXT {
+		BLOCKING_JOB job;
+		std::wstring path;
+		uint64_t direct_threshold;
+		bool missing; // 存在しないかフォルダ
+		uint64_t notfound_generation; // 依頼する前に404キャッシュを調べたときの世代。開き終わるまでに消していたらmissingでも入れない
+		HANDLE file;
+		HANDLE direct_file; // direct_threshold以上ならバッファリング無しでも開いておく
+		uint64_t size;
+		http_conn_t* conn;
+		bool pending; // ブロッキングスレッドに回して完了がまだ届いていない。その間はハンドルに触らず、接続枠も再利用しない
+		uint64_t generation; // 切断のたびに増やす
+		uint64_t issued; // 依頼したときのgeneration。違っていれば完了は切断済みの接続のもの
+	};
+
+	struct FILE_IO_CONTEXT {
 		HANDLE file;
 		uint64_t size;
 		uint64_t sent_count;
 		uint64_t read_count;
 		uint64_t total_read;
 		uint64_t total_sent;
+		uint64_t next_offset;
+		DWORD chunk;
+		DWORD reading;
+		uint64_t generation; // ファイルを閉じるたびに増やす。違っていれば読込の完了は閉じたファイルのもの
+		DWORD header_size;
+		DWORD send_limit; // 次の送信で送るボディの上限。0は制限無し
 		bool sending;
-		bool reading;
-		std::array<std::vector<char>, 2> buf;
-		std::array<DWORD, 2> transferred;
+		bool direct;
+		LARGE_INTEGER send_start;
+		std::vector<FILE_READ_CONTEXT> slots;
 		http_conn_t* conn;
 	};
 
+	// 次の送信で送るボディのバイト数。送信中か読込が終わっていなければ0
+	inline DWORD next_send_size(const FILE_IO_CONTEXT& _ctx) noexcept
+	{
+		if (_ctx.sending || _ctx.sent_count >= _ctx.read_count) return 0;
+		const FILE_READ_CONTEXT& slot = _ctx.slots.at(_ctx.sent_count % _ctx.slots.size());
+		if (!slot.ready) return 0;
+
+		DWORD length = slot.transferred - slot.sent;
+		if (_ctx.send_limit > 0) length = std::min(length, _ctx.send_limit);
+		return length;
+	}
+
 	std::wstring get_remote_ipport(LPVOID _buffer, DWORD _len);
+	ULONG get_remote_address(LPVOID _buffer, DWORD _len);
+
+	struct arena_stats_t {
+		uint64_t overflows;
+		uint64_t bytes;
+	};
+
+	struct admission_stats_t {
+		uint64_t accepted;
+		uint64_t reserved_accepted;
+		uint64_t shed;
+		size_t active;
+		size_t peak;
+		size_t queued; // 取り出した完了のうち、まだ受付の判定をしていない接続
+		size_t queue_peak;
+		size_t lingering; // 503/429を返して相手の切断を待っている接続
+		uint64_t accept_reaped; // 最初のデータを送らずに打ち切った接続
+	};
 
 	struct http_conn_t {
 		SOCKET sock;
+		ULONG address; // 接続元IP。0はレート制限の対象外(ヘルスチェック)
+		bool trusted; // ループバックかHEALTHCHECK_IPからの接続。統計などのパスに応答する
 		HTTP_IO_CONTEXT ior_ctx;
 		HTTP_IO_CONTEXT iow_ctx;
+		FILE_OPEN_CONTEXT open_ctx;
 		FILE_IO_CONTEXT fio_ctx;
 		std::string path;
-		bool headersent;
+		std::string header;
 		bool keepalive;
 
-		http_conn_t() : sock(INVALID_SOCKET), ior_ctx(), iow_ctx(), fio_ctx(), path(), headersent(false), keepalive(false)
+		// 完了を待っているコルーチンと待っているI/Oの種類
+		std::coroutine_handle<> waiter;
+		UINT waiting;
+		DWORD io_transferred;
+
+		// 区間計測の起点。accepted_atは最初のリクエストを受信するまで
+		int64_t accepted_at;
+		int64_t received_at;
+
+		// このターンで送信できる残りのバイト数(deficit round robin)
+		int64_t deficit;
+
+		// 応答ごとの帯域制限
+		token_bucket bucket;
+
+		// リクエストごとに巻き戻すアリーナ。溢れた分はarena_upstreamで数える
+		counting_resource arena_upstream;
+		std::vector<char> arena_buf;
+		std::pmr::monotonic_buffer_resource arena;
+
+		http_conn_t() : sock(INVALID_SOCKET), address(0), trusted(false), ior_ctx(), iow_ctx(), open_ctx(), fio_ctx(), path(), header(), keepalive(false), waiter(), waiting(0), io_transferred(0), accepted_at(0), received_at(0), deficit(0), bucket()
+			, arena_upstream(), arena_buf(HTTP_ARENA_SIZE), arena(arena_buf.data(), arena_buf.size(), &arena_upstream)
 		{
 			ior_ctx.conn = this;
 			iow_ctx.conn = this;
+			open_ctx.conn = this;
+			open_ctx.file = INVALID_HANDLE_VALUE;
+			open_ctx.direct_file = INVALID_HANDLE_VALUE;
+			open_ctx.pending = false;
+			open_ctx.generation = 0;
+			open_ctx.issued = 0;
+			open_ctx.notfound_generation = 0;
 			fio_ctx.conn = this;
 			fio_ctx.file = INVALID_HANDLE_VALUE;
 		}
 	};
 
-	class http_server {
+	template <typename LogPolicy>
+	class basic_http_server {
 	private:
 		std::string listen_address_;
 		uint16_t listen_port_;
-		std::array<char, 1024> addr_buffer_;
-		HTTP_ACCEPT_CONTEXT accept_ctx_;
+		int backlog_;
+		bool nodelay_;
+		int send_buffer_; // 0はOS任せ
+		int recv_buffer_; // 0はOS任せ
+		bool fastopen_;
+		std::vector<HTTP_ACCEPT_CONTEXT> accept_ctxs_;
+		DWORD accept_timeout_; // 秒
 		std::vector<http_conn_t> conns_;
-
+		DWORD chunk_max_;
+		LARGE_INTEGER qpc_freq_;
+		uint64_t direct_threshold_;
+		aligned_buffer_pool direct_pool_;
+		size_t reserved_;
+		ULONG healthcheck_address_;
+		std::string response_unavailable_;
+		std::string response_too_many_;
+		std::vector<std::pair<SOCKET, ULONGLONG>> lingering_;
+		admission_stats_t admission_;
+		HANDLE compport_;
+		ULONG_PTR file_compkey_;
+		blocking_pool* pool_;
 
 		bool tcp_socket();
 		bool tcp_bind();
 		bool tcp_listen();
 
+		void release_direct_buffers(http_conn_t* _conn);
+		void close_with(SOCKET _sock, const std::string& _response);
+		void set_buffer_sizes(SOCKET _sock);
+		void release_opened(http_conn_t* _conn);
+
 	public:
 		SOCKET sock_;
 
-		http_server(const std::string _address, uint16_t _port, uint16_t _maxconn);
-		~http_server();
+		basic_http_server(const http_config_t& _config);
+		~basic_http_server();
 
+		void set_completion_port(HANDLE _compport, ULONG_PTR _file_compkey);
+		// ファイルを開く処理を回す先。nullptrならイベントループで開く
+		void set_blocking_pool(blocking_pool* _pool);
 		bool prepare();
 
 		size_t count() const noexcept;
+		admission_stats_t admission_stats() const noexcept;
+		arena_stats_t arena_stats() const noexcept;
+		size_t inflight_reads() const noexcept;
+		bool is_healthcheck(ULONG _address) const noexcept;
+		bool is_trusted(ULONG _address) const noexcept;
+		// 1回の取り出しに含まれる接続完了を受付待ちとして数える
+		void queue_accepts(size_t _count) noexcept;
+		void dequeue_accept() noexcept;
+		// reap_accepts()で打ち切ったAcceptExの完了が届いたときに数える
+		void count_reaped_accept() noexcept;
+		// 503/429を返した接続のうち、待ち時間を過ぎたものを閉じる。_allなら全て
+		void close_lingering(bool _all);
 
 		bool tcp_acceptex();
+		bool tcp_acceptex(HTTP_ACCEPT_CONTEXT* _ctx);
+		// 接続済みのまま最初のデータを待ち続けているAcceptExを打ち切る。完了はソケットがINVALID_SOCKETのまま届く
+		void reap_accepts();
 		bool tcp_read(http_conn_t* _conn);
 		bool tcp_send_file(http_conn_t* _conn);
-		bool tcp_send(http_conn_t* _conn, const std::vector<char *>& _data);
+		void tcp_send_file_complete(http_conn_t* _conn, DWORD _transferred);
+		bool tcp_send(http_conn_t* _conn, const WSABUF* _bufs, DWORD _count);
 		bool tcp_send(http_conn_t* _conn, const std::string& _data);
 
-		bool file_open(http_conn_t* _conn, const std::wstring &_path);
+		// _pathを開く。ブロッキングスレッドに回したらtrueを返し、HTTP_FILE_OPENの完了を待ってからfile_open_complete()を呼ぶ
+		// falseならその場で開き終えているので、すぐにfile_open_complete()を呼ぶ
+		bool file_open_start(http_conn_t* _conn, const wchar_t* _path);
+		// 開いた結果を送信用に取り込む。開けなかったらfalse
+		bool file_open_complete(http_conn_t* _conn);
+		// HTTP_FILE_OPENの完了が届いたら最初に呼ぶ。依頼の後で切断されていたら開いたハンドルを閉じてfalseを返す
+		bool file_open_finish(FILE_OPEN_CONTEXT* _ctx);
 		bool file_read(http_conn_t* _conn);
 
-		http_conn_t *insert(SOCKET _sock);
+		http_conn_t *insert(SOCKET _sock, bool _healthcheck);
+		void reject(SOCKET _sock);
+		void reject_too_many(SOCKET _sock);
 		void file_close(http_conn_t* _conn);
 		void connection_close(http_conn_t* _conn);
 	};
+
+	using http_server = basic_http_server<http_log_policy>;
 }
@@ -2,347 +2,57 @@
 
 #include "log.hpp"
 
+#include "blocking_pool.hpp"
+#include "early_hints.hpp"
+#include "frame_pool.hpp"
+#include "http_handler.hpp"
 #include "http_server.hpp"
+#include "metrics.hpp"
+#include "not_found_cache.hpp"
+#include "rate_limiter.hpp"
+#include "request_capture.hpp"
+#include "stall_watchdog.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
 
-#include <tuple>
-#include <unordered_map>
+#include <algorithm>
+#include <vector>
 
-namespace {
+#include <winternl.h>
 
-	const std::array<bool, 0x80> http_available_ascii_codes =
-	{
-		0, 0, 0, 0, 0, 0, 0, 0,
-		0, 1, 1, 0, 0, 1, 0, 0, // \t, \n, \r
-		0, 0, 0, 0, 0, 0, 0, 0,
-		0, 0, 0, 0, 0, 0, 0, 0,
-		1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 0
-	};
+#pragma comment(lib, "ntdll.lib")
 
-	const std::array<bool, 0x80> absolute_path_codes =
-	{
-		0, 0, 0, 0, 0, 0, 0, 0,
-		0, 0, 0, 0, 0, 0, 0, 0,
-		0, 0, 0, 0, 0, 0, 0, 0,
-		0, 0, 0, 0, 0, 0, 0, 0,
-		0, 0, 0, 0, 0, 0, 0, 0,
-		0, 0, 0, 0, 0, 1, 1, 1, // 0x2D(-) 0x2E(.) 0x2F(/)
-		1, 1, 1, 1, 1, 1, 1, 1, // 0x30-
-		1, 1, 0, 0, 0, 0, 0, 0, // -0x39 数字
-		1, 1, 1, 1, 1, 1, 1, 1, // 0x40(@) 0x41-
-		1, 1, 1, 1, 1, 1, 1, 1, // -
-		1, 1, 1, 1, 1, 1, 1, 1, // -
-		1, 1, 1, 0, 0, 0, 0, 1, // -0x5A ALPHA 0x5F(_)
-		0, 1, 1, 1, 1, 1, 1, 1, // 0x61-
-		1, 1, 1, 1, 1, 1, 1, 1, // -
-		1, 1, 1, 1, 1, 1, 1, 1, // -
-		1, 1, 1, 0, 0, 0, 1, 0  // -0x7A alpha 0x7E(~)
-	};
+namespace {
 
-	std::unordered_map<std::string, std::string> ext_map = {
-		{"css", "text/css"},
-		{"csv", "text/csv"},
-		{"txt", "text/plain"},
-		{"vtt", "text/vtt"},
-		{"html", "text/html"},
-		{"htm", "text/html"},
-		{"wgsl", "text/wgsl"},
-		{"apng", "image/apng"},
-		{"avif", "image/avif"},
-		{"bmp", "image/bmp"},
-		{"gif", "image/gif"},
-		{"png", "image/png"},
-		{"svg", "image/svg+xml"},
-		{"webp", "image/webp"},
-		{"ico", "image/x-icon"},
-		{"tif", "image/tiff"},
-		{"tiff", "image/tiff"},
-		{"jpeg", "image/jpeg"},
-		{"jpg", "image/jpeg"},
-		{"mp4", "video/mp4"},
-		{"mpeg", "video/mpeg"},
-		{"webm", "video/webm"},
-		{"mp3", "audio/mp3"},
-		{"mpga", "audio/mpeg"},
-		{"weba", "audio/webm"},
-		{"wav", "audio/wave"},
-		{"otf", "font/otf"},
-		{"ttf", "font/ttf"},
-		{"woff", "font/woff"},
-		{"woff2", "font/woff2"},
-		{"7z", "application/x-7z-compressed"},
-		{"atom", "application/atom+xml"},
-		{"pdf", "application/pdf"},
-		{"mjs", "application/javascript"},
-		{"js", "application/javascript"},
-		{"json", "application/json"},
-		{"rss", "application/rss+xml"},
-		{"tar", "application/x-tar"},
-		{"xhtml", "application/xhtml+xml"},
-		{"xht", "application/xhtml+xml"},
-		{"xslt", "application/xslt+xml"},
-		{"xml", "application/xml"},
-		{"gz", "application/gzip"},
-		{"zip", "application/zip"},
-		{"wasm", "application/wasm"}
+	struct completion_stats_t {
+		uint64_t wakeups;
+		uint64_t completions;
+		uint64_t full_batches;
+		ULONG max_batch;
 	};
 
-	inline std::string trim(const std::string& s)
-	{
-		auto a = s.find_first_not_of(" \t\r\n");
-		if (a == std::string::npos) return "";
-		auto b = s.find_last_not_of(" \t\r\n");
-		return s.substr(a, b - a + 1);
-	}
-
-	bool check_ascii(const std::vector<char>& _s, size_t _size)
+	// GetQueuedCompletionStatusEx()は個々の結果をOVERLAPPEDにNTSTATUSで残す
+	DWORD get_completion_error(const OVERLAPPED_ENTRY& _entry)
 	{
-		for (size_t i = 0; i < _size; ++i)
-		{
-			auto c = _s.at(i);
-			if (c > 0x7f || !http_available_ascii_codes.at(c))
-			{
-				app::log(L"Error: Invalid char is %d.", (DWORD)c);
-				return false;
-			}
-		}
-		return true;
-	}
-
-	std::tuple<int, std::string, std::string, std::string, std::unordered_map<std::string, std::string>>
-		parse_http_header(const std::vector<char>& _header, size_t _size)
-	{
-		enum : int {
-			SEC_METHOD,
-			SEC_REQUEST,
-			SEC_VERSION,
-			SEC_KEY,
-			SEC_VALUE
-		};
-
-		int sec = SEC_METHOD;
-		int rc = -1;
-		char prev_c = 0;
-
-		bool invalid_char = false;
-		std::string method = "";
-		bool method_oversize = false;
-		std::string request = "";
-		bool request_oversize = false;
-		std::string version = "";
-		bool version_oversize = false;
-		std::string key = "";
-		std::string value = "";
-		bool header_end = false;
-		bool invalid_keyvalue = false;
-		std::unordered_map<std::string, std::string> key_values;
-
-		// サイズ予約
-		request.reserve(_size);
-		key.reserve(_size);
-		value.reserve(_size);
-
-		for (size_t i = 0; i < _header.size() && i < _size; ++i)
-		{
-			char c = _header.at(i);
-
-			// check valid char
-			if (c > 0x7f || !http_available_ascii_codes.at(c))
-			{
-				invalid_char = true;
-			}
-			else
-			{
-
-				switch (sec)
-				{
-				case SEC_METHOD:
-					if (c == ' ')
-					{
-						sec = SEC_REQUEST;
-					}
-					else
-					{
-						if (method.size() > 7)
-						{
-							// CONNECT/OPTIONS = 7chars
-							method_oversize = true;
-						}
-						else
-						{
-							method += c;
-						}
-					}
-					break;
-				case SEC_REQUEST:
-					if (c == ' ')
-					{
-						sec = SEC_VERSION;
-					}
-					else
-					{
-						if (request.size() > 4096)
-						{
-							request_oversize = true;
-						}
-						else
-						{
-							request += c;
-						}
-					}
-					break;
-				case SEC_VERSION:
-					if (c == '\n' && prev_c == '\r')
-					{
-						sec = SEC_KEY;
-						version.pop_back(); // 末尾の\rを削除
-					}
-					else
-					{
-						if (version.size() > 8)
-						{
-							// HTTP/1.1 = 8chars
-							version_oversize = true;
-						}
-						else
-						{
-							version += c;
-						}
-					}
-					break;
-				case SEC_KEY:
-					if (c == '\n' && prev_c == '\r')
-					{
-						key.pop_back(); // 末尾の\rを削除
-
-						if (key == "")
-						{
-							header_end = true;
-						}
-						else
-						{
-							invalid_keyvalue = true;
-						}
-					}
-					else if (c == ':')
-					{
-						sec = SEC_VALUE;
-					}
-					else
-					{
-						key += c;
-					}
-					break;
-				case SEC_VALUE:
-					if (c == '\n' && prev_c == '\r')
-					{
-						sec = SEC_KEY;
-						value.pop_back(); // 末尾の\rを削除
-
-						// key valueの格納
-						const auto trimed_key = trim(key);
-						const auto trimed_value = trim(value);
-						if (trimed_key == "" || trimed_value == "")
-						{
-							invalid_keyvalue = true;
-						}
-						else
-						{
-							if (key_values.contains(trimed_key))
-							{
-								key_values.at(trimed_key) += (", " + trimed_value);
-							}
-							else
-							{
-								key_values.insert({ trimed_key, trimed_value });
-							}
-							key = "";
-							value = "";
-						}
-					}
-					else
-					{
-						value = value += c;
-					}
-					break;
-				}
-			}
-
-			prev_c = c;
-
-			if (invalid_char) break;
-			if (method_oversize) break;
-			if (request_oversize) break;
-			if (version_oversize) break;
-			if (invalid_keyvalue) break;
-			if (header_end) break;
-		}
-
-		// 解析終了後のチェック
-		if (invalid_char) rc = -1;
-		else if (method_oversize) rc = -2;
-		else if (request_oversize) rc = -3;
-		else if (version_oversize) rc = -4;
-		else if (invalid_keyvalue) rc = -5;
-		else if (!header_end) rc = -6;
-		else rc = 0;
-
-		return {
-			rc,
-			method,
-			request,
-			version,
-			key_values
-		};
+		if (_entry.lpOverlapped == NULL) return ERROR_SUCCESS;
+		auto status = static_cast<NTSTATUS>(_entry.lpOverlapped->Internal);
+		if (NT_SUCCESS(status)) return ERROR_SUCCESS;
+		return ::RtlNtStatusToDosError(status);
 	}
 
-	std::string get_absolute_path(const std::string& _request)
+	// 区間ごとのパーセンタイルをログに出す
+	void log_latency()
 	{
-		std::string r = "";
-		r.reserve(_request.size());
-		char prev_c = 0;
-
-		for (size_t i = 0; i < _request.size(); ++i)
+		app::latency_values values;
+		app::metrics_registry::instance().latency(values);
+		for (size_t i = 0; i < values.size(); ++i)
 		{
-			char c = _request.at(i);
-			if (r == "" && c != '/') // スラッシュで始まらないURL禁止
-				return "";
-
-			if (c == '/' && prev_c == '/') // 連続スラッシュ禁止
-				return "";
-			if (c == '/' && prev_c == '.') // .で終わるフォルダ禁止
-				return "";
-			if (c == '.' && prev_c == '/') // .で始まるファイル/フォルダは禁止
-				return "";
-			if (c == '.' && prev_c == '.') // 連続ドット禁止
-				return "";
-
-			if (c == '?') // クエリ以降は無視
-				break;
-
-			if (absolute_path_codes[c] == 0) // 許可されていない文字が含まれていた
-				return "";
-
-			r += c;
-
-			prev_c = c;
+			const auto& h = values.at(i);
+			if (h.count == 0) continue;
+			app::log(L"Info: latency %s count=%llu p50=%lluus p90=%lluus p99=%lluus p999=%lluus max=%lluus",
+				app::s_to_ws(app::latency_phase_name(static_cast<app::latency_phase>(i))).c_str(),
+				h.count, h.percentile(0.5), h.percentile(0.9), h.percentile(0.99), h.percentile(0.999), h.max);
 		}
-
-		if (r.back() == '.') // .で終わるファイルは禁止
-			return "";
-
-		return r;
 	}
 
 	std::wstring get_htdocs()
@@ -382,59 +92,12 @@ namespace {
 		return r;
 	}
 
-	std::wstring absolute_path_to_winpath(const std::string& _path)
-	{
-		std::wstring r = app::s_to_ws(_path);
-		for (auto& c : r)
-		{
-			if (c == L'/') c = L'\\';
-		}
-		return r;
-	}
-
-	bool is_file(const std::wstring& _path)
-	{
-		auto attr = ::GetFileAttributesW(_path.c_str());
-		return ((attr != INVALID_FILE_ATTRIBUTES) && !(attr & FILE_ATTRIBUTE_DIRECTORY));
-	}
-
-	std::string get_content_type(const std::wstring& _path)
-	{
-		bool has_ext = false;
-		std::string ext = "";
-		ext.reserve(255);
-		for (size_t i = _path.size() - 1; i != 0; --i)
-		{
-			char c = (_path.at(i) & 0xff);
-			if (c == '\\')
-			{
-				has_ext = false;
-				break;
-			}
-			else if (c == '.')
-			{
-				has_ext = true;
-				break;
-			}
-			ext = c + ext;
-		}
-
-		if (!has_ext || ext == "")
-			return "application/octet-stream";
-		
-		if (ext_map.contains(ext))
-			return ext_map.at(ext);
-
-		return "application/octet-stream";
-	}
 }
 
 
 namespace app {
 	http_thread::http_thread()
-		: ip_("127.0.0.1")
-		, port_(20082)
-		, maxconn_(16)
+		: config_()
 		, window_(NULL)
 		, thread_(NULL)
 		, compport_(NULL)
@@ -462,13 +125,126 @@ namespace app {
 			app::log(L"Info: htdocs directory created.");
 		}
 
-		http_server server(ip_.c_str(), port_, maxconn_);
+		http_cache_policy notfound(config_.notfound_cache);
+		early_hints earlyhints(config_.early_hints, htdocs_path, config_.early_hints_prefetch);
+		earlyhints.set_completion_port(compport_, COMPKEY_PREFETCH);
+
+		http_server server(config_);
+		server.set_completion_port(compport_, COMPKEY_FILE_READ);
+		request_capture capture;
+		capture.set_completion_port(compport_, COMPKEY_CAPTURE);
+		rate_limiter limiter(config_.rate_table, config_.rate_limit, config_.rate_burst, config_.connections_per_ip);
+		http_handler handler(server, notfound, earlyhints, htdocs_path);
+		stall_watchdog watchdog(config_.stall_threshold);
+
+		// ファイルを開く処理はブロッキングスレッドに回す。接続より先に止めるのでserverとhandlerより後に置く
+		blocking_pool pool;
+		if (pool.start(config_.blocking_threads, compport_, COMPKEY_FILE_OPEN))
+		{
+			server.set_blocking_pool(&pool);
+			earlyhints.set_blocking_pool(&pool);
+		}
+		handler.set_send_quantum(static_cast<size_t>(config_.send_quantum) * 1024);
+		handler.set_bandwidth(config_.bandwidth_total, config_.bandwidth);
+		if (limiter.enabled())
+		{
+			handler.set_rate_limiter(&limiter);
+		}
+
+		// 受信したリクエストの記録
+		if (config_.capture_file != "" && capture.open(s_to_ws(config_.capture_file), config_.capture_limit))
+		{
+			log(L"Info: capture requests to %s", s_to_ws(config_.capture_file).c_str());
+			handler.set_capture(&capture);
+		}
+
+		// 1回の待機で取り出した完了通知の数。イベントループで数え、統計とスレッド終了時のログに出す
+		completion_stats_t completion = {};
+
+		// 統計の取得。カウンタは取得時に合算し、ゲージはその時点の値を読む
+		if (config_.metrics_path.starts_with('/'))
+		{
+			handler.add_endpoint(config_.metrics_path, "text/plain; version=0.0.4; charset=utf-8", [&server, &notfound, &watchdog, &limiter, &pool, &completion](std::string& _out) {
+				auto admission = server.admission_stats();
+				write_metric(_out, "httpserver_connections_active", "gauge", "Connections currently open.", static_cast<uint64_t>(server.count()));
+				write_metric(_out, "httpserver_connections_accepted_total", "counter", "Connections accepted.", admission.accepted);
+				write_metric(_out, "httpserver_connections_shed_total", "counter", "Connections refused with 503.", admission.shed);
+				write_metric(_out, "httpserver_accept_queue", "gauge", "Accepted connections dequeued and not yet admitted or refused.", static_cast<uint64_t>(admission.queued));
+				write_metric(_out, "httpserver_accept_queue_peak", "gauge", "Most accepted connections waiting for admission at once.", static_cast<uint64_t>(admission.queue_peak));
+				write_metric(_out, "httpserver_accept_reaped_total", "counter", "Connections closed for sending nothing within ACCEPT_DATA_TIMEOUT.", admission.accept_reaped);
+				write_metric(_out, "httpserver_connections_lingering", "gauge", "Refused connections waiting for the client to close.", static_cast<uint64_t>(admission.lingering));
+				write_metric(_out, "httpserver_file_reads_inflight", "gauge", "File reads issued and not yet completed.", static_cast<uint64_t>(server.inflight_reads()));
+				write_metric(_out, "httpserver_notfound_cache_inserts_total", "counter", "Paths added to the not-found cache.", notfound.stats().inserts);
+
+				auto blocking = pool.stats();
+				write_metric(_out, "httpserver_blocking_jobs_total", "counter", "File opens handed to the blocking thread pool.", blocking.submitted);
+				write_metric(_out, "httpserver_blocking_jobs_inflight", "gauge", "File opens queued or running on the blocking thread pool.", blocking.inflight);
+
+				auto limited = limiter.stats();
+				write_metric(_out, "httpserver_rate_limited_connections_total", "counter", "Connections refused with 429 by CONNECTIONS_PER_IP or RATE_LIMIT.", limited.limited_connections);
+				write_metric(_out, "httpserver_rate_limited_requests_total", "counter", "Requests answered with 429 by RATE_LIMIT.", limited.limited_requests);
+				write_metric(_out, "httpserver_rate_table_full_total", "counter", "Clients let through without rate limiting because the rate table had no free slot (fail open).", limited.table_full);
+
+				auto stall = watchdog.stats();
+				write_metric(_out, "httpserver_loop_iterations_total", "counter", "Completions handled by the event loop.", stall.iterations);
+				write_metric(_out, "httpserver_loop_iteration_max_microseconds", "gauge", "Longest time spent handling one completion.", stall.max_usec);
+
+				// 1回の待機あたりの完了通知の数は _sum / _count で求める
+				write_metric_header(_out, "httpserver_completion_batch", "summary", "Completions dequeued per wakeup of GetQueuedCompletionStatusEx.");
+				write_metric_value(_out, "httpserver_completion_batch_sum", nullptr, completion.completions);
+				write_metric_value(_out, "httpserver_completion_batch_count", nullptr, completion.wakeups);
+				write_metric(_out, "httpserver_completion_batch_max", "gauge", "Most completions dequeued in one wakeup.", completion.max_batch);
+				write_metric(_out, "httpserver_completion_batch_full_total", "counter", "Wakeups that filled all COMPLETION_BATCH entries.", completion.full_batches);
+				write_metric_header(_out, "httpserver_loop_stalls_total", "counter", "Completions that took longer than STALL_THRESHOLD, by handler.");
+				for (size_t i = 0; i < stall.by_handler.size(); ++i)
+				{
+					std::string labels = std::string("handler=\"") + stall_handler_name(i) + "\"";
+					write_metric_value(_out, "httpserver_loop_stalls_total", labels.c_str(), stall.by_handler.at(i));
+				}
+				write_metric_header(_out, "httpserver_loop_stall_calls_total", "counter", "Stalls by the longest synchronous call made while handling.");
+				for (size_t i = 0; i < stall.by_call.size(); ++i)
+				{
+					std::string labels = std::string("call=\"") + stall_call_name(static_cast<stall_call>(i)) + "\"";
+					write_metric_value(_out, "httpserver_loop_stall_calls_total", labels.c_str(), stall.by_call.at(i));
+				}
+
+				write_process_metrics(_out);
+				if constexpr (http_metrics_policy::enabled)
+				{
+					write_metrics(_out, metrics_registry::instance().snapshot());
+
+					latency_values latency;
+					metrics_registry::instance().latency(latency);
+					write_latency(_out, latency);
+				}
+			});
+		}
+
+		// イベントのトレース
+		if constexpr (http_trace_policy::enabled)
+		{
+			if (config_.trace_events > 0 && config_.trace_path.starts_with('/'))
+			{
+				trace_ring::attach(config_.trace_events);
+				handler.add_endpoint(config_.trace_path, "application/json", [](std::string& _out) {
+					write_trace(_out);
+				});
+			}
+		}
 		if (server.prepare())
 		{
 			log(L"Info: http_server::prepare() success.");
 
 			auto port = ::CreateIoCompletionPort((HANDLE)server.sock_, compport_, COMPKEY_TCP_ACCEPTEX, 0);
 
+			// htdocsの変更監視
+			// 監視できない(SMB共有で拒否されたなど)ときは404キャッシュ無しで続ける
+			if (!notfound.watch(htdocs_path, compport_, COMPKEY_DIR_CHANGE))
+			{
+				log(L"Error: not_found_cache::watch() failed. notfound cache disabled.");
+				notfound.disable();
+			}
+
 			// 接続待ち
 			if (!server.tcp_acceptex())
 			{
@@ -476,19 +252,61 @@ namespace app {
 				return 0;
 			}
 
+			// 完了通知はまとめて取り出し、1件ずつ処理する
+			std::vector<OVERLAPPED_ENTRY> entries(std::clamp<uint32_t>(config_.completion_batch, 1, 1024));
+			ULONG removed = 0;
+			ULONG next = 0;
+			uint32_t ticks = 0;
+			uint64_t table_full = 0;
+
 			while (true)
 			{
-				DWORD transferred = 0;
-				ULONG_PTR compkey = 0;
-				LPOVERLAPPED ov = NULL;
-				auto rc = ::GetQueuedCompletionStatus(compport_, &transferred, &compkey, &ov, INFINITE);
-				auto gqcs_error = rc == FALSE ? ::GetLastError() : ERROR_SUCCESS;
-				if (rc == FALSE && ov == NULL)
+				// 前の完了の処理時間を確定する
+				watchdog.end();
+
+				if (next == removed)
 				{
-					log(L"Error: GetQueuedCompletionStatus() failed. ErrorCode=%lu", gqcs_error);
-					continue;
+					next = 0;
+					removed = 0;
+
+					// 送信を譲った接続があれば再開し、まだ残っていれば完了を待たずに次のターンへ
+					// 帯域制限の補充待ちは、次に送れるようになる時刻まで待つ
+					handler.run_deferred();
+					handler.run_throttled();
+					DWORD timeout = handler.has_deferred() ? 0 : handler.throttle_timeout();
+					if (!::GetQueuedCompletionStatusEx(compport_, entries.data(), static_cast<ULONG>(entries.size()), &removed, timeout, FALSE))
+					{
+						auto error = ::GetLastError();
+						if (error != WAIT_TIMEOUT)
+						{
+							log(L"Error: GetQueuedCompletionStatusEx() failed. ErrorCode=%lu", error);
+						}
+						continue;
+					}
+					http_trace_policy::instant("dequeue", 0, removed);
+					completion.wakeups++;
+					completion.completions += removed;
+					completion.max_batch = std::max(completion.max_batch, removed);
+					if (removed == entries.size()) completion.full_batches++;
+
+					// 受付を待っている接続
+					size_t accepts = 0;
+					for (ULONG i = 0; i < removed; ++i)
+					{
+						if (entries[i].lpCompletionKey == COMPKEY_TCP_ACCEPTEX) accepts++;
+					}
+					server.queue_accepts(accepts);
 				}
 
+				const auto& entry = entries[next++];
+				DWORD transferred = entry.dwNumberOfBytesTransferred;
+				ULONG_PTR compkey = entry.lpCompletionKey;
+				LPOVERLAPPED ov = entry.lpOverlapped;
+				auto gqcs_error = get_completion_error(entry);
+				auto rc = gqcs_error == ERROR_SUCCESS ? TRUE : FALSE;
+				auto trace_start = http_trace_policy::now();
+				watchdog.begin(compkey);
+
 				if (compkey == COMPKEY_OPERATION && ov == NULL)
 				{
 					if (transferred == OPERATION_STOP)
@@ -500,6 +318,31 @@ namespace app {
 					{
 						// KEEPALIVE切断処理
 					}
+					else if (transferred == OPERATION_TICK)
+					{
+						watchdog.report();
+						capture.flush();
+						server.close_lingering(false);
+						server.reap_accepts();
+
+						// 接続元IPの表が一杯で制限せずに通した分
+						auto limited = limiter.stats();
+						if (limited.table_full != table_full)
+						{
+							log(L"Error: rate table full, %llu clients passed without rate limit. Increase RATE_TABLE.", limited.table_full - table_full);
+							table_full = limited.table_full;
+						}
+
+						// 一定間隔で区間ごとの応答時間を出す
+						if constexpr (http_metrics_policy::enabled)
+						{
+							if (config_.latency_dump > 0 && ++ticks >= config_.latency_dump)
+							{
+								ticks = 0;
+								log_latency();
+							}
+						}
+					}
 				}
 
 				if (compkey == COMPKEY_TCP_ACCEPTEX && ov != NULL)
@@ -507,15 +350,14 @@ namespace app {
 					// ACCEPT
 					HTTP_ACCEPT_CONTEXT *ctx = (HTTP_ACCEPT_CONTEXT*)ov;
 					SOCKET sock = ctx->sock;
+					server.dequeue_accept();
 
-					if (rc == FALSE)
+					if (sock == INVALID_SOCKET)
 					{
-						log(L"Error: ACCEPT completion failed. ErrorCode=%lu", gqcs_error);
-						if (sock != INVALID_SOCKET)
-						{
-							::closesocket(sock);
-						}
-						if (!server.tcp_acceptex())
+						// データを送らない接続をreap_accepts()で打ち切ったもの
+						// 閉じる直前に最初のデータが届いて成功で完了していても、ソケットはもう無いので出し直す
+						server.count_reaped_accept();
+						if (!server.tcp_acceptex(ctx))
 						{
 							log(L"Error: websocket_server::acceptex() failed.");
 							break;
@@ -523,327 +365,162 @@ namespace app {
 						continue;
 					}
 
-					auto ipport = get_remote_ipport(ctx->data, transferred);
-					log(L"Info: sock=%llu connected from %s", sock, ipport.c_str());
-
-					if (!server.tcp_acceptex())
-					{
-						log(L"Error: sock=%llu http_server::tcp_acceptex() failed.", sock);
-						break;
-					}
-
-					auto conn = server.insert(sock);
-					if (conn == nullptr)
+					if (rc == FALSE || (ctx->recv_len > 0 && transferred == 0))
 					{
-						log(L"Error: sock=%llu reached max connection.", sock);
-						server.connection_close(conn);
+						// 最初のデータを待つ場合、0バイト完了はデータ無しで切断された
+						if (rc == FALSE) log(L"Error: ACCEPT completion failed. ErrorCode=%lu", gqcs_error);
+						::closesocket(sock);
+						if (!server.tcp_acceptex(ctx))
+						{
+							log(L"Error: websocket_server::acceptex() failed.");
+							break;
+						}
 						continue;
 					}
 
-					// 接続元の表示
-					log(L"Info: sock=%llu ACCEPT called", conn->sock);
+					auto ipport = get_remote_ipport(ctx->buf.data(), ctx->recv_len);
+					auto address = get_remote_address(ctx->buf.data(), ctx->recv_len);
+					auto healthcheck = server.is_healthcheck(address);
+					auto trusted = server.is_trusted(address);
+					log(L"Info: sock=%llu connected from %s", sock, ipport.c_str());
 
-					::CreateIoCompletionPort((HANDLE)conn->sock, compport_, COMPKEY_TCP_READWRITE, 0);
+					// ヘルスチェックは接続元IPごとの制限を受けない
+					if (healthcheck) address = 0;
 
-					// 読込待ち
-					if (!server.tcp_read(conn))
+					http_conn_t* conn = nullptr;
+					if (address != 0 && !limiter.connect(address, latency_now()))
 					{
-						log(L"Error: sock=%llu websocket_server::read() failed", conn->sock);
+						// 同じIPからの接続が多すぎるものは429を返して切る
+						server.reject_too_many(sock);
+						log(L"Info: sock=%llu >> HTTP/1.1 429 Too Many Requests (%s)", sock, ipport.c_str());
 					}
-				}
-				if (compkey == COMPKEY_TCP_READWRITE && ov != NULL)
-				{
-					HTTP_IO_CONTEXT* ctx = (HTTP_IO_CONTEXT*)ov;
-					http_conn_t* conn = ctx->conn;
-
-					if (rc == FALSE)
-					{
-						log(L"Error: socket I/O completion failed. sock=%llu,type=%u,ErrorCode=%lu", conn->sock, ctx->type, gqcs_error);
-						server.file_close(conn);
-						server.connection_close(conn);
-						continue;
-					}
-
-					if (transferred == 0 && (ctx->type == HTTP_TCP_RECV || ctx->type == HTTP_TCP_SEND))
+					else if ((conn = server.insert(sock, healthcheck)) == nullptr)
 					{
-						// IO完了かつ転送バイト0は終了
-						server.connection_close(conn);
+						// 接続数超過は503を返して切る
+						if (address != 0) limiter.disconnect(address);
+						server.reject(sock);
+						log(L"Info: sock=%llu >> HTTP/1.1 503 Service Unavailable (active=%llu shed=%llu)", sock, static_cast<uint64_t>(server.count()), server.admission_stats().shed);
 					}
-					else if (ctx->type == HTTP_TCP_RECV)
-					{
-						// データ受信完了
-						const auto &[rc, method, request, version, kvs] = parse_http_header(ctx->buf, transferred);
-						
-						if (rc < 0)
-						{
-							// HTTPプロトコルを話していない
-							server.connection_close(conn);
-						}
-						else
-						{
-							// ログに表示
-							log(L"Info: sock=%llu << %s %s %s", conn->sock, s_to_ws(method).c_str(), s_to_ws(request).c_str(), s_to_ws(version).c_str());
-
-							// ヘッダ未返送
-							conn->headersent = false;
-
-							// keep-aliveチェック
-							if (kvs.contains("Connection") && kvs.at("Connection") == "close")
-							{
-								conn->keepalive = false;
-							}
-							else
-							{
-								conn->keepalive = true;
-							}
-
-							if (version != "HTTP/1.1")
-							{
-								log(L"Info: sock=%llu >> HTTP/1.1 505 HTTP Version Not Supported", conn->sock);
-								const std::string res = 
-									version + " 505 HTTP Version Not Supported\r\n"
-									"X-Server-Message: Only support HTTP/1.1.\r\n"
-									"Content-Length: 0\r\n"
-									"Connection: close\r\n"
-									"\r\n";
-								conn->keepalive = false;
-								if (!server.tcp_send(conn, res))
-								{
-									log(L"Error: http_sever::send() failed.");
-									server.connection_close(conn);
-								}
-							}
-							else if (method != "GET" && method != "HEAD")
-							{
-								log(L"Info: sock=%llu >> HTTP/1.1 405 Method Not Allowed", conn->sock);
-								const std::string res =
-									"HTTP/1.1 405 Method Not Allowed\r\n"
-									"Allow: GET, HEAD\r\n"
-									"Content-Length: 0\r\n"
-									"Connection: close\r\n"
-									"\r\n";
-								conn->keepalive = false;
-								if (!server.tcp_send(conn, res))
-								{
-									log(L"Error: sock=%llu http_sever::tcp_send() failed", conn->sock);
-									server.connection_close(conn);
-								}
-							}
-							else
-							{
-								std::string res = "";
-								auto absolutepath = get_absolute_path(request);
-								if (absolutepath == "")
-								{
-									log(L"Info: sock=%llu >> HTTP/1.1 400 Bad Request", conn->sock);
-									res =
-										"HTTP/1.1 400 Bad Request\r\n"
-										"Content-Length: 0\r\n"
-										"\r\n";
-								}
-								else
-								{
-									// スラッシュで終わってたらindex.html表示を試みる
-									if (absolutepath.back() == '/')
-									{
-										absolutepath += "index.html";
-									}
-									auto path = htdocs_path + absolute_path_to_winpath(absolutepath);
-									auto exists = is_file(path);
-
-									if (exists)
-									{
-										if (server.file_open(conn, path))
-										{
-											::CreateIoCompletionPort(conn->fio_ctx.file, compport_, COMPKEY_FILE_READ, 0);
-
-											bool ok = true;
-
-											if (method == "GET" && conn->fio_ctx.size > 0)
-											{
-												if (!server.file_read(conn))
-												{
-													log(L"Error: sock=%llu http_sever::file_read() failed", conn->sock);
-													server.file_close(conn);
-													ok = false;
-												}
-												else
-												{
-													conn->fio_ctx.sending = true;
-												}
-											}
-											else if (conn->fio_ctx.size == 0)
-											{
-												server.file_close(conn);
-											}
-
-											if (ok)
-											{
-												log(L"Info: sock=%llu >> HTTP/1.1 200 OK", conn->sock);
-												res = "HTTP/1.1 200 OK\r\n";
-												res += "Content-Type: " + get_content_type(path) + "\r\n";
-												res += "Content-Length: " + std::to_string(conn->fio_ctx.size) + "\r\n";
-												res += "Cache-Control: no-store\r\n";
-												res += "\r\n";
-											}
-
-											if (method == "HEAD")
-											{
-												conn->fio_ctx.size = 0;
-												server.file_close(conn);
-											}
-										}
-									}
-
-									if (res == "")
-									{
-										log(L"Info: sock=%llu >> HTTP/1.1 404 Not Found", conn->sock);
-										res =
-											"HTTP/1.1 404 Not Found\r\n"
-											"Content-Length: 0\r\n"
-											"\r\n";
-									}
-								}
-								if (!server.tcp_send(conn, res))
-								{
-									log(L"Error: sock=%llu http_sever::tcp_send() failed", conn->sock);
-									server.connection_close(conn);
-								}
-							}
-
-							// 読込待ち
-							if (!server.tcp_read(conn))
-							{
-								log(L"Error: sock=%llu http_server::tcp_read() failed", conn->sock);
-								server.connection_close(conn);
-							}
-						}
-					}
-					else if (ctx->type == HTTP_TCP_SEND)
+					else
 					{
-						// データ書き込み完了
-						if (conn->headersent == false)
-						{
-							conn->headersent = true;
-						}
-						else
-						{
-							conn->fio_ctx.sent_count++;
-							conn->fio_ctx.total_sent += transferred;
-						}
-						conn->fio_ctx.sending = false;
-
-						// log(L"Info: file send total=%llu current=%llu count=%llu.", conn->fio_ctx.size, conn->fio_ctx.total_sent, conn->fio_ctx.sent_count);
+						// 接続元の表示
+						log(L"Info: sock=%llu ACCEPT called", conn->sock);
 
-						// 読込バッファがたまっている
-						if (conn->fio_ctx.sent_count < conn->fio_ctx.read_count)
 						{
-							if (!server.tcp_send_file(conn))
-							{
-								if (conn->sock >= 0)
-								{
-									log(L"Error: sock=%llu http_server::tcp_send_file() failed", conn->sock);
-								}
-								server.connection_close(conn);
-							}
+							stall_call_scope scope(CALL_ASSOCIATE_PORT);
+							::CreateIoCompletionPort((HANDLE)conn->sock, compport_, COMPKEY_TCP_READWRITE, 0);
 						}
 
-						// ファイル読込が送信完了待ちしてた
-						if (!conn->fio_ctx.reading && conn->fio_ctx.size > conn->fio_ctx.total_read)
+						// 接続と同時に受け取ったデータは受信済みとして処理する
+						if (transferred > 0)
 						{
-							if (conn->fio_ctx.sent_count < conn->fio_ctx.read_count)
-							{
-								if (!server.file_read(conn))
-								{
-									if (conn->sock >= 0)
-									{
-										log(L"Error: sock=%llu http_server::file_read() failed", conn->sock);
-									}
-									server.connection_close(conn);
-								}
-							}
+							std::memcpy(conn->ior_ctx.buf.data(), ctx->buf.data(), transferred);
 						}
+						handler.on_accept(conn, address, trusted, transferred);
+					}
+					http_trace_policy::complete("accept", sock, trace_start, transferred);
 
-						// 切断処理
-						if (conn->fio_ctx.size <= conn->fio_ctx.sent_count)
-						{
-							if (!conn->keepalive)
-							{
-								server.connection_close(conn);
-							}
-						}
+					// 受信データを取り出してから次の接続待ち
+					if (!server.tcp_acceptex(ctx))
+					{
+						log(L"Error: sock=%llu http_server::tcp_acceptex() failed.", sock);
+						break;
 					}
 				}
+				if (compkey == COMPKEY_TCP_READWRITE && ov != NULL)
+				{
+					auto ctx = (HTTP_IO_CONTEXT*)ov;
+					auto sock = ctx->conn->sock;
+					auto type = ctx->type;
+					handler.on_socket(ctx, gqcs_error, transferred);
+					http_trace_policy::complete(type == HTTP_TCP_RECV ? "recv" : "send", sock, trace_start, transferred);
+				}
 				if (compkey == COMPKEY_FILE_READ && ov != NULL)
 				{
-					FILE_IO_CONTEXT* ctx = (FILE_IO_CONTEXT*)ov;
-
-					http_conn_t* conn = ctx->conn;
-
+					auto slot = (FILE_READ_CONTEXT*)ov;
+					auto sock = slot->conn->sock;
+					handler.on_file_read(slot, gqcs_error, transferred);
+					http_trace_policy::complete("file_read", sock, trace_start, transferred);
+				}
+				if (compkey == COMPKEY_FILE_OPEN && ov != NULL)
+				{
+					auto ctx = (FILE_OPEN_CONTEXT*)ov;
+					auto sock = ctx->conn->sock;
+					handler.on_file_open(ctx);
+					http_trace_policy::complete("file_open", sock, trace_start, 0);
+				}
+				if (compkey == COMPKEY_PREFETCH && ov != NULL)
+				{
+					// 先読みはキャッシュに載せるだけ
+					earlyhints.on_prefetch((PREFETCH_CONTEXT*)ov, rc != FALSE, transferred);
+					http_trace_policy::complete("prefetch", 0, trace_start, transferred);
+				}
+				if (compkey == COMPKEY_CAPTURE && ov != NULL)
+				{
+					capture.on_write(gqcs_error, transferred);
+				}
+				if (compkey == COMPKEY_DIR_CHANGE && ov != NULL)
+				{
+					// 監視が途切れたら変更を知る手段が無いので404キャッシュを止める
 					if (rc == FALSE)
 					{
-						if (gqcs_error != ERROR_HANDLE_EOF)
+						if (gqcs_error != ERROR_OPERATION_ABORTED)
 						{
-							log(L"Error: file read completion failed. sock=%llu, ErrorCode=%lu", conn->sock, gqcs_error);
-							server.file_close(conn);
-							server.connection_close(conn);
+							log(L"Error: directory change completion failed. ErrorCode=%lu notfound cache disabled.", gqcs_error);
 						}
+						notfound.disable();
 						continue;
 					}
 
-					const DWORD read_index = (ctx->read_count % 2);
-					ctx->transferred.at(read_index) = transferred;
-					ctx->total_read += transferred;
-					ctx->read_count++;
-					ctx->reading = false;
-					ctx->ov.Offset = ctx->total_read & 0xffffffff;
-					ctx->ov.OffsetHigh = (ctx->total_read >> 32) & 0xffffffff;
-
-					// log(L"Info: file read total=%llu current=%llu count=%llu.", ctx->size, ctx->total_read, ctx->read_count);
-
-					if (ctx->read_count <= ctx->sent_count + 2)
+					// htdocsの変更通知
+					if (!notfound.on_change(transferred))
 					{
-						// 次のファイル読込
-						if (!server.file_read(conn))
-						{
-							log(L"Error: sock=%llu http_server::file_read() failed", conn->sock);
-							server.connection_close(conn);
-						}
+						log(L"Error: not_found_cache::on_change() failed. notfound cache disabled.");
+						notfound.disable();
 					}
+				}
+			}
 
-					// ファイル読込待ち
-					if (!ctx->sending && ctx->size > ctx->total_sent)
-					{
-						if (ctx->sent_count < ctx->read_count)
-						{
-							if (!server.tcp_send_file(conn))
-							{
-								log(L"Error: sock=%llu http_server::tcp_send_file() failed", conn->sock);
-								server.connection_close(conn);
-							}
-						}
-					}
+			auto stats = notfound.stats();
+			log(L"Info: notfound cache hits=%llu inserts=%llu evictions=%llu invalidations=%llu", stats.hits, stats.inserts, stats.evictions, stats.invalidations);
 
-					// 読込が完了した
-					if (ctx->size == ctx->total_read)
-					{
-						log(L"Info: sock=%llu file read complete", conn->sock);
-						server.file_close(conn);
-					}
-				}
+			auto admission = server.admission_stats();
+			log(L"Info: admission accepted=%llu reserved=%llu shed=%llu peak=%llu queue_peak=%llu accept_reaped=%llu", admission.accepted, admission.reserved_accepted, admission.shed, static_cast<uint64_t>(admission.peak), static_cast<uint64_t>(admission.queue_peak), admission.accept_reaped);
+
+			log(L"Info: completions=%llu wakeups=%llu per_wakeup=%.2f max=%lu full_batches=%llu", completion.completions, completion.wakeups,
+				completion.wakeups > 0 ? static_cast<double>(completion.completions) / completion.wakeups : 0.0, completion.max_batch, completion.full_batches);
+
+			auto blocking = pool.stats();
+			log(L"Info: blocking pool threads=%lu jobs=%llu", config_.blocking_threads, blocking.submitted);
+
+			auto limited = limiter.stats();
+			log(L"Info: rate limit connections=%llu requests=%llu reused=%llu table_full=%llu", limited.limited_connections, limited.limited_requests, limited.reused, limited.table_full);
+
+			auto arena = server.arena_stats();
+			log(L"Info: request arena overflows=%llu bytes=%llu", arena.overflows, arena.bytes);
+
+			watchdog.report();
+			auto stall = watchdog.stats();
+			log(L"Info: event loop iterations=%llu stalls=%llu max=%lluus", stall.iterations, stall.stalls, stall.max_usec);
+
+			auto frames = frame_pool::current().stats();
+			log(L"Info: coroutine frames allocated=%llu reused=%llu", frames.allocated, frames.reused);
+
+			if constexpr (http_metrics_policy::enabled)
+			{
+				log_latency();
 			}
 		}
+		trace_ring::detach();
 		log(L"Info: thread end.");
 
 		return 0;
 	}
 
-	bool http_thread::run(HWND _window, const std::string& _ip, uint16_t _port, uint16_t _maxconn)
+	bool http_thread::run(HWND _window, const http_config_t& _config)
 	{
 		window_ = _window;
-		ip_ = _ip;
-		port_ = _port;
-		maxconn_ = _maxconn;
+		config_ = _config;
 
 		// CompPort作成
 		compport_ = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, COMPKEY_OPERATION, 0);
@@ -858,6 +535,15 @@ namespace app {
 		return thread_ != NULL;
 	}
 
+	// ウィンドウのタイマーから1秒ごとに呼ばれる
+	void http_thread::tick()
+	{
+		if (thread_ != NULL)
+		{
+			::PostQueuedCompletionStatus(compport_, OPERATION_TICK, COMPKEY_OPERATION, NULL);
+		}
+	}
+
 	void http_thread::stop()
 	{
 		if (thread_ != NULL)
@@ -2,6 +2,8 @@
 
 #include "common.hpp"
 
+#include "http_config.hpp"
+
 #include <string>
 
 namespace app
@@ -10,18 +12,18 @@ namespace app
 	constexpr ULONG_PTR COMPKEY_TCP_ACCEPTEX = 1;
 	constexpr ULONG_PTR COMPKEY_TCP_READWRITE = 2;
 	constexpr ULONG_PTR COMPKEY_FILE_READ = 3;
+	constexpr ULONG_PTR COMPKEY_DIR_CHANGE = 4;
+	constexpr ULONG_PTR COMPKEY_PREFETCH = 5;
+	constexpr ULONG_PTR COMPKEY_FILE_OPEN = 6;
+	constexpr ULONG_PTR COMPKEY_CAPTURE = 7;
 	constexpr DWORD OPERATION_STOP = 0;
 	constexpr DWORD OPERATION_KEEPALIVE_CHECK = 1;
-
-
-
+	constexpr DWORD OPERATION_TICK = 2;
 
 	class http_thread
 	{
 	private:
-		std::string ip_;
-		uint16_t port_;
-		uint16_t maxconn_;
+		http_config_t config_;
 		HWND window_;
 		HANDLE thread_;
 		HANDLE compport_;
@@ -39,7 +41,8 @@ namespace app
 		http_thread(http_thread&&) = delete;
 		http_thread& operator = (http_thread&&) = delete;
 
-		bool run(HWND, const std::string& _ip, uint16_t _port, uint16_t _maxconn);
+		bool run(HWND, const http_config_t& _config);
 		void stop();
+		void tick();
 	};
 }
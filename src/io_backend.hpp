@@ -0,0 +1,30 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include <concepts>
+#include <string>
+
+namespace app {
+
+	struct http_conn_t;
+	struct FILE_OPEN_CONTEXT;
+
+	// 接続とファイルに対するI/O。完了通知はhttp_handlerに渡す
+	template <typename T>
+	concept io_backend = requires(T& _io, http_conn_t* _conn, FILE_OPEN_CONTEXT* _opened, const std::string& _data, const wchar_t* _path, DWORD _transferred)
+	{
+		{ _io.tcp_read(_conn) } -> std::same_as<bool>;
+		{ _io.tcp_send(_conn, _data) } -> std::same_as<bool>;
+		{ _io.tcp_send_file(_conn) } -> std::same_as<bool>;
+		_io.tcp_send_file_complete(_conn, _transferred);
+
+		{ _io.file_open_start(_conn, _path) } -> std::same_as<bool>;
+		{ _io.file_open_complete(_conn) } -> std::same_as<bool>;
+		{ _io.file_open_finish(_opened) } -> std::same_as<bool>;
+		{ _io.file_read(_conn) } -> std::same_as<bool>;
+
+		_io.file_close(_conn);
+		_io.connection_close(_conn);
+	};
+}
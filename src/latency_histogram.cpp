@@ -0,0 +1,101 @@
+﻿#include "latency_histogram.hpp"
+
+#include <algorithm>
+#include <bit>
+
+namespace {
+
+	void add_relaxed(std::atomic<uint64_t>& _v, uint64_t _n) noexcept
+	{
+		_v.store(_v.load(std::memory_order_relaxed) + _n, std::memory_order_relaxed);
+	}
+
+}
+
+
+namespace app {
+
+	const char* latency_phase_name(latency_phase _phase) noexcept
+	{
+		switch (_phase)
+		{
+		case PHASE_FIRST_BYTE: return "first_byte";
+		case PHASE_PARSE: return "parse";
+		case PHASE_OPEN: return "open";
+		case PHASE_FIRST_BODY: return "first_body";
+		case PHASE_TOTAL: return "total";
+		case PHASE_SMALL_TOTAL: return "small_total";
+		default: return "unknown";
+		}
+	}
+
+	// 16未満はそのまま、それ以上は最上位ビットの位置と続く4ビットで決める
+	size_t latency_bucket(uint64_t _usec) noexcept
+	{
+		if (_usec < LATENCY_SUB_COUNT) return static_cast<size_t>(_usec);
+
+		size_t msb = std::bit_width(_usec) - 1;
+		if (msb >= LATENCY_MAX_BITS) return LATENCY_BUCKETS - 1;
+
+		size_t sub = static_cast<size_t>(_usec >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB_COUNT - 1);
+		return (msb - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT + sub;
+	}
+
+	// バケットに入る最大の値
+	uint64_t latency_bucket_upper(size_t _bucket) noexcept
+	{
+		if (_bucket < LATENCY_SUB_COUNT) return _bucket;
+
+		size_t msb = _bucket / LATENCY_SUB_COUNT + LATENCY_SUB_BITS - 1;
+		uint64_t sub = _bucket % LATENCY_SUB_COUNT;
+		uint64_t low = (LATENCY_SUB_COUNT + sub) << (msb - LATENCY_SUB_BITS);
+		return low + (uint64_t(1) << (msb - LATENCY_SUB_BITS)) - 1;
+	}
+
+	uint64_t latency_snapshot::percentile(double _q) const noexcept
+	{
+		if (count == 0) return 0;
+
+		auto rank = static_cast<uint64_t>(_q * static_cast<double>(count));
+		rank = std::clamp<uint64_t>(rank, 1, count);
+
+		uint64_t seen = 0;
+		for (size_t i = 0; i < counts.size(); ++i)
+		{
+			seen += counts.at(i);
+			if (seen >= rank) return std::min(latency_bucket_upper(i), max);
+		}
+		return max;
+	}
+
+	latency_histogram::latency_histogram()
+		: counts_()
+		, count_(0)
+		, sum_(0)
+		, max_(0)
+	{
+	}
+
+	latency_histogram::~latency_histogram()
+	{
+	}
+
+	void latency_histogram::record(uint64_t _usec) noexcept
+	{
+		add_relaxed(counts_[latency_bucket(_usec)], 1);
+		add_relaxed(count_, 1);
+		add_relaxed(sum_, _usec);
+		if (_usec > max_.load(std::memory_order_relaxed)) max_.store(_usec, std::memory_order_relaxed);
+	}
+
+	void latency_histogram::merge_into(latency_snapshot& _snapshot) const noexcept
+	{
+		for (size_t i = 0; i < counts_.size(); ++i)
+		{
+			_snapshot.counts.at(i) += counts_.at(i).load(std::memory_order_relaxed);
+		}
+		_snapshot.count += count_.load(std::memory_order_relaxed);
+		_snapshot.sum += sum_.load(std::memory_order_relaxed);
+		_snapshot.max = std::max(_snapshot.max, max_.load(std::memory_order_relaxed));
+	}
+}
@@ -0,0 +1,67 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace app {
+
+	// 1リクエストの区間
+	enum latency_phase : size_t {
+		PHASE_FIRST_BYTE, // 接続から最初のリクエストの受信まで
+		PHASE_PARSE, // 受信からヘッダ解析の終了まで
+		PHASE_OPEN, // ヘッダ解析からファイルを開き終わるまで
+		PHASE_FIRST_BODY, // 受信からボディの最初の送信完了まで
+		PHASE_TOTAL, // 受信から応答の送信完了まで
+		PHASE_SMALL_TOTAL, // PHASE_TOTALのうち本体が64KB以下の応答
+		PHASE_COUNT
+	};
+
+	const char* latency_phase_name(latency_phase _phase) noexcept;
+
+	// 対数線形(HDR方式)のバケット。2のべき乗ごとに16分割するので誤差は1/16以内
+	// 値はマイクロ秒で、2^36us(約19時間)以上は最後のバケットにまとめる
+	constexpr size_t LATENCY_SUB_BITS = 4;
+	constexpr size_t LATENCY_SUB_COUNT = size_t(1) << LATENCY_SUB_BITS;
+	constexpr size_t LATENCY_MAX_BITS = 36;
+	constexpr size_t LATENCY_BUCKETS = (LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT;
+
+	size_t latency_bucket(uint64_t _usec) noexcept;
+	uint64_t latency_bucket_upper(size_t _bucket) noexcept;
+
+	// 合算した結果。パーセンタイルはここで求める
+	struct latency_snapshot {
+		std::array<uint64_t, LATENCY_BUCKETS> counts;
+		uint64_t count;
+		uint64_t sum;
+		uint64_t max;
+
+		uint64_t percentile(double _q) const noexcept;
+	};
+
+	// 記録用。書くのは持ち主のスレッドだけで、読み出しは他のスレッドからでもよい
+	class latency_histogram
+	{
+	private:
+		std::array<std::atomic<uint64_t>, LATENCY_BUCKETS> counts_;
+		std::atomic<uint64_t> count_;
+		std::atomic<uint64_t> sum_;
+		std::atomic<uint64_t> max_;
+
+	public:
+		latency_histogram();
+		~latency_histogram();
+
+		// コピー不可
+		latency_histogram(const latency_histogram&) = delete;
+		latency_histogram& operator = (const latency_histogram&) = delete;
+		// ムーブ不可
+		latency_histogram(latency_histogram&&) = delete;
+		latency_histogram& operator = (latency_histogram&&) = delete;
+
+		void record(uint64_t _usec) noexcept;
+		void merge_into(latency_snapshot& _snapshot) const noexcept;
+	};
+}
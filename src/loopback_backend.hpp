@@ -0,0 +1,363 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include "http_handler.hpp"
+#include "http_server.hpp"
+#include "io_backend.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace app {
+
+	// ソケットとファイルの代わりにメモリ上の台本を使うio_backend
+	// 受信は台本の要素を1回に1つずつ渡し(使い切ったら相手の切断)、送信は接続ごとに溜め、ファイルはadd_file()で登録した内容を返す
+	// 完了は完了ポートではなくキューに積み、run()でhttp_handlerのon_socket()などに渡す。ベンチマークと試験用
+	class loopback_backend
+	{
+	private:
+		static constexpr size_t RECV_BUFFER_SIZE = 16 * 1024;
+		static constexpr DWORD FILE_CHUNK = 64 * 1024;
+
+		enum class completion_type { socket, file_read, file_open };
+
+		struct completion_t {
+			completion_type type;
+			void* ctx;
+			DWORD transferred;
+		};
+
+		struct script_t {
+			std::vector<std::string> input; // 1回の受信で渡すバイト列
+			size_t next;
+			std::string output; // 送信されたバイト列
+			const std::string* body; // 開いたファイルの内容
+			bool closed;
+		};
+
+		std::vector<http_conn_t> conns_;
+		std::vector<script_t> scripts_;
+		std::unordered_map<std::wstring, std::string> files_;
+		std::vector<completion_t> completions_; // 配列を使い回し、積むときにヒープへ行かないようにする
+		size_t next_completion_;
+
+		size_t index(const http_conn_t* _conn) const noexcept
+		{
+			return static_cast<size_t>(_conn - conns_.data());
+		}
+
+		// 本物のハンドルとは比べないので、接続ごとに0とINVALID_HANDLE_VALUE以外の値を割り当てる
+		HANDLE fake_handle(const http_conn_t* _conn) const noexcept
+		{
+			return reinterpret_cast<HANDLE>(static_cast<uintptr_t>(index(_conn) + 1));
+		}
+
+	public:
+		loopback_backend(size_t _conns, size_t _read_ahead = 4)
+			: conns_(_conns)
+			, scripts_(_conns)
+			, files_()
+			, completions_()
+			, next_completion_(0)
+		{
+			for (auto& x : conns_)
+			{
+				x.ior_ctx.buf.resize(RECV_BUFFER_SIZE);
+				x.ior_ctx.wsabuf.buf = reinterpret_cast<CHAR*>(x.ior_ctx.buf.data());
+				x.ior_ctx.wsabuf.len = x.ior_ctx.buf.size();
+				x.ior_ctx.type = HTTP_TCP_RECV;
+				x.iow_ctx.type = HTTP_TCP_SEND;
+				x.open_ctx.job.run = nullptr;
+				x.open_ctx.job.compkey = 0;
+
+				x.fio_ctx.slots.resize(std::max<size_t>(_read_ahead, 2));
+				for (auto& slot : x.fio_ctx.slots)
+				{
+					slot.buf.resize(FILE_CHUNK);
+					slot.direct_buf = nullptr;
+					slot.pending = false;
+					slot.conn = &x;
+				}
+			}
+		}
+
+		// コピー不可
+		loopback_backend(const loopback_backend&) = delete;
+		loopback_backend& operator = (const loopback_backend&) = delete;
+		// ムーブ不可
+		loopback_backend(loopback_backend&&) = delete;
+		loopback_backend& operator = (loopback_backend&&) = delete;
+
+		// _pathはhttp_handlerが組み立てるパス(htdocs + \区切りのパス)
+		void add_file(const std::wstring& _path, std::string _body)
+		{
+			files_.insert_or_assign(_path, std::move(_body));
+		}
+
+		// 空いている接続に台本を割り当て、_handlerに接続を渡す。空きが無ければnullptr
+		template <typename Handler>
+		http_conn_t* accept(Handler& _handler, std::vector<std::string> _input)
+		{
+			for (auto& x : conns_)
+			{
+				if (x.sock != INVALID_SOCKET || x.open_ctx.pending) continue;
+
+				// 送信を溜める文字列は前の台本のものを空にして使い回す
+				auto& script = scripts_.at(index(&x));
+				script.input = std::move(_input);
+				script.next = 0;
+				script.output.clear();
+				script.body = nullptr;
+				script.closed = false;
+				x.sock = static_cast<SOCKET>(index(&x) + 1);
+				_handler.on_accept(&x, 0, true, 0);
+				return &x;
+			}
+			return nullptr;
+		}
+
+		// 積まれた完了をhttp_handlerに渡す。送信を譲った接続も含めて、何も残らなくなるまで続ける
+		template <typename Handler>
+		size_t run(Handler& _handler)
+		{
+			size_t count = 0;
+			while (true)
+			{
+				_handler.run_deferred();
+				_handler.run_throttled();
+				if (next_completion_ == completions_.size())
+				{
+					completions_.clear();
+					next_completion_ = 0;
+					if (_handler.has_deferred()) continue;
+					break;
+				}
+
+				auto entry = completions_.at(next_completion_++);
+				count++;
+
+				switch (entry.type)
+				{
+				case completion_type::socket:
+					_handler.on_socket(static_cast<HTTP_IO_CONTEXT*>(entry.ctx), ERROR_SUCCESS, entry.transferred);
+					break;
+				case completion_type::file_read:
+					_handler.on_file_read(static_cast<FILE_READ_CONTEXT*>(entry.ctx), ERROR_SUCCESS, entry.transferred);
+					break;
+				case completion_type::file_open:
+					_handler.on_file_open(static_cast<FILE_OPEN_CONTEXT*>(entry.ctx));
+					break;
+				}
+			}
+			return count;
+		}
+
+		const std::string& output(const http_conn_t* _conn) const
+		{
+			return scripts_.at(index(_conn)).output;
+		}
+
+		bool closed(const http_conn_t* _conn) const
+		{
+			return scripts_.at(index(_conn)).closed;
+		}
+
+		// 以下はio_backendとしてhttp_handlerから呼ばれる
+
+		bool tcp_read(http_conn_t* _conn)
+		{
+			if (_conn->sock == INVALID_SOCKET) return false;
+
+			// 台本を使い切ったら0バイト受信(相手の切断)を返す
+			auto& script = scripts_.at(index(_conn));
+			size_t length = 0;
+			if (script.next < script.input.size())
+			{
+				const auto& chunk = script.input.at(script.next++);
+				length = std::min(chunk.size(), _conn->ior_ctx.buf.size());
+				std::copy_n(chunk.data(), length, _conn->ior_ctx.buf.data());
+			}
+			completions_.push_back({ completion_type::socket, &_conn->ior_ctx, static_cast<DWORD>(length) });
+			return true;
+		}
+
+		bool tcp_send(http_conn_t* _conn, const std::string& _data)
+		{
+			if (_conn->sock == INVALID_SOCKET) return false;
+
+			scripts_.at(index(_conn)).output.append(_data);
+			completions_.push_back({ completion_type::socket, &_conn->iow_ctx, static_cast<DWORD>(_data.size()) });
+			return true;
+		}
+
+		bool tcp_send_file(http_conn_t* _conn)
+		{
+			if (_conn->sock == INVALID_SOCKET) return false;
+
+			FILE_IO_CONTEXT& fctx = _conn->fio_ctx;
+			DWORD length = next_send_size(fctx);
+			if (length == 0) return true;
+			FILE_READ_CONTEXT& slot = fctx.slots.at(fctx.sent_count % fctx.slots.size());
+
+			// 未送信のヘッダがあれば最初のボディと一緒に送る
+			auto& output = scripts_.at(index(_conn)).output;
+			fctx.header_size = static_cast<DWORD>(_conn->header.size());
+			output.append(_conn->header);
+			output.append(slot.data + slot.sent, length);
+
+			fctx.sending = true;
+			completions_.push_back({ completion_type::socket, &_conn->iow_ctx, fctx.header_size + length });
+			return true;
+		}
+
+		void tcp_send_file_complete(http_conn_t* _conn, DWORD _transferred)
+		{
+			FILE_IO_CONTEXT& fctx = _conn->fio_ctx;
+			FILE_READ_CONTEXT& slot = fctx.slots.at(fctx.sent_count % fctx.slots.size());
+
+			if (fctx.header_size > 0)
+			{
+				_transferred -= std::min(_transferred, fctx.header_size);
+				fctx.header_size = 0;
+				_conn->header.clear();
+			}
+
+			slot.sent += _transferred;
+			if (slot.sent >= slot.transferred)
+			{
+				slot.ready = false;
+				fctx.sent_count++;
+			}
+			fctx.total_sent += _transferred;
+			fctx.sending = false;
+		}
+
+		// 登録したファイルの有無はその場で分かるが、ブロッキングスレッドと同じく完了を待たせる
+		bool file_open_start(http_conn_t* _conn, const wchar_t* _path)
+		{
+			FILE_OPEN_CONTEXT& ctx = _conn->open_ctx;
+			auto& script = scripts_.at(index(_conn));
+
+			ctx.path.assign(_path);
+			ctx.file = INVALID_HANDLE_VALUE;
+			ctx.direct_file = INVALID_HANDLE_VALUE;
+			ctx.size = 0;
+			auto it = files_.find(ctx.path);
+			ctx.missing = it == files_.end();
+			script.body = ctx.missing ? nullptr : &it->second;
+			if (!ctx.missing)
+			{
+				ctx.file = fake_handle(_conn);
+				ctx.size = it->second.size();
+			}
+
+			ctx.pending = true;
+			ctx.issued = ctx.generation;
+			completions_.push_back({ completion_type::file_open, &ctx, 0 });
+			return true;
+		}
+
+		bool file_open_finish(FILE_OPEN_CONTEXT* _ctx)
+		{
+			_ctx->pending = false;
+			if (_ctx->issued == _ctx->generation) return true;
+
+			_ctx->file = INVALID_HANDLE_VALUE;
+			return false;
+		}
+
+		bool file_open_complete(http_conn_t* _conn)
+		{
+			FILE_OPEN_CONTEXT& opened = _conn->open_ctx;
+			FILE_IO_CONTEXT& ctx = _conn->fio_ctx;
+			if (opened.file == INVALID_HANDLE_VALUE || ctx.file != INVALID_HANDLE_VALUE)
+			{
+				opened.file = INVALID_HANDLE_VALUE;
+				return false;
+			}
+
+			ctx.file = opened.file;
+			ctx.size = opened.size;
+			opened.file = INVALID_HANDLE_VALUE;
+			ctx.direct = false;
+			ctx.read_count = 0;
+			ctx.sent_count = 0;
+			ctx.total_read = 0;
+			ctx.total_sent = 0;
+			ctx.next_offset = 0;
+			ctx.send_limit = 0;
+			ctx.sending = false;
+			ctx.chunk = FILE_CHUNK;
+			for (auto& slot : ctx.slots)
+			{
+				slot.ready = false;
+			}
+			return true;
+		}
+
+		bool file_read(http_conn_t* _conn)
+		{
+			FILE_IO_CONTEXT& ctx = _conn->fio_ctx;
+			const std::string* body = scripts_.at(index(_conn)).body;
+			if (ctx.file == INVALID_HANDLE_VALUE || body == nullptr) return false;
+
+			while (ctx.next_offset < ctx.size && ctx.read_count < ctx.sent_count + ctx.slots.size())
+			{
+				FILE_READ_CONTEXT& slot = ctx.slots.at(ctx.read_count % ctx.slots.size());
+				if (slot.pending) break;
+
+				DWORD length = static_cast<DWORD>(std::min<uint64_t>(ctx.chunk, ctx.size - ctx.next_offset));
+				slot.data = slot.buf.data();
+				slot.offset = ctx.next_offset;
+				slot.length = length;
+				slot.request = length;
+				slot.transferred = 0;
+				slot.sent = 0;
+				slot.ready = false;
+				std::copy_n(body->data() + ctx.next_offset, length, slot.data);
+				completions_.push_back({ completion_type::file_read, &slot, length });
+
+				slot.pending = true;
+				slot.issued = ctx.generation;
+				ctx.read_count++;
+				ctx.reading++;
+				ctx.next_offset += length;
+			}
+			return true;
+		}
+
+		void file_close(http_conn_t* _conn)
+		{
+			_conn->fio_ctx.file = INVALID_HANDLE_VALUE;
+			_conn->fio_ctx.generation++;
+		}
+
+		void connection_close(http_conn_t* _conn)
+		{
+			file_close(_conn);
+			_conn->open_ctx.generation++;
+			if (!_conn->open_ctx.pending)
+			{
+				_conn->open_ctx.file = INVALID_HANDLE_VALUE;
+			}
+			if (_conn->sock != INVALID_SOCKET)
+			{
+				scripts_.at(index(_conn)).closed = true;
+				_conn->sock = INVALID_SOCKET;
+			}
+		}
+	};
+
+	static_assert(io_backend<loopback_backend>);
+
+	extern template class basic_http_handler<loopback_backend, http_log_policy, http_cache_policy, http_metrics_policy, http_trace_policy>;
+	using loopback_http_handler = basic_http_handler<loopback_backend, http_log_policy, http_cache_policy, http_metrics_policy, http_trace_policy>;
+
+	// ログ・404キャッシュ・統計・トレースを全て外したもの。ベンチマークで機能の有無を比べる
+	extern template class basic_http_handler<loopback_backend, log_policy_disabled, null_not_found_cache, metrics_policy_disabled, trace_policy_disabled>;
+	using loopback_bare_http_handler = basic_http_handler<loopback_backend, log_policy_disabled, null_not_found_cache, metrics_policy_disabled, trace_policy_disabled>;
+}
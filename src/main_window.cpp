@@ -156,17 +156,84 @@ namespace app
 
 			{
 				// 読み出し
-				auto ip = ini_.get_ipaddress();
-				auto port = ini_.get_port();
-				auto connections = ini_.get_connections();
+				http_config_t config;
+				config.ip = ini_.get_ipaddress();
+				config.port = ini_.get_port();
+				config.maxconn = ini_.get_connections();
+				config.reserved_connections = ini_.get_reserved_connections();
+				config.healthcheck_ip = ini_.get_healthcheck_ip();
+				config.retry_after = ini_.get_retry_after();
+				config.accept_posted = ini_.get_accept_posted();
+				config.listen_backlog = ini_.get_listen_backlog();
+				config.accept_data = ini_.get_accept_data();
+				config.accept_data_timeout = ini_.get_accept_data_timeout();
+				config.tcp_nodelay = ini_.get_tcp_nodelay();
+				config.send_buffer = ini_.get_send_buffer();
+				config.recv_buffer = ini_.get_recv_buffer();
+				config.tcp_fastopen = ini_.get_tcp_fastopen();
+				config.completion_batch = ini_.get_completion_batch();
+				config.blocking_threads = ini_.get_blocking_threads();
+				config.send_quantum = ini_.get_send_quantum();
+				config.bandwidth_total = ini_.get_bandwidth_total();
+				config.bandwidth = ini_.get_bandwidth();
+				config.rate_limit = ini_.get_rate_limit();
+				config.rate_burst = ini_.get_rate_burst();
+				config.connections_per_ip = ini_.get_connections_per_ip();
+				config.rate_table = ini_.get_rate_table();
+				config.metrics_path = ini_.get_metrics_path();
+				config.latency_dump = ini_.get_latency_dump();
+				config.trace_events = ini_.get_trace_events();
+				config.trace_path = ini_.get_trace_path();
+				config.stall_threshold = ini_.get_stall_threshold();
+				config.capture_file = ini_.get_capture_file();
+				config.capture_limit = ini_.get_capture_limit();
+				config.notfound_cache = ini_.get_notfound_cache();
+				config.read_ahead = ini_.get_read_ahead();
+				config.read_chunk_max = ini_.get_read_chunk_max();
+				config.direct_io_threshold = ini_.get_direct_io_threshold();
+				config.direct_io_streams = ini_.get_direct_io_streams();
+				config.early_hints_prefetch = ini_.get_early_hints_prefetch();
+				config.early_hints = ini_.get_early_hints();
 
 				// 書き込み
-				ini_.set_ipaddress(ip);
-				ini_.set_port(port);
-				ini_.set_connections(connections);
+				ini_.set_ipaddress(config.ip);
+				ini_.set_port(config.port);
+				ini_.set_connections(config.maxconn);
+				ini_.set_reserved_connections(config.reserved_connections);
+				ini_.set_healthcheck_ip(config.healthcheck_ip);
+				ini_.set_retry_after(config.retry_after);
+				ini_.set_accept_posted(config.accept_posted);
+				ini_.set_listen_backlog(config.listen_backlog);
+				ini_.set_accept_data(config.accept_data);
+				ini_.set_accept_data_timeout(config.accept_data_timeout);
+				ini_.set_tcp_nodelay(config.tcp_nodelay);
+				ini_.set_send_buffer(config.send_buffer);
+				ini_.set_recv_buffer(config.recv_buffer);
+				ini_.set_tcp_fastopen(config.tcp_fastopen);
+				ini_.set_completion_batch(config.completion_batch);
+				ini_.set_blocking_threads(config.blocking_threads);
+				ini_.set_send_quantum(config.send_quantum);
+				ini_.set_bandwidth_total(config.bandwidth_total);
+				ini_.set_rate_limit(config.rate_limit);
+				ini_.set_rate_burst(config.rate_burst);
+				ini_.set_connections_per_ip(config.connections_per_ip);
+				ini_.set_rate_table(config.rate_table);
+				ini_.set_metrics_path(config.metrics_path);
+				ini_.set_latency_dump(config.latency_dump);
+				ini_.set_trace_events(config.trace_events);
+				ini_.set_trace_path(config.trace_path);
+				ini_.set_stall_threshold(config.stall_threshold);
+				ini_.set_capture_file(config.capture_file);
+				ini_.set_capture_limit(config.capture_limit);
+				ini_.set_notfound_cache(config.notfound_cache);
+				ini_.set_read_ahead(config.read_ahead);
+				ini_.set_read_chunk_max(config.read_chunk_max);
+				ini_.set_direct_io_threshold(config.direct_io_threshold);
+				ini_.set_direct_io_streams(config.direct_io_streams);
+				ini_.set_early_hints_prefetch(config.early_hints_prefetch);
 
 				// スレッド開始
-				if (!http_thread_.run(window_, ip, port, connections)) return -1;
+				if (!http_thread_.run(window_, config)) return -1;
 			}
 
 			// タイマー設定
@@ -192,6 +259,7 @@ namespace app
 		{
 			if (_wparam == 1)
 			{
+				http_thread_.tick();
 				return 0;
 			}
 		}
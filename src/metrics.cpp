@@ -0,0 +1,210 @@
+﻿#include "metrics.hpp"
+
+#include <charconv>
+
+#include <psapi.h>
+
+#pragma comment(lib, "psapi.lib")
+
+namespace {
+
+	const std::array<std::pair<const char*, double>, 5> latency_quantiles = {{
+		{"0.5", 0.5},
+		{"0.9", 0.9},
+		{"0.99", 0.99},
+		{"0.999", 0.999},
+		{"1", 1.0}
+	}};
+
+	// FILETIMEは100ナノ秒単位
+	uint64_t filetime_to_usec(const FILETIME& _ft)
+	{
+		return ((static_cast<uint64_t>(_ft.dwHighDateTime) << 32) | _ft.dwLowDateTime) / 10;
+	}
+
+}
+
+
+namespace app {
+
+	uint64_t latency_usec(int64_t _ticks) noexcept
+	{
+		static const int64_t freq = [] {
+			LARGE_INTEGER f;
+			::QueryPerformanceFrequency(&f);
+			return f.QuadPart;
+		}();
+
+		if (_ticks <= 0) return 0;
+		return static_cast<uint64_t>(_ticks / freq * 1000000 + _ticks % freq * 1000000 / freq);
+	}
+
+	metrics_registry::metrics_registry()
+		: mutex_()
+		, threads_()
+	{
+	}
+
+	metrics_registry& metrics_registry::instance()
+	{
+		static metrics_registry registry;
+		return registry;
+	}
+
+	// 初回だけ登録する。以降はスレッドローカルのポインタを返すだけ
+	thread_metrics& metrics_registry::local()
+	{
+		thread_local thread_metrics* metrics = nullptr;
+		if (metrics == nullptr)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			threads_.push_back(std::make_unique<thread_metrics>());
+			metrics = threads_.back().get();
+		}
+		return *metrics;
+	}
+
+	metric_values metrics_registry::snapshot()
+	{
+		metric_values r = {};
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (const auto& x : threads_)
+		{
+			for (size_t i = 0; i < METRIC_COUNT; ++i)
+			{
+				r.at(i) += x->values.at(i).load(std::memory_order_relaxed);
+			}
+		}
+		return r;
+	}
+
+	// 区間ごとに全スレッドのヒストグラムを合算する
+	void metrics_registry::latency(latency_values& _values)
+	{
+		for (auto& x : _values)
+		{
+			x.counts.fill(0);
+			x.count = 0;
+			x.sum = 0;
+			x.max = 0;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (const auto& x : threads_)
+		{
+			for (size_t i = 0; i < PHASE_COUNT; ++i)
+			{
+				x->latency.at(i).merge_into(_values.at(i));
+			}
+		}
+	}
+
+	void write_metric_header(std::string& _out, const char* _name, const char* _type, const char* _help)
+	{
+		_out.append("# HELP ").append(_name).append(" ").append(_help).append("\n");
+		_out.append("# TYPE ").append(_name).append(" ").append(_type).append("\n");
+	}
+
+	void write_metric_value(std::string& _out, const char* _name, const char* _labels, uint64_t _value)
+	{
+		std::array<char, 24> buf;
+		auto [end, ec] = std::to_chars(buf.data(), buf.data() + buf.size(), _value);
+
+		_out.append(_name);
+		if (_labels != nullptr) _out.append("{").append(_labels).append("}");
+		_out.append(" ").append(buf.data(), end).append("\n");
+	}
+
+	void write_metric(std::string& _out, const char* _name, const char* _type, const char* _help, uint64_t _value)
+	{
+		write_metric_header(_out, _name, _type, _help);
+		write_metric_value(_out, _name, nullptr, _value);
+	}
+
+	void write_metrics(std::string& _out, const metric_values& _values)
+	{
+		write_metric_header(_out, "httpserver_requests_total", "counter", "Responses sent, by status code.");
+		write_metric_value(_out, "httpserver_requests_total", "status=\"200\"", _values.at(METRIC_REQUESTS_200));
+		write_metric_value(_out, "httpserver_requests_total", "status=\"400\"", _values.at(METRIC_REQUESTS_400));
+		write_metric_value(_out, "httpserver_requests_total", "status=\"404\"", _values.at(METRIC_REQUESTS_404));
+		write_metric_value(_out, "httpserver_requests_total", "status=\"405\"", _values.at(METRIC_REQUESTS_405));
+		write_metric_value(_out, "httpserver_requests_total", "status=\"429\"", _values.at(METRIC_REQUESTS_429));
+		write_metric_value(_out, "httpserver_requests_total", "status=\"505\"", _values.at(METRIC_REQUESTS_505));
+
+		write_metric(_out, "httpserver_early_hints_total", "counter", "103 Early Hints responses sent.", _values.at(METRIC_EARLY_HINTS));
+		write_metric(_out, "httpserver_sent_bytes_total", "counter", "Bytes sent to clients.", _values.at(METRIC_BYTES_SENT));
+
+		write_metric_header(_out, "httpserver_notfound_cache_lookups_total", "counter", "Not-found cache lookups, by result.");
+		write_metric_value(_out, "httpserver_notfound_cache_lookups_total", "result=\"hit\"", _values.at(METRIC_NOTFOUND_CACHE_HITS));
+		write_metric_value(_out, "httpserver_notfound_cache_lookups_total", "result=\"miss\"", _values.at(METRIC_NOTFOUND_CACHE_MISSES));
+
+		write_metric(_out, "httpserver_file_opens_total", "counter", "Files opened for responses.", _values.at(METRIC_FILE_OPENS));
+		write_metric(_out, "httpserver_shaped_bytes_total", "counter", "Body bytes sent under a bandwidth limit.", _values.at(METRIC_SHAPED_BYTES));
+		write_metric(_out, "httpserver_throttle_waits_total", "counter", "Body sends held back until the bandwidth limit refilled.", _values.at(METRIC_THROTTLE_WAITS));
+		write_metric(_out, "httpserver_send_deferrals_total", "counter", "Body sends deferred to the next loop turn after a connection used its quantum.", _values.at(METRIC_SEND_DEFERRALS));
+	}
+
+	void write_latency(std::string& _out, const latency_values& _values)
+	{
+		const char* name = "httpserver_request_phase_microseconds";
+		write_metric_header(_out, name, "summary", "Request latency by phase.");
+
+		std::string labels;
+		for (size_t i = 0; i < PHASE_COUNT; ++i)
+		{
+			const auto& h = _values.at(i);
+			const char* phase = latency_phase_name(static_cast<latency_phase>(i));
+			for (const auto& [label, q] : latency_quantiles)
+			{
+				labels.assign("phase=\"").append(phase).append("\",quantile=\"").append(label).append("\"");
+				write_metric_value(_out, name, labels.c_str(), h.percentile(q));
+			}
+			labels.assign("phase=\"").append(phase).append("\"");
+			write_metric_value(_out, "httpserver_request_phase_microseconds_sum", labels.c_str(), h.sum);
+			write_metric_value(_out, "httpserver_request_phase_microseconds_count", labels.c_str(), h.count);
+		}
+	}
+
+	// プロセス全体の資源使用量。regress.ps1がシナリオの前後で取得して1リクエストあたりの値を求める
+	void write_process_metrics(std::string& _out)
+	{
+		auto process = ::GetCurrentProcess();
+
+		PROCESS_MEMORY_COUNTERS memory = {};
+		if (::GetProcessMemoryInfo(process, &memory, sizeof(memory)))
+		{
+			write_metric(_out, "process_resident_memory_bytes", "gauge", "Working set size in bytes.", memory.WorkingSetSize);
+			write_metric(_out, "process_resident_memory_peak_bytes", "gauge", "Peak working set size in bytes.", memory.PeakWorkingSetSize);
+			write_metric(_out, "process_page_faults_total", "counter", "Page faults.", memory.PageFaultCount);
+		}
+
+		FILETIME creation, exit, kernel, user;
+		if (::GetProcessTimes(process, &creation, &exit, &kernel, &user))
+		{
+			write_metric_header(_out, "process_cpu_microseconds_total", "counter", "CPU time consumed, by mode.");
+			write_metric_value(_out, "process_cpu_microseconds_total", "mode=\"kernel\"", filetime_to_usec(kernel));
+			write_metric_value(_out, "process_cpu_microseconds_total", "mode=\"user\"", filetime_to_usec(user));
+		}
+
+		DWORD handles = 0;
+		if (::GetProcessHandleCount(process, &handles))
+		{
+			write_metric(_out, "process_open_handles", "gauge", "Open kernel handles.", handles);
+		}
+
+		// ファイルとソケットのI/Oを合わせた回数。リクエスト数で割れば1件あたりのI/O呼び出しになる
+		IO_COUNTERS io = {};
+		if (::GetProcessIoCounters(process, &io))
+		{
+			write_metric_header(_out, "process_io_operations_total", "counter", "I/O operations issued, by kind.");
+			write_metric_value(_out, "process_io_operations_total", "kind=\"read\"", io.ReadOperationCount);
+			write_metric_value(_out, "process_io_operations_total", "kind=\"write\"", io.WriteOperationCount);
+			write_metric_value(_out, "process_io_operations_total", "kind=\"other\"", io.OtherOperationCount);
+			write_metric_header(_out, "process_io_bytes_total", "counter", "I/O bytes transferred, by kind.");
+			write_metric_value(_out, "process_io_bytes_total", "kind=\"read\"", io.ReadTransferCount);
+			write_metric_value(_out, "process_io_bytes_total", "kind=\"write\"", io.WriteTransferCount);
+			write_metric_value(_out, "process_io_bytes_total", "kind=\"other\"", io.OtherTransferCount);
+		}
+	}
+}
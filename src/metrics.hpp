@@ -0,0 +1,97 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include "latency_histogram.hpp"
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace app {
+
+	enum metric_id : size_t {
+		METRIC_REQUESTS_200,
+		METRIC_REQUESTS_400,
+		METRIC_REQUESTS_404,
+		METRIC_REQUESTS_405,
+		METRIC_REQUESTS_429,
+		METRIC_REQUESTS_505,
+		METRIC_EARLY_HINTS,
+		METRIC_BYTES_SENT,
+		METRIC_NOTFOUND_CACHE_HITS,
+		METRIC_NOTFOUND_CACHE_MISSES,
+		METRIC_FILE_OPENS,
+		METRIC_SEND_DEFERRALS,
+		METRIC_SHAPED_BYTES,
+		METRIC_THROTTLE_WAITS,
+		METRIC_COUNT
+	};
+
+	using metric_values = std::array<uint64_t, METRIC_COUNT>;
+	using latency_values = std::array<latency_snapshot, PHASE_COUNT>;
+
+	// 区間計測用の時刻。QueryPerformanceCounter()はTSCが使える環境ではrdtsc相当で読める
+	inline int64_t latency_now() noexcept
+	{
+		LARGE_INTEGER now;
+		::QueryPerformanceCounter(&now);
+		return now.QuadPart;
+	}
+
+	uint64_t latency_usec(int64_t _ticks) noexcept;
+
+	// スレッドごとのカウンタ。書くのは持ち主のスレッドだけなのでロック命令は使わない
+	// 他のスレッドのカウンタと同じキャッシュラインに載らないように揃える
+	struct alignas(64) thread_metrics {
+		std::array<std::atomic<uint64_t>, METRIC_COUNT> values;
+		std::array<latency_histogram, PHASE_COUNT> latency;
+
+		void add(metric_id _id, uint64_t _n = 1) noexcept
+		{
+			auto& v = values[_id];
+			v.store(v.load(std::memory_order_relaxed) + _n, std::memory_order_relaxed);
+		}
+
+		void record(latency_phase _phase, int64_t _start, int64_t _end) noexcept
+		{
+			latency[_phase].record(latency_usec(_end - _start));
+		}
+	};
+
+	// スレッドごとのカウンタを束ねる。合算は取得時だけ行う
+	class metrics_registry
+	{
+	private:
+		std::mutex mutex_;
+		std::vector<std::unique_ptr<thread_metrics>> threads_;
+
+		metrics_registry();
+
+	public:
+		// コピー不可
+		metrics_registry(const metrics_registry&) = delete;
+		metrics_registry& operator = (const metrics_registry&) = delete;
+		// ムーブ不可
+		metrics_registry(metrics_registry&&) = delete;
+		metrics_registry& operator = (metrics_registry&&) = delete;
+
+		static metrics_registry& instance();
+
+		thread_metrics& local();
+		metric_values snapshot();
+		void latency(latency_values& _values);
+	};
+
+	// Prometheusのテキスト形式で書き出す
+	void write_metric(std::string& _out, const char* _name, const char* _type, const char* _help, uint64_t _value);
+	void write_metric_header(std::string& _out, const char* _name, const char* _type, const char* _help);
+	void write_metric_value(std::string& _out, const char* _name, const char* _labels, uint64_t _value);
+	void write_metrics(std::string& _out, const metric_values& _values);
+	void write_latency(std::string& _out, const latency_values& _values);
+	void write_process_metrics(std::string& _out);
+}
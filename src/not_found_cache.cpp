@@ -0,0 +1,170 @@
+﻿#include "not_found_cache.hpp"
+
+#include "log.hpp"
+
+namespace {
+	constexpr auto NOTIFY_BUFFER_SIZE = 16 * 1024; // 16KB
+}
+
+namespace app {
+
+	not_found_cache::not_found_cache(size_t _capacity)
+		: capacity_(_capacity)
+		, set_()
+		, ring_(_capacity)
+		, next_(0)
+		, generation_(0)
+		, dir_(INVALID_HANDLE_VALUE)
+		, ov_()
+		, notify_buf_(NOTIFY_BUFFER_SIZE / sizeof(DWORD))
+		, stats_()
+	{
+		set_.reserve(_capacity);
+	}
+
+	not_found_cache::~not_found_cache()
+	{
+		if (dir_ != INVALID_HANDLE_VALUE)
+		{
+			::CancelIoEx(dir_, &ov_);
+			::CloseHandle(dir_);
+		}
+	}
+
+	bool not_found_cache::read_changes()
+	{
+		std::memset(&ov_, 0, sizeof(OVERLAPPED));
+		auto rc = ::ReadDirectoryChangesW(dir_, notify_buf_.data(), notify_buf_.size() * sizeof(DWORD), TRUE,
+			FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME, NULL, &ov_, NULL);
+		if (!rc)
+		{
+			log(L"Error: ReadDirectoryChangesW() failed. GetLastError()=%lu", ::GetLastError());
+			return false;
+		}
+		return true;
+	}
+
+	bool not_found_cache::watch(const std::wstring& _dir, HANDLE _compport, ULONG_PTR _compkey)
+	{
+		// 無効時は監視不要
+		if (capacity_ == 0) return true;
+
+		dir_ = ::CreateFileW(_dir.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+		if (dir_ == INVALID_HANDLE_VALUE)
+		{
+			log(L"Error: CreateFileW() failed. GetLastError()=%lu", ::GetLastError());
+			return false;
+		}
+
+		if (::CreateIoCompletionPort(dir_, _compport, _compkey, 0) == NULL)
+		{
+			log(L"Error: CreateIoCompletionPort() failed. GetLastError()=%lu", ::GetLastError());
+			return false;
+		}
+
+		return read_changes();
+	}
+
+	bool not_found_cache::on_change(DWORD _transferred)
+	{
+		bool added = false;
+
+		if (_transferred == 0)
+		{
+			// バッファ溢れ時は何が起きたか分からないので破棄
+			added = true;
+		}
+		else
+		{
+			auto p = reinterpret_cast<const char*>(notify_buf_.data());
+			while (true)
+			{
+				auto info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(p);
+				if (info->Action == FILE_ACTION_ADDED || info->Action == FILE_ACTION_RENAMED_NEW_NAME)
+				{
+					added = true;
+					break;
+				}
+				if (info->NextEntryOffset == 0) break;
+				p += info->NextEntryOffset;
+			}
+		}
+
+		// 削除だけならキャッシュは正しいまま
+		// 空でも世代は進め、追加より前に存在を確かめた404が後から入らないようにする
+		if (added)
+		{
+			auto cached = !set_.empty();
+			clear();
+			if (cached)
+			{
+				stats_.invalidations++;
+				log(L"Info: notfound cache cleared. hits=%llu inserts=%llu evictions=%llu", stats_.hits, stats_.inserts, stats_.evictions);
+			}
+		}
+
+		return read_changes();
+	}
+
+	bool not_found_cache::contains(std::string_view _path)
+	{
+		if (capacity_ == 0) return false;
+
+		if (set_.contains(_path))
+		{
+			stats_.hits++;
+			return true;
+		}
+		return false;
+	}
+
+	uint64_t not_found_cache::generation() const noexcept
+	{
+		return generation_;
+	}
+
+	void not_found_cache::insert(std::string_view _path, uint64_t _generation)
+	{
+		if (capacity_ == 0 || _generation != generation_) return;
+
+		// 古いものから追い出す
+		auto& slot = ring_.at(next_);
+		if (slot != "")
+		{
+			set_.erase(slot);
+			stats_.evictions++;
+		}
+		slot = _path;
+		set_.insert(slot);
+		next_ = (next_ + 1) % capacity_;
+		stats_.inserts++;
+	}
+
+	void not_found_cache::clear()
+	{
+		set_.clear();
+		for (auto& x : ring_) x.clear();
+		next_ = 0;
+		generation_++;
+	}
+
+	void not_found_cache::disable()
+	{
+		clear();
+		capacity_ = 0;
+
+		if (dir_ != INVALID_HANDLE_VALUE)
+		{
+			::CancelIoEx(dir_, &ov_);
+			::CloseHandle(dir_);
+			dir_ = INVALID_HANDLE_VALUE;
+		}
+	}
+
+	not_found_cache_stats_t not_found_cache::stats() const noexcept
+	{
+		auto r = stats_;
+		r.size = set_.size();
+		return r;
+	}
+}
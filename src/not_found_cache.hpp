@@ -0,0 +1,84 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include "utils.hpp"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_set>
+#include <cstdint>
+
+namespace app {
+
+	struct not_found_cache_stats_t {
+		uint64_t hits;
+		uint64_t inserts;
+		uint64_t evictions;
+		uint64_t invalidations;
+		size_t size;
+	};
+
+	// 存在しないパスのキャッシュ
+	// htdocs配下にファイル/フォルダが追加されたら全破棄する
+	class not_found_cache
+	{
+	private:
+		size_t capacity_;
+		std::unordered_set<std::string, string_hash, std::equal_to<>> set_;
+		std::vector<std::string> ring_;
+		size_t next_;
+		uint64_t generation_; // clear()のたびに増やす
+
+		HANDLE dir_;
+		OVERLAPPED ov_;
+		std::vector<DWORD> notify_buf_;
+
+		not_found_cache_stats_t stats_;
+
+		bool read_changes();
+
+	public:
+		not_found_cache(size_t _capacity);
+		~not_found_cache();
+
+		// コピー不可
+		not_found_cache(const not_found_cache&) = delete;
+		not_found_cache& operator = (const not_found_cache&) = delete;
+		// ムーブ不可
+		not_found_cache(not_found_cache&&) = delete;
+		not_found_cache& operator = (not_found_cache&&) = delete;
+
+		bool watch(const std::wstring& _dir, HANDLE _compport, ULONG_PTR _compkey);
+		bool on_change(DWORD _transferred);
+
+		bool contains(std::string_view _path);
+		// 存在を確かめる前にgeneration()を取っておき、insert()に渡す。その間に消していれば入れない
+		uint64_t generation() const noexcept;
+		void insert(std::string_view _path, uint64_t _generation);
+		void clear();
+		// 変更を監視できなくなったら、古い404を返さないようにキャッシュを止める
+		void disable();
+
+		not_found_cache_stats_t stats() const noexcept;
+	};
+
+	// 404キャッシュ無し。not_found_cacheと同じ呼び出しができる
+	class null_not_found_cache
+	{
+	public:
+		null_not_found_cache(size_t) {}
+
+		bool watch(const std::wstring&, HANDLE, ULONG_PTR) { return true; }
+		bool on_change(DWORD) { return true; }
+
+		bool contains(std::string_view) { return false; }
+		uint64_t generation() const noexcept { return 0; }
+		void insert(std::string_view, uint64_t) {}
+		void clear() {}
+		void disable() {}
+
+		not_found_cache_stats_t stats() const noexcept { return {}; }
+	};
+}
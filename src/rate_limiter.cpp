@@ -0,0 +1,130 @@
+﻿#include "rate_limiter.hpp"
+
+#include <algorithm>
+#include <bit>
+
+namespace {
+	constexpr size_t MAX_PROBE = 8;
+	constexpr int64_t IDLE_SECONDS = 60; // これより長く使われていない枠は再利用する
+}
+
+
+namespace app {
+
+	rate_limiter::rate_limiter(size_t _slots, uint32_t _rate, uint32_t _burst, uint32_t _max_connections)
+		: table_(_rate > 0 || _max_connections > 0 ? std::bit_ceil(std::max<size_t>(_slots, MAX_PROBE)) : 0)
+		, mask_(table_.empty() ? 0 : table_.size() - 1)
+		, shift_(64 - std::countr_zero(std::max<size_t>(table_.size(), 2)))
+		, rate_(_rate)
+		, burst_(std::max(_burst, _rate))
+		, max_connections_(_max_connections)
+		, idle_(qpc_frequency() * IDLE_SECONDS)
+		, stats_()
+	{
+	}
+
+	rate_limiter::~rate_limiter()
+	{
+	}
+
+	bool rate_limiter::enabled() const noexcept
+	{
+		return !table_.empty();
+	}
+
+	// 探索を始める枠。s_addrはネットワークバイトオーダーで下位バイトが先頭のオクテットになるので、
+	// ホスト順に直してから掛けた結果の上位ビットを使う。そうしないと同じ/12のIPが同じ枠に集まる
+	size_t rate_limiter::slot(ULONG _address) const noexcept
+	{
+		auto hash = static_cast<uint64_t>(::ntohl(_address)) * 0x9E3779B97F4A7C15ull;
+		return static_cast<size_t>(hash >> shift_);
+	}
+
+	// 同じIPの枠、無ければ空きか使われなくなった枠を返す
+	rate_limiter::entry* rate_limiter::find(ULONG _address, int64_t _now) noexcept
+	{
+		auto start = slot(_address);
+		entry* candidate = nullptr;
+
+		for (size_t i = 0; i < MAX_PROBE; ++i)
+		{
+			auto& x = table_[(start + i) & mask_];
+			if (x.address == _address) return &x;
+
+			if (candidate == nullptr && (x.address == 0 || (x.active == 0 && _now - std::max(x.connections.last, x.requests.last) > idle_)))
+			{
+				candidate = &x;
+			}
+		}
+
+		if (candidate == nullptr)
+		{
+			stats_.table_full++;
+			return nullptr;
+		}
+
+		if (candidate->address != 0) stats_.reused++;
+		candidate->address = _address;
+		candidate->active = 0;
+		candidate->connections.reset(rate_, burst_, _now);
+		candidate->requests.reset(rate_, burst_, _now);
+		return candidate;
+	}
+
+	bool rate_limiter::connect(ULONG _address, int64_t _now) noexcept
+	{
+		if (table_.empty()) return true;
+
+		auto x = find(_address, _now);
+		if (x == nullptr) return true;
+
+		// 接続を数えるバケットはリクエストと分けるので、RATE_LIMIT=1でも接続した直後のリクエストは通る
+		x->connections.refill(_now);
+		if ((max_connections_ > 0 && x->active >= max_connections_) || !x->connections.ready())
+		{
+			stats_.limited_connections++;
+			return false;
+		}
+		x->connections.take(1);
+		x->active++;
+		return true;
+	}
+
+	void rate_limiter::disconnect(ULONG _address) noexcept
+	{
+		if (table_.empty()) return;
+
+		auto start = slot(_address);
+		for (size_t i = 0; i < MAX_PROBE; ++i)
+		{
+			auto& x = table_[(start + i) & mask_];
+			if (x.address == _address)
+			{
+				if (x.active > 0) x.active--;
+				return;
+			}
+		}
+	}
+
+	bool rate_limiter::acquire(ULONG _address, int64_t _now) noexcept
+	{
+		if (table_.empty() || rate_ == 0) return true;
+
+		auto x = find(_address, _now);
+		if (x == nullptr) return true;
+
+		x->requests.refill(_now);
+		if (!x->requests.ready())
+		{
+			stats_.limited_requests++;
+			return false;
+		}
+		x->requests.take(1);
+		return true;
+	}
+
+	rate_limiter_stats_t rate_limiter::stats() const noexcept
+	{
+		return stats_;
+	}
+}
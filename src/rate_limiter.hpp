@@ -0,0 +1,65 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include "token_bucket.hpp"
+
+#include <vector>
+#include <cstdint>
+
+namespace app {
+
+	struct rate_limiter_stats_t {
+		uint64_t limited_requests;
+		uint64_t limited_connections;
+		uint64_t reused; // 使われていない枠を別のIPに回した
+		uint64_t table_full; // 枠が取れずに制限せず通した
+	};
+
+	// 接続元IPごとのトークンバケット。接続とリクエストは別のバケットで数える
+	// 大きさ固定のオープンアドレス法で、確保もロックもしない。イベントループのスレッドからのみ使う
+	// 使われなくなった枠は探索の途中で見つけたときに再利用するので、掃除はしない
+	class rate_limiter
+	{
+	private:
+		struct entry {
+			ULONG address; // 0は空き
+			uint32_t active; // 接続数
+			token_bucket connections;
+			token_bucket requests;
+		};
+
+		std::vector<entry> table_;
+		size_t mask_;
+		int shift_;
+		int64_t rate_;
+		int64_t burst_;
+		uint32_t max_connections_;
+		int64_t idle_;
+		rate_limiter_stats_t stats_;
+
+		size_t slot(ULONG _address) const noexcept;
+		entry* find(ULONG _address, int64_t _now) noexcept;
+
+	public:
+		rate_limiter(size_t _slots, uint32_t _rate, uint32_t _burst, uint32_t _max_connections);
+		~rate_limiter();
+
+		// コピー不可
+		rate_limiter(const rate_limiter&) = delete;
+		rate_limiter& operator = (const rate_limiter&) = delete;
+		// ムーブ不可
+		rate_limiter(rate_limiter&&) = delete;
+		rate_limiter& operator = (rate_limiter&&) = delete;
+
+		bool enabled() const noexcept;
+
+		// 接続の受付。接続数の上限とトークンを見る。通したら接続数を数える
+		bool connect(ULONG _address, int64_t _now) noexcept;
+		void disconnect(ULONG _address) noexcept;
+		// リクエストごと
+		bool acquire(ULONG _address, int64_t _now) noexcept;
+
+		rate_limiter_stats_t stats() const noexcept;
+	};
+}
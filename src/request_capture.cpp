@@ -0,0 +1,239 @@
+﻿#include "request_capture.hpp"
+
+#include "capture_format.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "stall_watchdog.hpp"
+
+#include <cstring>
+
+namespace {
+	constexpr size_t CAPTURE_BUFFER_SIZE = 1024 * 1024; // 1MB
+}
+
+
+namespace app {
+
+	request_capture::request_capture()
+		: file_(INVALID_HANDLE_VALUE)
+		, compport_(NULL)
+		, compkey_(0)
+		, ov_()
+		, buf_()
+		, writing_()
+		, pending_(false)
+		, written_(0)
+		, limit_(0)
+		, records_(0)
+		, dropped_(0)
+		, last_(0)
+	{
+	}
+
+	request_capture::~request_capture()
+	{
+		close();
+	}
+
+	void request_capture::set_completion_port(HANDLE _compport, ULONG_PTR _compkey)
+	{
+		compport_ = _compport;
+		compkey_ = _compkey;
+	}
+
+	bool request_capture::open(const std::wstring& _path, uint32_t _limit_mb)
+	{
+		close();
+
+		DWORD flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN | (compport_ != NULL ? FILE_FLAG_OVERLAPPED : 0);
+		file_ = ::CreateFileW(_path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, flags, NULL);
+		if (file_ == INVALID_HANDLE_VALUE)
+		{
+			log(L"Error: capture CreateFileW() failed. GetLastError()=%lu", ::GetLastError());
+			return false;
+		}
+		if (compport_ != NULL && ::CreateIoCompletionPort(file_, compport_, compkey_, 0) == NULL)
+		{
+			log(L"Error: capture CreateIoCompletionPort() failed. GetLastError()=%lu", ::GetLastError());
+			::CloseHandle(file_);
+			file_ = INVALID_HANDLE_VALUE;
+			return false;
+		}
+
+		buf_.reserve(CAPTURE_BUFFER_SIZE);
+		writing_.reserve(CAPTURE_BUFFER_SIZE);
+		pending_ = false;
+		written_ = 0;
+		limit_ = static_cast<uint64_t>(_limit_mb) * 1024 * 1024;
+		records_ = 0;
+		dropped_ = 0;
+		last_ = latency_now();
+
+		FILETIME now;
+		::GetSystemTimeAsFileTime(&now);
+		append_capture_header(buf_, now);
+		return true;
+	}
+
+	void request_capture::close()
+	{
+		if (file_ == INVALID_HANDLE_VALUE) return;
+
+		// 終了時は書き込み中の分を待ってから残りを同期で書く
+		wait_pending();
+		if (file_ != INVALID_HANDLE_VALUE && write_sync(buf_))
+		{
+			buf_.clear();
+		}
+		if (file_ == INVALID_HANDLE_VALUE) return;
+		::CloseHandle(file_);
+		file_ = INVALID_HANDLE_VALUE;
+		log(L"Info: capture records=%llu dropped=%llu bytes=%llu", records_, dropped_, written_);
+	}
+
+	bool request_capture::is_open() const noexcept
+	{
+		return file_ != INVALID_HANDLE_VALUE;
+	}
+
+	// 上限を超えたら以降は数えるだけ
+	void request_capture::record(uint64_t _id, const char* _data, size_t _size)
+	{
+		if (file_ == INVALID_HANDLE_VALUE) return;
+
+		if (limit_ > 0 && written_ + buf_.size() + _size + CAPTURE_RECORD_OVERHEAD > limit_)
+		{
+			dropped_++;
+			return;
+		}
+
+		// 前の書き込みがまだ終わっていなければ入れ替えられないので捨てる
+		if (buf_.size() + _size + CAPTURE_RECORD_OVERHEAD > CAPTURE_BUFFER_SIZE && (!flush_buffer() || !buf_.empty()))
+		{
+			dropped_++;
+			return;
+		}
+
+		auto now = latency_now();
+		append_capture_record(buf_, latency_usec(now - last_), _id, _data, _size);
+		last_ = now;
+		records_++;
+	}
+
+	// 書き込み中なら何もせずtrueを返す。溜まった分は次の機会に書く
+	bool request_capture::flush_buffer()
+	{
+		if (buf_.empty() || pending_) return true;
+
+		if (compport_ == NULL)
+		{
+			if (!write_sync(buf_)) return false;
+			buf_.clear();
+			return true;
+		}
+
+		// 溜めたバッファを書き込み用と入れ替え、空いた方に続きを溜める
+		writing_.swap(buf_);
+		buf_.clear();
+		std::memset(&ov_, 0, sizeof(OVERLAPPED));
+		ov_.Offset = written_ & 0xffffffff;
+		ov_.OffsetHigh = (written_ >> 32) & 0xffffffff;
+		BOOL rc;
+		{
+			stall_call_scope scope(CALL_WRITE_FILE);
+			rc = ::WriteFile(file_, writing_.data(), static_cast<DWORD>(writing_.size()), NULL, &ov_);
+		}
+		auto error = rc ? ERROR_SUCCESS : ::GetLastError();
+		if (error != ERROR_SUCCESS && error != ERROR_IO_PENDING)
+		{
+			fail(error);
+			return false;
+		}
+
+		// 同期で終わっても完了は届く
+		pending_ = true;
+		return true;
+	}
+
+	bool request_capture::write_sync(const std::vector<char>& _buf)
+	{
+		if (_buf.empty()) return true;
+
+		OVERLAPPED ov = {};
+		ov.Offset = written_ & 0xffffffff;
+		ov.OffsetHigh = (written_ >> 32) & 0xffffffff;
+		DWORD written = 0;
+		BOOL rc;
+		{
+			stall_call_scope scope(CALL_WRITE_FILE);
+			rc = ::WriteFile(file_, _buf.data(), static_cast<DWORD>(_buf.size()), &written, compport_ != NULL ? &ov : NULL);
+			if (!rc && compport_ != NULL && ::GetLastError() == ERROR_IO_PENDING)
+			{
+				rc = ::GetOverlappedResult(file_, &ov, &written, TRUE);
+			}
+		}
+		if (!rc)
+		{
+			fail(::GetLastError());
+			return false;
+		}
+		written_ += written;
+		return true;
+	}
+
+	void request_capture::wait_pending()
+	{
+		if (!pending_) return;
+
+		DWORD written = 0;
+		if (!::GetOverlappedResult(file_, &ov_, &written, TRUE))
+		{
+			fail(::GetLastError());
+			return;
+		}
+		written_ += written;
+		writing_.clear();
+		pending_ = false;
+	}
+
+	void request_capture::fail(DWORD _error)
+	{
+		log(L"Error: capture WriteFile() failed. GetLastError()=%lu", _error);
+		::CloseHandle(file_);
+		file_ = INVALID_HANDLE_VALUE;
+		buf_.clear();
+		writing_.clear();
+		pending_ = false;
+	}
+
+	void request_capture::on_write(DWORD _error, DWORD _transferred)
+	{
+		// close()で待ち終えた分
+		if (!pending_ || file_ == INVALID_HANDLE_VALUE) return;
+
+		if (_error != ERROR_SUCCESS)
+		{
+			fail(_error);
+			return;
+		}
+		written_ += _transferred;
+		writing_.clear();
+		pending_ = false;
+	}
+
+	void request_capture::flush()
+	{
+		if (file_ == INVALID_HANDLE_VALUE) return;
+		flush_buffer();
+	}
+
+	uint64_t request_capture::records() const noexcept
+	{
+		return records_;
+	}
+
+	uint64_t request_capture::dropped() const noexcept
+	{
+		return dropped_;
+	}
+}
@@ -0,0 +1,59 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace app {
+
+	// 受信したリクエストヘッダを時刻付きでファイルに記録する(形式はcapture_format.hpp)
+	// 書き込みはバッファに溜めてタイマーかバッファが一杯になったときに行う
+	// 完了ポートがあれば書き込み中のバッファと入れ替えて非同期に書き、イベントループを待たせない
+	class request_capture
+	{
+	private:
+		HANDLE file_;
+		HANDLE compport_;
+		ULONG_PTR compkey_;
+		OVERLAPPED ov_;
+		std::vector<char> buf_;
+		std::vector<char> writing_; // 書き込み中。完了するまで触らない
+		bool pending_;
+		uint64_t written_;
+		uint64_t limit_;
+		uint64_t records_;
+		uint64_t dropped_;
+		int64_t last_;
+
+		bool flush_buffer();
+		bool write_sync(const std::vector<char>& _buf);
+		void wait_pending();
+		void fail(DWORD _error);
+
+	public:
+		request_capture();
+		~request_capture();
+
+		// コピー不可
+		request_capture(const request_capture&) = delete;
+		request_capture& operator = (const request_capture&) = delete;
+		// ムーブ不可
+		request_capture(request_capture&&) = delete;
+		request_capture& operator = (request_capture&&) = delete;
+
+		// open()より前に呼ぶ。呼ばなければ同期で書く
+		void set_completion_port(HANDLE _compport, ULONG_PTR _compkey);
+		bool open(const std::wstring& _path, uint32_t _limit_mb);
+		void close();
+		bool is_open() const noexcept;
+
+		void record(uint64_t _id, const char* _data, size_t _size);
+		void flush();
+		void on_write(DWORD _error, DWORD _transferred);
+
+		uint64_t records() const noexcept;
+		uint64_t dropped() const noexcept;
+	};
+}
@@ -0,0 +1,164 @@
+﻿#include "stall_watchdog.hpp"
+
+#include "log.hpp"
+#include "metrics.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+
+namespace {
+
+	thread_local app::stall_watchdog* current_watchdog = nullptr;
+
+	constexpr size_t max_pending = 64;
+
+	int64_t ms_to_ticks(uint32_t _ms)
+	{
+		LARGE_INTEGER freq;
+		::QueryPerformanceFrequency(&freq);
+		return freq.QuadPart * _ms / 1000;
+	}
+
+}
+
+
+namespace app {
+
+	const char* stall_call_name(stall_call _call) noexcept
+	{
+		switch (_call)
+		{
+		case CALL_NONE: return "none";
+		case CALL_CREATE_FILE: return "CreateFileW";
+		case CALL_GET_FILE_ATTRIBUTES: return "GetFileAttributesW";
+		case CALL_ASSOCIATE_PORT: return "CreateIoCompletionPort";
+		case CALL_LOG: return "log";
+		case CALL_WRITE_FILE: return "WriteFile";
+		default: return "unknown";
+		}
+	}
+
+	const char* stall_handler_name(size_t _handler) noexcept
+	{
+		switch (_handler)
+		{
+		case 0: return "operation";
+		case 1: return "accept";
+		case 2: return "socket";
+		case 3: return "file_read";
+		case 4: return "dir_change";
+		case 5: return "prefetch";
+		case 6: return "file_open";
+		case 7: return "capture";
+		default: return "unknown";
+		}
+	}
+
+	stall_watchdog::stall_watchdog(uint32_t _threshold_ms)
+		: threshold_(ms_to_ticks(_threshold_ms))
+		, handler_(0)
+		, start_(0)
+		, call_(CALL_NONE)
+		, call_ticks_(0)
+		, stats_()
+		, pending_()
+		, dropped_(0)
+	{
+		pending_.reserve(max_pending);
+		if (_threshold_ms > 0 && current_watchdog == nullptr)
+		{
+			current_watchdog = this;
+		}
+	}
+
+	stall_watchdog::~stall_watchdog()
+	{
+		if (current_watchdog == this)
+		{
+			current_watchdog = nullptr;
+		}
+	}
+
+	void stall_watchdog::begin(size_t _handler) noexcept
+	{
+		if (current_watchdog != this) return;
+
+		handler_ = std::min(_handler, STALL_HANDLERS - 1);
+		start_ = latency_now();
+		call_ = CALL_NONE;
+		call_ticks_ = 0;
+	}
+
+	// しきい値を超えた記録はログに出さずに溜めておく。ここでログを書くとそれ自体が止まる
+	void stall_watchdog::end() noexcept
+	{
+		if (start_ == 0) return;
+
+		auto ticks = latency_now() - start_;
+		start_ = 0;
+
+		auto usec = latency_usec(ticks);
+		stats_.iterations++;
+		stats_.max_usec = std::max(stats_.max_usec, usec);
+		if (ticks < threshold_) return;
+
+		stats_.stalls++;
+		stats_.by_handler.at(handler_)++;
+		stats_.by_call.at(call_)++;
+		if (pending_.size() < max_pending)
+		{
+			pending_.push_back({ handler_, call_, usec, latency_usec(call_ticks_) });
+		}
+		else
+		{
+			dropped_++;
+		}
+	}
+
+	void stall_watchdog::on_call(stall_call _call, int64_t _ticks) noexcept
+	{
+		if (start_ == 0 || _ticks <= call_ticks_) return;
+		call_ = _call;
+		call_ticks_ = _ticks;
+	}
+
+	void stall_watchdog::report()
+	{
+		for (const auto& x : pending_)
+		{
+			log(L"Error: event loop stalled %lluus in %s (longest call %s %lluus)", x.usec,
+				s_to_ws(stall_handler_name(x.handler)).c_str(), s_to_ws(stall_call_name(x.call)).c_str(), x.call_usec);
+		}
+		if (dropped_ > 0)
+		{
+			log(L"Error: %llu more stalls not shown", dropped_);
+		}
+		pending_.clear();
+		dropped_ = 0;
+	}
+
+	stall_stats_t stall_watchdog::stats() const noexcept
+	{
+		return stats_;
+	}
+
+	stall_watchdog* stall_watchdog::current() noexcept
+	{
+		return current_watchdog;
+	}
+
+	stall_call_scope::stall_call_scope(stall_call _call) noexcept
+		: watchdog_(current_watchdog)
+		, call_(_call)
+		, start_(watchdog_ != nullptr ? latency_now() : 0)
+	{
+	}
+
+	stall_call_scope::~stall_call_scope()
+	{
+		if (watchdog_ != nullptr)
+		{
+			watchdog_->on_call(call_, latency_now() - start_);
+		}
+	}
+}
@@ -0,0 +1,99 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include <array>
+#include <vector>
+#include <cstdint>
+
+namespace app {
+
+	// イベントループを止めうる同期呼び出し
+	enum stall_call : size_t {
+		CALL_NONE,
+		CALL_CREATE_FILE,
+		CALL_GET_FILE_ATTRIBUTES,
+		CALL_ASSOCIATE_PORT,
+		CALL_LOG,
+		CALL_WRITE_FILE,
+		CALL_COUNT
+	};
+
+	// 完了の処理。添字は完了キー
+	constexpr size_t STALL_HANDLERS = 8;
+
+	const char* stall_call_name(stall_call _call) noexcept;
+	const char* stall_handler_name(size_t _handler) noexcept;
+
+	struct stall_record_t {
+		size_t handler;
+		stall_call call; // 処理中で最も長かった同期呼び出し
+		uint64_t usec;
+		uint64_t call_usec;
+	};
+
+	struct stall_stats_t {
+		uint64_t iterations;
+		uint64_t stalls;
+		uint64_t max_usec;
+		std::array<uint64_t, STALL_HANDLERS> by_handler;
+		std::array<uint64_t, CALL_COUNT> by_call;
+	};
+
+	// 完了1件の処理時間を測り、しきい値を超えたものを原因と一緒に残す
+	// 測るのは作ったスレッドだけ
+	class stall_watchdog
+	{
+	private:
+		int64_t threshold_;
+		size_t handler_;
+		int64_t start_;
+		stall_call call_;
+		int64_t call_ticks_;
+		stall_stats_t stats_;
+		std::vector<stall_record_t> pending_;
+		uint64_t dropped_;
+
+	public:
+		stall_watchdog(uint32_t _threshold_ms);
+		~stall_watchdog();
+
+		// コピー不可
+		stall_watchdog(const stall_watchdog&) = delete;
+		stall_watchdog& operator = (const stall_watchdog&) = delete;
+		// ムーブ不可
+		stall_watchdog(stall_watchdog&&) = delete;
+		stall_watchdog& operator = (stall_watchdog&&) = delete;
+
+		void begin(size_t _handler) noexcept;
+		void end() noexcept;
+		void on_call(stall_call _call, int64_t _ticks) noexcept;
+
+		// 溜まった記録をログに出す。ループの外(タイマー)から呼ぶ
+		void report();
+		stall_stats_t stats() const noexcept;
+
+		// 測定中のスレッドのwatchdog。無効ならnullptr
+		static stall_watchdog* current() noexcept;
+	};
+
+	// 同期呼び出しを囲んで時間を測る
+	class stall_call_scope
+	{
+	private:
+		stall_watchdog* watchdog_;
+		stall_call call_;
+		int64_t start_;
+
+	public:
+		explicit stall_call_scope(stall_call _call) noexcept;
+		~stall_call_scope();
+
+		// コピー不可
+		stall_call_scope(const stall_call_scope&) = delete;
+		stall_call_scope& operator = (const stall_call_scope&) = delete;
+		// ムーブ不可
+		stall_call_scope(stall_call_scope&&) = delete;
+		stall_call_scope& operator = (stall_call_scope&&) = delete;
+	};
+}
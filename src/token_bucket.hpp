@@ -0,0 +1,81 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace app {
+
+	inline int64_t qpc_frequency() noexcept
+	{
+		static const int64_t freq = [] {
+			LARGE_INTEGER f;
+			::QueryPerformanceFrequency(&f);
+			return f.QuadPart;
+		}();
+		return freq;
+	}
+
+	// トークンバケット。時刻はQueryPerformanceCounter()の値
+	// 使った分は後から引くので残量は負になりうる。負の間は使えない
+	struct token_bucket {
+		int64_t rate = 0; // 1秒あたりの補充量。0は無制限
+		int64_t burst = 0; // 溜められる上限
+		int64_t tokens = 0;
+		int64_t last = 0;
+
+		void reset(int64_t _rate, int64_t _burst, int64_t _now) noexcept
+		{
+			rate = _rate;
+			burst = std::max<int64_t>(_burst, 1);
+			tokens = burst;
+			last = _now;
+		}
+
+		void refill(int64_t _now) noexcept
+		{
+			if (rate == 0) return;
+
+			auto freq = qpc_frequency();
+			auto elapsed = _now - last;
+			if (elapsed <= 0) return;
+
+			// 長く空いたときは掛け算があふれる前に満タンにする
+			if (elapsed >= freq * 60)
+			{
+				tokens = burst;
+				last = _now;
+				return;
+			}
+
+			auto add = elapsed * rate / freq;
+			if (add <= 0) return;
+
+			tokens += add;
+			last += add * freq / rate;
+			if (tokens >= burst)
+			{
+				tokens = burst;
+				last = _now;
+			}
+		}
+
+		bool ready() const noexcept
+		{
+			return rate == 0 || tokens > 0;
+		}
+
+		void take(int64_t _n) noexcept
+		{
+			if (rate != 0) tokens -= _n;
+		}
+
+		// 使えるようになるまでの時間(QPCの単位)
+		int64_t wait() const noexcept
+		{
+			if (ready()) return 0;
+			return (1 - tokens) * qpc_frequency() / rate + 1;
+		}
+	};
+}
@@ -0,0 +1,132 @@
+﻿#include "trace.hpp"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+
+namespace {
+
+	thread_local app::trace_ring* current_ring = nullptr;
+
+	std::mutex rings_mutex;
+	std::vector<std::unique_ptr<app::trace_ring>> rings;
+
+	int64_t get_qpc_freq() noexcept
+	{
+		static const int64_t freq = [] {
+			LARGE_INTEGER f;
+			::QueryPerformanceFrequency(&f);
+			return f.QuadPart;
+		}();
+		return freq;
+	}
+
+	// traceの時刻はマイクロ秒。小数点以下3桁まで出す
+	void append_usec(std::string& _out, int64_t _ticks)
+	{
+		auto freq = get_qpc_freq();
+		auto nsec = _ticks / freq * 1000000000 + _ticks % freq * 1000000000 / freq;
+
+		std::array<char, 24> buf;
+		auto [end, ec] = std::to_chars(buf.data(), buf.data() + buf.size(), nsec / 1000);
+		_out.append(buf.data(), end).append(".");
+
+		auto frac = nsec % 1000;
+		_out += static_cast<char>('0' + frac / 100);
+		_out += static_cast<char>('0' + frac / 10 % 10);
+		_out += static_cast<char>('0' + frac % 10);
+	}
+
+	void append_uint(std::string& _out, uint64_t _value)
+	{
+		std::array<char, 24> buf;
+		auto [end, ec] = std::to_chars(buf.data(), buf.data() + buf.size(), _value);
+		_out.append(buf.data(), end);
+	}
+
+}
+
+
+namespace app {
+
+	trace_ring::trace_ring(size_t _capacity)
+		: events_(_capacity)
+		, written_(0)
+		, thread_id_(::GetCurrentThreadId())
+	{
+	}
+
+	trace_ring::~trace_ring()
+	{
+	}
+
+	void trace_ring::write_json(std::string& _out, bool& _first) const
+	{
+		auto count = std::min<uint64_t>(written_, events_.size());
+		for (uint64_t i = written_ - count; i < written_; ++i)
+		{
+			const auto& e = events_[i % events_.size()];
+
+			_out.append(_first ? "\n" : ",\n");
+			_first = false;
+			_out.append("{\"name\":\"").append(e.name).append("\",\"cat\":\"httpserver\",\"ph\":\"");
+			_out.append(e.duration > 0 ? "X" : "i");
+			_out.append("\",\"pid\":1,\"tid\":");
+			append_uint(_out, thread_id_);
+			_out.append(",\"ts\":");
+			append_usec(_out, e.start);
+			if (e.duration > 0)
+			{
+				_out.append(",\"dur\":");
+				append_usec(_out, e.duration);
+			}
+			else
+			{
+				_out.append(",\"s\":\"t\"");
+			}
+			_out.append(",\"args\":{\"id\":");
+			append_uint(_out, e.id);
+			_out.append(",\"bytes\":");
+			append_uint(_out, e.bytes);
+			_out.append("}}");
+		}
+	}
+
+	trace_ring* trace_ring::current() noexcept
+	{
+		return current_ring;
+	}
+
+	void trace_ring::attach(size_t _capacity)
+	{
+		if (_capacity == 0 || current_ring != nullptr) return;
+
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		rings.push_back(std::make_unique<trace_ring>(_capacity));
+		current_ring = rings.back().get();
+	}
+
+	// 書き出し中のリングを消さないように、ロックを取ってから外す
+	void trace_ring::detach()
+	{
+		if (current_ring == nullptr) return;
+
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		std::erase_if(rings, [](const auto& _ring) { return _ring.get() == current_ring; });
+		current_ring = nullptr;
+	}
+
+	// リングは排他しないので、記録しているスレッドから呼ぶこと
+	void write_trace(std::string& _out)
+	{
+		bool first = true;
+		_out.append("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		for (const auto& x : rings)
+		{
+			x->write_json(_out, first);
+		}
+		_out.append("\n]}\n");
+	}
+}
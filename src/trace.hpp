@@ -0,0 +1,56 @@
+﻿#pragma once
+
+#include "common.hpp"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace app {
+
+	struct trace_event_t {
+		const char* name; // 静的な文字列のみ
+		uint64_t id; // ソケットなど
+		int64_t start; // QueryPerformanceCounter()
+		int64_t duration; // 0は瞬間のイベント
+		uint64_t bytes;
+	};
+
+	// スレッドごとのリングバッファ。古いイベントから上書きする
+	class trace_ring
+	{
+	private:
+		std::vector<trace_event_t> events_;
+		uint64_t written_;
+		DWORD thread_id_;
+
+	public:
+		trace_ring(size_t _capacity);
+		~trace_ring();
+
+		// コピー不可
+		trace_ring(const trace_ring&) = delete;
+		trace_ring& operator = (const trace_ring&) = delete;
+		// ムーブ不可
+		trace_ring(trace_ring&&) = delete;
+		trace_ring& operator = (trace_ring&&) = delete;
+
+		void push(const trace_event_t& _event) noexcept
+		{
+			events_[written_++ % events_.size()] = _event;
+		}
+
+		void write_json(std::string& _out, bool& _first) const;
+
+		// 記録中のスレッドのリング。記録しない場合はnullptr
+		static trace_ring* current() noexcept;
+		// このスレッドで記録を始める。_capacityが0なら何もしない
+		static void attach(size_t _capacity);
+		static void detach();
+	};
+
+	// 全スレッドのリングをChromeのtrace形式(JSON)で書き出す。Perfettoで読める
+	void write_trace(std::string& _out);
+}
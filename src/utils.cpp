@@ -1,13 +1,13 @@
 ﻿#include "utils.hpp"
 
 namespace app {
-	std::wstring s_to_ws(const std::string& _s)
+	std::wstring s_to_ws(std::string_view _s)
 	{
 		auto ilen = _s.length();
-		auto olen = ::MultiByteToWideChar(CP_UTF8, 0, _s.c_str(), ilen, 0, 0);
+		auto olen = ::MultiByteToWideChar(CP_UTF8, 0, _s.data(), ilen, 0, 0);
 		std::vector<wchar_t> r(olen + 1, L'\0');
 		if (olen)
-			::MultiByteToWideChar(CP_UTF8, 0, _s.c_str(), ilen, r.data(), olen);
+			::MultiByteToWideChar(CP_UTF8, 0, _s.data(), ilen, r.data(), olen);
 		return r.data();
 	}
 
@@ -20,4 +20,30 @@ namespace app {
 			::WideCharToMultiByte(CP_UTF8, 0, _ws.c_str(), ilen, r.data(), olen, NULL, FALSE);
 		return r.data();
 	}
+
+	std::wstring absolute_path_to_winpath(const std::string& _path)
+	{
+		std::wstring r = s_to_ws(_path);
+		for (auto& c : r)
+		{
+			if (c == L'/') c = L'\\';
+		}
+		return r;
+	}
+
+	// 一時文字列を作らずに_dstの後ろへ変換する
+	void append_winpath(std::pmr::wstring& _dst, std::string_view _path)
+	{
+		auto ilen = static_cast<int>(_path.size());
+		auto olen = ::MultiByteToWideChar(CP_UTF8, 0, _path.data(), ilen, 0, 0);
+		if (olen <= 0) return;
+
+		auto offset = _dst.size();
+		_dst.resize(offset + olen);
+		::MultiByteToWideChar(CP_UTF8, 0, _path.data(), ilen, _dst.data() + offset, olen);
+		for (auto i = offset; i < _dst.size(); ++i)
+		{
+			if (_dst.at(i) == L'/') _dst.at(i) = L'\\';
+		}
+	}
 }
@@ -2,10 +2,25 @@
 
 #include "common.hpp"
 
+#include <memory_resource>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace app {
-	std::wstring s_to_ws(const std::string& _s);
+
+	// std::stringキーのコンテナをstd::string_viewのまま引くためのハッシュ
+	struct string_hash {
+		using is_transparent = void;
+
+		size_t operator()(std::string_view _s) const noexcept
+		{
+			return std::hash<std::string_view>{}(_s);
+		}
+	};
+
+	std::wstring s_to_ws(std::string_view _s);
 	std::string ws_to_s(const std::wstring& _ws);
+	std::wstring absolute_path_to_winpath(const std::string& _path);
+	void append_winpath(std::pmr::wstring& _dst, std::string_view _path);
 }